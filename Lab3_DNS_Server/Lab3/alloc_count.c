@@ -0,0 +1,142 @@
+/*
+ * Allocation counter, loaded into a server or a proxy with LD_PRELOAD
+ *
+ * Counts the calls to malloc(), calloc(), realloc(), aligned_alloc(),
+ * memalign(), posix_memalign() and free(), passing each on to glibc, and
+ * writes the counts every ALLOC_COUNT_MS to $ALLOC_COUNT_FILE.<pid>, by
+ * default /tmp/alloc_count.<pid>. Reading the file before and after some
+ * load gives the allocations it cost; a hot path that allocates nothing
+ * leaves the counts where they were.
+ *
+ * The writer thread formats on its stack and uses write(2), so it never
+ * counts itself. A forked child starts from zero with a writer of its own.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+
+#define ALLOC_COUNT_MS 100
+#define ALLOC_COUNT_DEFAULT_FILE "/tmp/alloc_count"
+
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+
+static struct {
+	unsigned long mallocs;
+	unsigned long callocs;
+	unsigned long reallocs;
+	unsigned long aligned;
+	unsigned long frees;
+} alloc_counts;
+
+
+#define alloc_count(field) __atomic_fetch_add(&alloc_counts.field, 1, __ATOMIC_RELAXED)
+
+void *malloc(size_t size) {
+	alloc_count(mallocs);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+	alloc_count(callocs);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	alloc_count(reallocs);
+	return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+	alloc_count(aligned);
+	return __libc_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+	alloc_count(aligned);
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+	alloc_count(aligned);
+	if(alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+
+	void *ptr = __libc_memalign(alignment, size);
+	if(ptr == NULL)
+		return ENOMEM;
+	*out = ptr;
+	return 0;
+}
+
+void free(void *ptr) {
+	if(ptr != NULL)
+		alloc_count(frees);
+	__libc_free(ptr);
+}
+
+
+// Rewriting the file with the current counts, total being every call that allocates.
+// A failed write has nowhere to be reported, the next round tries again
+static bool alloc_count_write(const char *path) {
+	unsigned long mallocs = __atomic_load_n(&alloc_counts.mallocs, __ATOMIC_RELAXED);
+	unsigned long callocs = __atomic_load_n(&alloc_counts.callocs, __ATOMIC_RELAXED);
+	unsigned long reallocs = __atomic_load_n(&alloc_counts.reallocs, __ATOMIC_RELAXED);
+	unsigned long aligned = __atomic_load_n(&alloc_counts.aligned, __ATOMIC_RELAXED);
+	unsigned long frees = __atomic_load_n(&alloc_counts.frees, __ATOMIC_RELAXED);
+	char line[256];
+
+	int len = snprintf(line, sizeof line, "total %lu malloc %lu calloc %lu realloc %lu aligned %lu free %lu\n",
+		mallocs + callocs + reallocs + aligned, mallocs, callocs, reallocs, aligned, frees);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+		return false;
+	bool written = write(fd, line, len) == len;
+	close(fd);
+	return written;
+}
+
+static void *alloc_count_writer(void *args) {
+	const char *prefix = getenv("ALLOC_COUNT_FILE");
+	char path[256];
+
+	snprintf(path, sizeof path, "%s.%d", prefix != NULL ? prefix : ALLOC_COUNT_DEFAULT_FILE, (int) getpid());
+	while(1) {
+		struct timespec pause = {0, ALLOC_COUNT_MS * 1000000L};
+		nanosleep(&pause, NULL);
+		alloc_count_write(path);
+	}
+	return NULL;
+}
+
+
+static void alloc_count_start(void) {
+	pthread_t writer;
+
+	if(pthread_create(&writer, NULL, alloc_count_writer, NULL) == 0)
+		pthread_detach(writer);
+}
+
+static void alloc_count_fork_child(void) {
+	memset(&alloc_counts, 0, sizeof alloc_counts);
+	alloc_count_start();
+}
+
+__attribute__((constructor)) static void alloc_count_init(void) {
+	pthread_atfork(NULL, NULL, alloc_count_fork_child);
+	alloc_count_start();
+}
@@ -0,0 +1,142 @@
+/*
+ * Helpers shared by the bench_*.c programs
+ *
+ * A benchmark prints what it measured as [RESULT] lines, and takes its
+ * options as "--name N" pairs like the server and the proxies.
+ *
+ * Latencies go into a histogram of power of two buckets, each split into
+ * BENCH_SUB_BUCKETS linear steps, so a percentile is read to within a
+ * sixteenth of its value however many samples there are.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+
+#define BENCH_SUB_BUCKETS 16
+#define BENCH_BUCKETS (48 * BENCH_SUB_BUCKETS)
+
+
+struct bench_latency {
+	uint64_t counts[BENCH_BUCKETS];
+	uint64_t n;
+	int64_t max_ns;
+};
+
+
+static inline int64_t bench_now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+// A whole number of at least 1 given on the command line, or -1
+static inline long bench_parse_count(const char *arg) {
+	char *end;
+	long value = strtol(arg, &end, 10);
+
+	if(end == arg || *end != '\0' || value < 1)
+		return -1;
+	return value;
+}
+
+
+// Deterministic pseudo-random numbers, one state per thread
+static inline uint64_t bench_random(uint64_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+
+static inline int bench_bucket(int64_t ns) {
+	if(ns < BENCH_SUB_BUCKETS)
+		return ns < 0 ? 0 : (int) ns;
+
+	int shift = 63 - __builtin_clzll((uint64_t) ns) - 4;
+	int bucket = (shift + 1) * BENCH_SUB_BUCKETS + (int) ((ns >> shift) - BENCH_SUB_BUCKETS);
+	return bucket < BENCH_BUCKETS ? bucket : BENCH_BUCKETS - 1;
+}
+
+// Largest latency of a bucket
+static inline int64_t bench_bucket_limit(int bucket) {
+	if(bucket < BENCH_SUB_BUCKETS)
+		return bucket;
+
+	int shift = bucket / BENCH_SUB_BUCKETS - 1;
+	return ((int64_t) (BENCH_SUB_BUCKETS + bucket % BENCH_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+
+static inline void bench_latency_add(struct bench_latency *latency, int64_t ns) {
+	latency->counts[bench_bucket(ns)]++;
+	latency->n++;
+	if(ns > latency->max_ns)
+		latency->max_ns = ns;
+}
+
+static inline void bench_latency_merge(struct bench_latency *into, const struct bench_latency *from) {
+	for(int i = 0; i < BENCH_BUCKETS; i++)
+		into->counts[i] += from->counts[i];
+	into->n += from->n;
+	if(from->max_ns > into->max_ns)
+		into->max_ns = from->max_ns;
+}
+
+static inline int64_t bench_latency_quantile(const struct bench_latency *latency, double q) {
+	uint64_t rank = (uint64_t) (q * latency->n), seen = 0;
+
+	for(int i = 0; i < BENCH_BUCKETS; i++) {
+		seen += latency->counts[i];
+		if(seen > rank)
+			return bench_bucket_limit(i) < latency->max_ns ? bench_bucket_limit(i) : latency->max_ns;
+	}
+	return latency->max_ns;
+}
+
+static inline void bench_latency_print(const char *what, const struct bench_latency *latency) {
+	if(latency->n == 0) {
+		printf("[RESULT]: %s: no samples\n", what);
+		return;
+	}
+	printf("[RESULT]: %s: p50 %.1f us, p90 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n", what,
+		bench_latency_quantile(latency, 0.5) / 1e3, bench_latency_quantile(latency, 0.9) / 1e3,
+		bench_latency_quantile(latency, 0.99) / 1e3, bench_latency_quantile(latency, 0.999) / 1e3,
+		latency->max_ns / 1e3);
+}
+
+
+// A socket of type connected to host:port, with Nagle off for TCP, or -1
+static inline int bench_connect(const char *host, int port, int type) {
+	struct sockaddr_in address;
+	int nodelay = 1;
+
+	memset(&address, 0, sizeof address);
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	if(inet_pton(AF_INET, host, &address.sin_addr) != 1)
+		return -1;
+
+	int fd = socket(AF_INET, type, 0);
+	if(fd < 0)
+		return -1;
+	if(connect(fd, (struct sockaddr *) &address, sizeof address) < 0) {
+		close(fd);
+		return -1;
+	}
+	if(type == SOCK_STREAM)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
+	return fd;
+}
@@ -0,0 +1,246 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "proto.h"
+#include "cache.h"
+#include "bench.h"
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_CAPACITY 65536
+#define DEFAULT_SHARDS 64
+#define DEFAULT_KEYS 100000
+#define DEFAULT_SECONDS 2
+#define DEFAULT_SKEW 0.99
+#define SEQUENCE_LEN 1048576
+#define KEY_LEN 40
+#define TTL 300
+#define LATENCY_SAMPLE 16
+
+
+// What one thread did: every miss is answered and stored, as the proxy does with the DNS Server's answer
+struct cache_thread {
+	pthread_t id;
+	int index;
+	uint32_t *sequence;
+	uint64_t n_lookups;
+	uint64_t n_hits;
+	uint64_t n_lock_waits;
+	struct bench_latency hit_latency;
+};
+
+
+struct cache *cache;
+long n_threads = DEFAULT_THREADS;
+long capacity = DEFAULT_CAPACITY;
+long n_shards = DEFAULT_SHARDS;
+long n_keys = DEFAULT_KEYS;
+long seconds = DEFAULT_SECONDS;
+double skew = DEFAULT_SKEW;
+bool compare_locked = false;
+bool locked;
+char (*keys)[KEY_LEN];
+double *cdf;
+int64_t deadline;
+
+
+// Picking key i with a probability proportional to 1 / (i + 1)^skew, uniformly for a skew of 0
+uint32_t pickKey(uint64_t *seed) {
+	double u = (bench_random(seed) >> 11) * (1.0 / 9007199254740992.0);
+	long lo = 0, hi = n_keys - 1;
+
+	while(lo < hi) {
+		long mid = lo + (hi - lo) / 2;
+		if(cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+
+// The read path the cache had before its lookups went lock-free: the shard mutex held around the lookup,
+// counting how often it was already taken
+int lockedLookup(struct cache_thread *thread, const char *key, char *value, uint32_t *ttl) {
+	struct cache_shard *shard = cache_shard_of(cache, cache_hash(OP_QUERY_NAME, key));
+
+	if(pthread_mutex_trylock(&shard->lock) == EBUSY) {
+		thread->n_lock_waits++;
+		cache_shard_lock(cache, shard);
+	}
+	int found = cache_lookup(cache, OP_QUERY_NAME, key, value, ttl);
+	pthread_mutex_unlock(&shard->lock);
+	return found;
+}
+
+
+// Every LATENCY_SAMPLE-th lookup is timed, so reading the clock barely weighs on the throughput
+void *cacheThread(void *args) {
+	struct cache_thread *thread = (struct cache_thread *) args;
+	char value[CACHE_VALUE_MAX];
+	uint32_t ttl;
+
+	while(bench_now_ns() < deadline) {
+		for(long i = 0; i < SEQUENCE_LEN; i++) {
+			const char *key = keys[thread->sequence[i]];
+			bool timed = (i & (LATENCY_SAMPLE - 1)) == 0;
+			int64_t begin = timed ? bench_now_ns() : 0;
+
+			int found = locked ? lockedLookup(thread, key, value, &ttl) : cache_lookup(cache, OP_QUERY_NAME, key, value, &ttl);
+			if(found == CACHE_HIT) {
+				if(timed)
+					bench_latency_add(&thread->hit_latency, bench_now_ns() - begin);
+				thread->n_hits++;
+			}
+			else {
+				cache_insert(cache, OP_QUERY_NAME, key, "10.1.2.3", TTL);
+			}
+			thread->n_lookups++;
+
+			if((i & 1023) == 1023 && bench_now_ns() >= deadline)
+				break;
+		}
+	}
+	return NULL;
+}
+
+
+// One timed run of n_running threads, printing its throughput, hit latency and contention:
+// read retries for the lock-free lookups, waits for the shard mutex for the locked ones
+bool runThreads(struct cache_thread *threads, long n_running) {
+	struct cache_stats before, after;
+	struct bench_latency latency;
+	uint64_t n_lookups = 0, n_hits = 0, n_lock_waits = 0;
+
+	cache_get_stats(cache, &before);
+	int64_t begin = bench_now_ns();
+	deadline = begin + seconds * 1000000000LL;
+	for(long i = 0; i < n_running; i++) {
+		threads[i].n_lookups = threads[i].n_hits = threads[i].n_lock_waits = 0;
+		memset(&threads[i].hit_latency, 0, sizeof threads[i].hit_latency);
+		if(pthread_create(&threads[i].id, NULL, cacheThread, &threads[i]) != 0) {
+			printf("[ERROR]: Could not create thread\n");
+			return false;
+		}
+	}
+
+	memset(&latency, 0, sizeof latency);
+	for(long i = 0; i < n_running; i++) {
+		pthread_join(threads[i].id, NULL);
+		n_lookups += threads[i].n_lookups;
+		n_hits += threads[i].n_hits;
+		n_lock_waits += threads[i].n_lock_waits;
+		bench_latency_merge(&latency, &threads[i].hit_latency);
+	}
+	double elapsed = (bench_now_ns() - begin) / 1e9;
+	cache_get_stats(cache, &after);
+
+	printf("[RESULT]: %2ld thread(s), %s: %.2fM lookups/s, hit ratio %.3f, hit p50 %.0f ns, p99 %.0f ns, %.4f %s per lookup\n",
+		n_running, locked ? "locked   " : "lock-free", n_lookups / elapsed / 1e6, (double) n_hits / n_lookups,
+		(double) bench_latency_quantile(&latency, 0.5), (double) bench_latency_quantile(&latency, 0.99),
+		(double) (locked ? n_lock_waits : after.read_retries - before.read_retries) / n_lookups,
+		locked ? "lock waits" : "read retries");
+	return true;
+}
+
+
+int main(int argc, char const *argv[]) {
+	char *USAGE = "[USAGE]: <executable code> [--threads N] [--capacity N] [--shards N] [--keys N] [--seconds N] [--skew S] [--locked]\n";
+
+	for(int i = 1; i < argc; i++) {
+		long *option = NULL;
+
+		if(strcmp(argv[i], "--skew") == 0 && i + 1 < argc) {
+			char *end;
+			skew = strtod(argv[++i], &end);
+			if(end == argv[i] || *end != '\0' || skew < 0) {
+				printf("%s", USAGE);
+				return 0;
+			}
+			continue;
+		}
+		if(strcmp(argv[i], "--locked") == 0) {
+			compare_locked = true;
+			continue;
+		}
+		if(strcmp(argv[i], "--threads") == 0)
+			option = &n_threads;
+		else if(strcmp(argv[i], "--capacity") == 0)
+			option = &capacity;
+		else if(strcmp(argv[i], "--shards") == 0)
+			option = &n_shards;
+		else if(strcmp(argv[i], "--keys") == 0)
+			option = &n_keys;
+		else if(strcmp(argv[i], "--seconds") == 0)
+			option = &seconds;
+		if(option == NULL || i + 1 == argc || (*option = bench_parse_count(argv[++i])) < 0) {
+			printf("%s", USAGE);
+			return 0;
+		}
+	}
+	if((n_shards & (n_shards - 1)) != 0 || n_shards > capacity) {
+		printf("[ERROR]: --shards must be a power of two, at most the capacity\n");
+		return 0;
+	}
+
+	cache = cache_create(capacity, n_shards);
+	keys = malloc(n_keys * sizeof *keys);
+	cdf = (double *) malloc(n_keys * sizeof *cdf);
+	struct cache_thread *threads = (struct cache_thread *) calloc(n_threads, sizeof *threads);
+	if(cache == NULL || keys == NULL || cdf == NULL || threads == NULL) {
+		printf("[ERROR]: Out of memory\n");
+		return 1;
+	}
+
+	double total = 0;
+	for(long i = 0; i < n_keys; i++) {
+		snprintf(keys[i], KEY_LEN, "key%ld.bench.example", i);
+		total += 1.0 / pow(i + 1, skew);
+		cdf[i] = total;
+	}
+	for(long i = 0; i < n_keys; i++)
+		cdf[i] /= total;
+
+	// Every thread replays its own sequence of keys, drawn before the clock starts
+	for(long i = 0; i < n_threads; i++) {
+		uint64_t seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+
+		threads[i].index = i;
+		threads[i].sequence = (uint32_t *) malloc(SEQUENCE_LEN * sizeof *threads[i].sequence);
+		if(threads[i].sequence == NULL) {
+			printf("[ERROR]: Out of memory\n");
+			return 1;
+		}
+		for(long j = 0; j < SEQUENCE_LEN; j++)
+			threads[i].sequence[j] = pickKey(&seed);
+	}
+
+	// Warming the cache up with one pass of the first sequence, then running with 1, 2, 4... up to n_threads threads
+	for(long i = 0; i < SEQUENCE_LEN; i++) {
+		char value[CACHE_VALUE_MAX];
+		uint32_t ttl;
+
+		if(cache_lookup(cache, OP_QUERY_NAME, keys[threads[0].sequence[i]], value, &ttl) != CACHE_HIT)
+			cache_insert(cache, OP_QUERY_NAME, keys[threads[0].sequence[i]], "10.1.2.3", TTL);
+	}
+	printf("[RESULT]: %ld shard(s), capacity %ld, %ld keys with skew %.2f, %ld s per run\n", n_shards, capacity, n_keys,
+		skew, seconds);
+
+	for(long n_running = 1; ; n_running = n_running * 2 < n_threads ? n_running * 2 : n_threads) {
+		locked = false;
+		if(!runThreads(threads, n_running))
+			return 1;
+		locked = true;
+		if(compare_locked && !runThreads(threads, n_running))
+			return 1;
+		if(n_running == n_threads)
+			break;
+	}
+	return 0;
+}
@@ -0,0 +1,376 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "proto.h"
+#include "bench.h"
+
+#define DEFAULT_CLIENTS 64
+#define DEFAULT_ROUNDS 20
+#define DEFAULT_DELAY_MS 20
+#define DEFAULT_UPSTREAM_PORT 12099
+#define UPSTREAM_QUEUE_LEN 4096
+#define UPSTREAM_TTL 300
+#define UPSTREAM_ANSWER "10.1.2.3"
+#define PROBE_PREFIX "upstream.health"
+#define REPLY_TIMEOUT_S 5
+#define RECEIVE_BUFFER 16384
+
+
+// A query the fake DNS Server has read and answers once delay_ms have passed since
+struct delayed_reply {
+	int64_t due;
+	uint32_t request_id;
+	uint8_t opcode;
+};
+
+// One connection of the proxy to the fake DNS Server: a reader queues every query, a writer answers them in order
+struct upstream_conn {
+	int fd;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct delayed_reply queue[UPSTREAM_QUEUE_LEN];
+	int head;
+	int n_queued;
+	bool closed;
+};
+
+// One client of the proxy, sending the round's query once all of them are ready
+struct coalesce_client {
+	pthread_t id;
+	int index;
+	int fd;
+	uint64_t n_errors;
+	struct bench_latency latency;
+};
+
+
+const char *host;
+int port;
+long n_clients = DEFAULT_CLIENTS;
+long n_rounds = DEFAULT_ROUNDS;
+long delay_ms = DEFAULT_DELAY_MS;
+long upstream_port = DEFAULT_UPSTREAM_PORT;
+long n_upstream_queries = 0;
+pthread_barrier_t round_start, round_end;
+
+
+bool sendAll(int fd, const char *buf, size_t len) {
+	while(len > 0) {
+		ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent <= 0)
+			return false;
+		buf += sent;
+		len -= sent;
+	}
+	return true;
+}
+
+
+// The round's name is new to the proxy, also across runs against the same proxy
+void roundName(long round, char *name, size_t len) {
+	snprintf(name, len, "r%ld.p%d.coalesce.example", round, (int) getpid());
+}
+
+
+// Answering the queued queries as they fall due, every one with the same address
+void *upstreamWriter(void *args) {
+	struct upstream_conn *conn = (struct upstream_conn *) args;
+	char frame[MAX_FRAME_LEN];
+
+	pthread_mutex_lock(&conn->lock);
+	while(1) {
+		while(conn->n_queued == 0 && !conn->closed)
+			pthread_cond_wait(&conn->ready, &conn->lock);
+		if(conn->n_queued == 0)
+			break;
+
+		struct delayed_reply reply = conn->queue[conn->head];
+		conn->head = (conn->head + 1) % UPSTREAM_QUEUE_LEN;
+		conn->n_queued--;
+		pthread_mutex_unlock(&conn->lock);
+
+		int64_t wait = reply.due - bench_now_ns();
+		if(wait > 0)
+			usleep(wait / 1000);
+		size_t frame_len = frame_encode_answer(frame, reply.request_id, reply.opcode, UPSTREAM_TTL, UPSTREAM_ANSWER, strlen(UPSTREAM_ANSWER));
+		sendAll(conn->fd, frame, frame_len);
+		pthread_mutex_lock(&conn->lock);
+	}
+	pthread_mutex_unlock(&conn->lock);
+	return NULL;
+}
+
+
+// Reading the queries of one proxy connection, counting those that are not health probes
+void *upstreamReader(void *args) {
+	struct upstream_conn *conn = (struct upstream_conn *) args;
+	char *in = (char *) malloc(RECEIVE_BUFFER);
+	size_t in_len = 0;
+	pthread_t writer;
+
+	if(in == NULL || pthread_create(&writer, NULL, upstreamWriter, conn) != 0) {
+		printf("[ERROR]: Unable to serve a connection of the proxy\n");
+		close(conn->fd);
+		free(in);
+		free(conn);
+		return NULL;
+	}
+
+	while(1) {
+		ssize_t got = recv(conn->fd, in + in_len, RECEIVE_BUFFER - in_len, 0);
+		if(got < 0 && errno == EINTR)
+			continue;
+		if(got <= 0)
+			break;
+		in_len += got;
+
+		struct frame_header header;
+		const char *payload;
+		size_t offset = 0;
+		int parsed;
+		while((parsed = frame_parse(in, in_len, &offset, &header, &payload)) == 1) {
+			if(header.length < strlen(PROBE_PREFIX) || memcmp(payload, PROBE_PREFIX, strlen(PROBE_PREFIX)) != 0)
+				__atomic_add_fetch(&n_upstream_queries, 1, __ATOMIC_RELAXED);
+
+			pthread_mutex_lock(&conn->lock);
+			if(conn->n_queued < UPSTREAM_QUEUE_LEN) {
+				struct delayed_reply *reply = &conn->queue[(conn->head + conn->n_queued) % UPSTREAM_QUEUE_LEN];
+				reply->due = bench_now_ns() + delay_ms * 1000000LL;
+				reply->request_id = header.request_id;
+				reply->opcode = header.opcode;
+				conn->n_queued++;
+				pthread_cond_signal(&conn->ready);
+			}
+			pthread_mutex_unlock(&conn->lock);
+		}
+		if(parsed < 0)
+			break;
+		memmove(in, in + offset, in_len - offset);
+		in_len -= offset;
+	}
+
+	pthread_mutex_lock(&conn->lock);
+	conn->closed = true;
+	pthread_cond_signal(&conn->ready);
+	pthread_mutex_unlock(&conn->lock);
+	pthread_join(writer, NULL);
+	close(conn->fd);
+	free(in);
+	free(conn);
+	return NULL;
+}
+
+
+// The fake DNS Server: every connection of the proxy gets its own reader and writer
+void *upstreamAcceptor(void *args) {
+	int listen_fd = *(int *) args;
+
+	while(1) {
+		int fd = accept(listen_fd, NULL, NULL);
+		if(fd < 0) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		struct upstream_conn *conn = (struct upstream_conn *) calloc(1, sizeof *conn);
+		pthread_t reader;
+		if(conn == NULL) {
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		pthread_mutex_init(&conn->lock, NULL);
+		pthread_cond_init(&conn->ready, NULL);
+		if(pthread_create(&reader, NULL, upstreamReader, conn) != 0) {
+			close(fd);
+			free(conn);
+			continue;
+		}
+		pthread_detach(reader);
+	}
+	return NULL;
+}
+
+
+int upstreamListen(int port) {
+	struct sockaddr_in address;
+	int opt = 1;
+
+	memset(&address, 0, sizeof address);
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt);
+	if(bind(fd, (struct sockaddr *) &address, sizeof address) < 0 || listen(fd, 128) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+// Reading the one reply to the query of the round
+bool receiveReply(int fd, struct frame_header *header) {
+	char in[MAX_FRAME_LEN];
+	size_t in_len = 0;
+
+	while(1) {
+		const char *payload;
+		size_t offset = 0;
+		int parsed = frame_parse(in, in_len, &offset, header, &payload);
+		if(parsed != 0)
+			return parsed == 1;
+
+		ssize_t got = recv(fd, in + in_len, sizeof in - in_len, 0);
+		if(got < 0 && errno == EINTR)
+			continue;
+		if(got <= 0)
+			return false;
+		in_len += got;
+	}
+}
+
+
+// Every round all clients ask at once for the same name, which the proxy has never seen
+void *clientThread(void *args) {
+	struct coalesce_client *client = (struct coalesce_client *) args;
+	char name[64], frame[MAX_FRAME_LEN];
+
+	for(long round = 0; round < n_rounds; round++) {
+		struct frame_header header;
+
+		roundName(round, name, sizeof name);
+		size_t frame_len = frame_encode(frame, round, OP_QUERY_NAME, 0, name, strlen(name));
+		pthread_barrier_wait(&round_start);
+
+		int64_t sent_at = bench_now_ns();
+		if(client->fd < 0 || !sendAll(client->fd, frame, frame_len) || !receiveReply(client->fd, &header)
+			|| header.request_id != (uint32_t) round || frame_status(header.flags) != STATUS_FOUND) {
+			client->n_errors++;
+		}
+		else {
+			bench_latency_add(&client->latency, bench_now_ns() - sent_at);
+		}
+		pthread_barrier_wait(&round_end);
+	}
+	return NULL;
+}
+
+
+int main(int argc, char const *argv[]) {
+	char *USAGE = "[USAGE]: <executable code> <Proxy IP Address> <Proxy Port number> [--upstream-port N] [--clients N] [--rounds N] [--delay-ms N]\n";
+
+	if(argc < 3) {
+		printf("%s", USAGE);
+		return 0;
+	}
+	for(int i = 3; i < argc; i++) {
+		long *option = NULL;
+
+		if(strcmp(argv[i], "--upstream-port") == 0)
+			option = &upstream_port;
+		else if(strcmp(argv[i], "--clients") == 0)
+			option = &n_clients;
+		else if(strcmp(argv[i], "--rounds") == 0)
+			option = &n_rounds;
+		else if(strcmp(argv[i], "--delay-ms") == 0)
+			option = &delay_ms;
+		if(option == NULL || i + 1 == argc || (*option = bench_parse_count(argv[++i])) < 0) {
+			printf("%s", USAGE);
+			return 0;
+		}
+	}
+	host = argv[1];
+	port = atoi(argv[2]);
+
+	int listen_fd = upstreamListen(upstream_port);
+	pthread_t acceptor;
+	if(listen_fd < 0 || pthread_create(&acceptor, NULL, upstreamAcceptor, &listen_fd) != 0) {
+		printf("[ERROR]: Unable to listen on 127.0.0.1:%ld for the proxy\n", upstream_port);
+		return 1;
+	}
+	pthread_detach(acceptor);
+	printf("[PROGRESS]: Answering the proxy on 127.0.0.1:%ld after %ld ms, start it with --upstream 127.0.0.1:%ld\n",
+		upstream_port, delay_ms, upstream_port);
+
+	struct coalesce_client *clients = (struct coalesce_client *) calloc(n_clients, sizeof *clients);
+	long *per_round = (long *) calloc(n_rounds, sizeof *per_round);
+	struct timeval timeout = {REPLY_TIMEOUT_S, 0};
+	if(clients == NULL || per_round == NULL) {
+		printf("[ERROR]: Out of memory\n");
+		return 1;
+	}
+
+	// Waiting for the proxy to come up, without sending it anything
+	int64_t give_up = bench_now_ns() + 10 * 1000000000LL;
+	int probe_fd;
+	while((probe_fd = bench_connect(host, port, SOCK_STREAM)) < 0 && bench_now_ns() < give_up)
+		usleep(100000);
+	if(probe_fd < 0) {
+		printf("[ERROR]: Unable to connect to %s:%d\n", host, port);
+		return 1;
+	}
+	close(probe_fd);
+
+	pthread_barrier_init(&round_start, NULL, n_clients + 1);
+	pthread_barrier_init(&round_end, NULL, n_clients + 1);
+	for(long i = 0; i < n_clients; i++) {
+		clients[i].index = i;
+		clients[i].fd = bench_connect(host, port, SOCK_STREAM);
+		if(clients[i].fd >= 0)
+			setsockopt(clients[i].fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+		if(pthread_create(&clients[i].id, NULL, clientThread, &clients[i]) != 0) {
+			printf("[ERROR]: Could not create thread\n");
+			return 1;
+		}
+	}
+
+	// Every reply of a round comes after the query it answers, so the count is complete at the end of the round
+	int64_t begin = bench_now_ns();
+	for(long round = 0; round < n_rounds; round++) {
+		long before = __atomic_load_n(&n_upstream_queries, __ATOMIC_RELAXED);
+
+		pthread_barrier_wait(&round_start);
+		pthread_barrier_wait(&round_end);
+		per_round[round] = __atomic_load_n(&n_upstream_queries, __ATOMIC_RELAXED) - before;
+	}
+	double elapsed = (bench_now_ns() - begin) / 1e9;
+
+	struct bench_latency latency;
+	uint64_t n_errors = 0;
+	long fewest = per_round[0], most = per_round[0], total = 0;
+	memset(&latency, 0, sizeof latency);
+	for(long i = 0; i < n_clients; i++) {
+		pthread_join(clients[i].id, NULL);
+		bench_latency_merge(&latency, &clients[i].latency);
+		n_errors += clients[i].n_errors;
+		if(clients[i].fd >= 0)
+			close(clients[i].fd);
+	}
+	for(long round = 0; round < n_rounds; round++) {
+		total += per_round[round];
+		fewest = per_round[round] < fewest ? per_round[round] : fewest;
+		most = per_round[round] > most ? per_round[round] : most;
+	}
+
+	printf("[RESULT]: %ld rounds of %ld clients asking at once for a new name, answered upstream after %ld ms, in %.2f s\n",
+		n_rounds, n_clients, delay_ms, elapsed);
+	printf("[RESULT]: Upstream queries per round: %.2f on average, %ld to %ld, for %ld client queries (%llu failed)\n",
+		(double) total / n_rounds, fewest, most, n_clients, (unsigned long long) n_errors);
+	bench_latency_print("Client latency", &latency);
+	return 0;
+}
@@ -0,0 +1,434 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "proto.h"
+#include "bench.h"
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_WINDOW 32
+#define DEFAULT_SECONDS 5
+#define DEFAULT_QUERY "www.google1.com"
+#define MAX_WINDOW 4096
+#define REPLY_TIMEOUT_S 5
+#define RECEIVE_BUFFER 65536
+#define DATAGRAM_LOSS_MS 1000
+#define DATAGRAM_POLL_MS 10
+
+
+// One connection's worth of load and what came back on it
+struct load_thread {
+	pthread_t id;
+	int index;
+	uint64_t n_found;
+	uint64_t n_not_found;
+	uint64_t n_errors;
+	uint64_t n_connections;
+	uint64_t n_lost;
+	bool failed;
+	struct bench_latency latency;
+	struct bench_latency first_reply;
+};
+
+
+const char *host;
+int port;
+long n_threads = DEFAULT_THREADS;
+long window = DEFAULT_WINDOW;
+long seconds = DEFAULT_SECONDS;
+long n_idle = 0;
+long reconnect = 0;
+bool use_udp = false;
+char **queries;
+size_t n_queries;
+int64_t deadline;
+
+
+// Loading the queries: one domain name or IP address per line, blanks around it trimmed and blank lines skipped
+char **loadQueries(const char *path, size_t *n_loaded) {
+	FILE *fp = fopen(path, "r");
+	char *line = NULL;
+	size_t len = 0, capacity = 1024;
+	char **loaded = (char **) malloc(capacity * sizeof *loaded);
+
+	*n_loaded = 0;
+	if(fp == NULL || loaded == NULL) {
+		if(fp != NULL)
+			fclose(fp);
+		free(loaded);
+		return NULL;
+	}
+	while(getline(&line, &len, fp) != -1) {
+		char *query = line + strspn(line, " \t\r\n");
+		size_t query_len = strcspn(query, " \t\r\n");
+
+		if(query_len == 0 || query_len > MAX_FRAME_BODY)
+			continue;
+		if(*n_loaded == capacity) {
+			capacity *= 2;
+			loaded = (char **) realloc(loaded, capacity * sizeof *loaded);
+		}
+		loaded[(*n_loaded)++] = strndup(query, query_len);
+	}
+	free(line);
+	fclose(fp);
+	return loaded;
+}
+
+
+// An IPv4 address is looked up in reverse, anything else as a domain name
+int queryOpcode(const char *query) {
+	struct in_addr addr;
+
+	return inet_pton(AF_INET, query, &addr) == 1 ? OP_QUERY_ADDR : OP_QUERY_NAME;
+}
+
+
+bool sendAll(int fd, const char *buf, size_t len) {
+	while(len > 0) {
+		ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent <= 0)
+			return false;
+		buf += sent;
+		len -= sent;
+	}
+	return true;
+}
+
+
+// Counting a reply by the status it carries
+void countReply(struct load_thread *thread, const struct frame_header *header) {
+	if(!(header->flags & FLAG_REPLY) || frame_status(header->flags) < 0)
+		thread->n_errors++;
+	else if(frame_status(header->flags) == STATUS_NOT_FOUND)
+		thread->n_not_found++;
+	else
+		thread->n_found++;
+}
+
+
+// Keeping window queries in flight on one connection until the deadline, then collecting the last replies.
+// A request id is a slot of the window in its low bits, so replies are matched in whatever order they come.
+// With --reconnect the connection is closed once it has answered that many queries, and a new one opened
+void *loadThread(void *args) {
+	struct load_thread *thread = (struct load_thread *) args;
+	int64_t *sent_at = (int64_t *) malloc(window * sizeof *sent_at);
+	int *free_slots = (int *) malloc(window * sizeof *free_slots);
+	char *out = (char *) malloc(window * MAX_FRAME_LEN);
+	char *in = (char *) malloc(RECEIVE_BUFFER);
+	size_t in_len = 0, next_query = thread->index;
+	uint32_t sequence = 0;
+	long n_free = window, n_sent = 0;
+	struct timeval timeout = {REPLY_TIMEOUT_S, 0};
+	bool first_reply = true;
+
+	// A connection's first reply is timed from before connect(), so it includes the accept and the worker picking it up
+	int64_t connected_at = bench_now_ns();
+	int fd = bench_connect(host, port, SOCK_STREAM);
+	if(fd < 0 || sent_at == NULL || free_slots == NULL || out == NULL || in == NULL) {
+		printf("[ERROR]: Unable to connect to %s:%d\n", host, port);
+		thread->failed = true;
+		if(fd >= 0)
+			close(fd);
+		free(sent_at);
+		free(free_slots);
+		free(out);
+		free(in);
+		return NULL;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+	thread->n_connections = 1;
+	for(long i = 0; i < window; i++)
+		free_slots[i] = i;
+
+	while(1) {
+		int64_t now = bench_now_ns();
+		size_t out_len = 0;
+
+		if(reconnect > 0 && n_sent == reconnect && n_free == window && now < deadline) {
+			close(fd);
+			connected_at = now;
+			fd = bench_connect(host, port, SOCK_STREAM);
+			if(fd < 0) {
+				printf("[ERROR]: Unable to connect to %s:%d\n", host, port);
+				thread->failed = true;
+				break;
+			}
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+			thread->n_connections++;
+			n_sent = 0;
+			in_len = 0;
+			first_reply = true;
+		}
+
+		// Topping up the window, in one send
+		while(now < deadline && n_free > 0 && (reconnect == 0 || n_sent < reconnect)) {
+			const char *query = queries[next_query++ % n_queries];
+			int slot = free_slots[--n_free];
+
+			sent_at[slot] = now;
+			n_sent++;
+			out_len += frame_encode(out + out_len, (sequence++ << 12) | slot, queryOpcode(query), 0, query, strlen(query));
+		}
+		if(out_len > 0 && !sendAll(fd, out, out_len))
+			break;
+		if(n_free == window)
+			break;
+
+		ssize_t got = recv(fd, in + in_len, RECEIVE_BUFFER - in_len, 0);
+		if(got < 0 && errno == EINTR)
+			continue;
+		if(got <= 0)
+			break;
+		in_len += got;
+		now = bench_now_ns();
+
+		struct frame_header header;
+		const char *payload;
+		size_t offset = 0;
+		int parsed;
+		while((parsed = frame_parse(in, in_len, &offset, &header, &payload)) == 1) {
+			int slot = header.request_id & (MAX_WINDOW - 1);
+			if(slot >= window)
+				continue;
+
+			bench_latency_add(&thread->latency, now - sent_at[slot]);
+			if(first_reply) {
+				bench_latency_add(&thread->first_reply, now - connected_at);
+				first_reply = false;
+			}
+			free_slots[n_free++] = slot;
+			countReply(thread, &header);
+		}
+		if(parsed < 0)
+			break;
+		memmove(in, in + offset, in_len - offset);
+		in_len -= offset;
+	}
+
+	// Whatever is still in flight was lost with the connection
+	if(n_free < window) {
+		printf("[ERROR]: Connection %d lost with %ld queries in flight\n", thread->index, window - n_free);
+		thread->n_errors += window - n_free;
+		thread->failed = true;
+	}
+	if(fd >= 0)
+		close(fd);
+	free(sent_at);
+	free(free_slots);
+	free(out);
+	free(in);
+	return NULL;
+}
+
+
+// The same load as datagrams on one UDP socket. A query whose reply has not come within DATAGRAM_LOSS_MS
+// is counted lost and its slot given to the next one, and a reply that comes after that is ignored
+void *datagramThread(void *args) {
+	struct load_thread *thread = (struct load_thread *) args;
+	int64_t *sent_at = (int64_t *) malloc(window * sizeof *sent_at);
+	uint32_t *slot_ids = (uint32_t *) malloc(window * sizeof *slot_ids);
+	bool *in_flight = (bool *) calloc(window, sizeof *in_flight);
+	int *free_slots = (int *) malloc(window * sizeof *free_slots);
+	size_t next_query = thread->index;
+	uint32_t sequence = 0;
+	long n_free = window;
+	int64_t last_expiry = bench_now_ns();
+	struct timeval timeout = {0, DATAGRAM_POLL_MS * 1000};
+
+	int fd = bench_connect(host, port, SOCK_DGRAM);
+	if(fd < 0 || sent_at == NULL || slot_ids == NULL || in_flight == NULL || free_slots == NULL) {
+		printf("[ERROR]: Unable to open a datagram socket to %s:%d\n", host, port);
+		thread->failed = true;
+		if(fd >= 0)
+			close(fd);
+		free(sent_at);
+		free(slot_ids);
+		free(in_flight);
+		free(free_slots);
+		return NULL;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+	for(long i = 0; i < window; i++)
+		free_slots[i] = i;
+
+	while(1) {
+		int64_t now = bench_now_ns();
+		char buf[MAX_FRAME_LEN];
+
+		while(now < deadline && n_free > 0) {
+			const char *query = queries[next_query++ % n_queries];
+			int slot = free_slots[--n_free];
+
+			slot_ids[slot] = (sequence++ << 12) | slot;
+			sent_at[slot] = now;
+			in_flight[slot] = true;
+			size_t frame_len = frame_encode(buf, slot_ids[slot], queryOpcode(query), 0, query, strlen(query));
+			if(send(fd, buf, frame_len, 0) < 0)
+				thread->n_errors++;
+		}
+		if(n_free == window)
+			break;
+
+		// Giving up on the datagrams that went unanswered for too long
+		if(now - last_expiry >= DATAGRAM_POLL_MS * 1000000LL) {
+			last_expiry = now;
+			for(long slot = 0; slot < window; slot++) {
+				if(in_flight[slot] && now - sent_at[slot] >= DATAGRAM_LOSS_MS * 1000000LL) {
+					in_flight[slot] = false;
+					free_slots[n_free++] = slot;
+					thread->n_lost++;
+				}
+			}
+		}
+
+		ssize_t got = recv(fd, buf, sizeof buf, 0);
+		if(got <= 0)
+			continue;
+
+		struct frame_header header;
+		const char *payload;
+		size_t offset = 0;
+		if(frame_parse(buf, got, &offset, &header, &payload) != 1)
+			continue;
+		int slot = header.request_id & (MAX_WINDOW - 1);
+		if(slot >= window || !in_flight[slot] || slot_ids[slot] != header.request_id)
+			continue;
+
+		bench_latency_add(&thread->latency, bench_now_ns() - sent_at[slot]);
+		in_flight[slot] = false;
+		free_slots[n_free++] = slot;
+		countReply(thread, &header);
+	}
+
+	close(fd);
+	free(sent_at);
+	free(slot_ids);
+	free(in_flight);
+	free(free_slots);
+	return NULL;
+}
+
+
+int main(int argc, char const *argv[]) {
+	char *USAGE = "[USAGE]: <executable code> <Server IP Address> <Server Port number> [--threads N] [--window N] [--seconds N] [--queries FILE] [--idle N] [--reconnect N] [--udp]\n";
+	const char *queries_path = NULL;
+	static char *default_queries[] = {DEFAULT_QUERY};
+
+	if(argc < 3) {
+		printf("%s", USAGE);
+		return 0;
+	}
+	host = argv[1];
+	port = atoi(argv[2]);
+	for(int i = 3; i < argc; i++) {
+		long *option = NULL;
+
+		if(strcmp(argv[i], "--queries") == 0 && i + 1 < argc) {
+			queries_path = argv[++i];
+			continue;
+		}
+		if(strcmp(argv[i], "--udp") == 0) {
+			use_udp = true;
+			continue;
+		}
+		if(strcmp(argv[i], "--threads") == 0)
+			option = &n_threads;
+		else if(strcmp(argv[i], "--window") == 0)
+			option = &window;
+		else if(strcmp(argv[i], "--seconds") == 0)
+			option = &seconds;
+		else if(strcmp(argv[i], "--idle") == 0)
+			option = &n_idle;
+		else if(strcmp(argv[i], "--reconnect") == 0)
+			option = &reconnect;
+		if(option == NULL || i + 1 == argc || (*option = bench_parse_count(argv[++i])) < 0) {
+			printf("%s", USAGE);
+			return 0;
+		}
+	}
+	if(window > MAX_WINDOW) {
+		printf("[ERROR]: The window is at most %d queries\n", MAX_WINDOW);
+		return 0;
+	}
+	if(use_udp && (n_idle > 0 || reconnect > 0)) {
+		printf("[ERROR]: --idle and --reconnect are about TCP connections\n");
+		return 0;
+	}
+
+	queries = default_queries;
+	n_queries = 1;
+	if(queries_path != NULL) {
+		queries = loadQueries(queries_path, &n_queries);
+		if(queries == NULL || n_queries == 0) {
+			printf("[ERROR]: No queries in %s\n", queries_path);
+			return 1;
+		}
+	}
+
+	// Connections that send half a request and then nothing, which must not hold up the others
+	for(long i = 0; i < n_idle; i++) {
+		char header[FRAME_HEADER_LEN];
+		int fd = bench_connect(host, port, SOCK_STREAM);
+
+		frame_encode_header(header, 0, OP_QUERY_NAME, 0, strlen(DEFAULT_QUERY));
+		if(fd < 0 || !sendAll(fd, header, FRAME_HEADER_LEN / 2)) {
+			printf("[ERROR]: Unable to open idle connection %ld\n", i);
+			return 1;
+		}
+	}
+
+	struct load_thread *threads = (struct load_thread *) calloc(n_threads, sizeof *threads);
+	struct bench_latency *latency = (struct bench_latency *) calloc(1, sizeof *latency);
+	struct bench_latency *first_reply = (struct bench_latency *) calloc(1, sizeof *first_reply);
+	if(threads == NULL || latency == NULL || first_reply == NULL) {
+		printf("[ERROR]: Out of memory\n");
+		return 1;
+	}
+	uint64_t n_found = 0, n_not_found = 0, n_errors = 0, n_connections = 0, n_lost = 0;
+	bool failed = false;
+
+	int64_t begin = bench_now_ns();
+	deadline = begin + seconds * 1000000000LL;
+	for(long i = 0; i < n_threads; i++) {
+		threads[i].index = i;
+		if(pthread_create(&threads[i].id, NULL, use_udp ? datagramThread : loadThread, &threads[i]) != 0) {
+			printf("[ERROR]: Could not create thread\n");
+			return 1;
+		}
+	}
+	for(long i = 0; i < n_threads; i++) {
+		pthread_join(threads[i].id, NULL);
+		n_found += threads[i].n_found;
+		n_not_found += threads[i].n_not_found;
+		n_errors += threads[i].n_errors;
+		n_connections += threads[i].n_connections;
+		n_lost += threads[i].n_lost;
+		failed |= threads[i].failed;
+		bench_latency_merge(latency, &threads[i].latency);
+		bench_latency_merge(first_reply, &threads[i].first_reply);
+	}
+	double elapsed = (bench_now_ns() - begin) / 1e9;
+
+	printf("[RESULT]: %ld connection(s), window %ld, %ld idle: %llu replies in %.2f s, %.0f queries/s\n",
+		n_threads, window, n_idle, (unsigned long long) latency->n, elapsed, latency->n / elapsed);
+	printf("[RESULT]: Found %llu, not found %llu, errors %llu\n", (unsigned long long) n_found,
+		(unsigned long long) n_not_found, (unsigned long long) n_errors);
+	if(use_udp)
+		printf("[RESULT]: Lost %llu datagrams, no reply within %d ms\n", (unsigned long long) n_lost, DATAGRAM_LOSS_MS);
+	if(reconnect > 0)
+		printf("[RESULT]: %llu connections of %ld queries, %.0f connections/s\n", (unsigned long long) n_connections,
+			reconnect, n_connections / elapsed);
+	bench_latency_print("Latency", latency);
+	if(reconnect > 0)
+		bench_latency_print("First reply after connect", first_reply);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,120 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "logger.h"
+#include "bench.h"
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_RECORDS 1000000
+#define DEFAULT_OUTPUT "/dev/null"
+
+
+// The ways a request can log: the printf calls the servers made before the logger,
+// and a debug record through the logger at level debug, where it is written, and at level info, where it is not
+#define MODE_PRINTF 0
+#define MODE_RING 1
+#define MODE_DISABLED 2
+
+
+long n_threads = DEFAULT_THREADS;
+long n_records = DEFAULT_RECORDS;
+int mode;
+
+
+// What a proxy logs for a query, with as many arguments
+void *logThread(void *args) {
+	long index = (long) args;
+	long per_thread = n_records / n_threads;
+
+	for(long i = 0; i < per_thread; i++) {
+		if(mode == MODE_PRINTF)
+			printf("[REQUESTED FOR]: host%ld.bench.example by client %ld, query %ld\n", i & 1023, index, i);
+		else
+			log_debug("[REQUESTED FOR]: host%ld.bench.example by client %ld, query %ld\n", i & 1023, index, i);
+	}
+	return NULL;
+}
+
+
+// Records per second of n_threads threads logging in the given mode, everything written out included
+double runMode(int run_mode) {
+	pthread_t *threads = (pthread_t *) calloc(n_threads, sizeof *threads);
+	if(threads == NULL)
+		return -1;
+
+	mode = run_mode;
+	log_level = run_mode == MODE_DISABLED ? LOG_INFO : LOG_DEBUG;
+	int64_t begin = bench_now_ns();
+	for(long i = 0; i < n_threads; i++)
+		pthread_create(&threads[i], NULL, logThread, (void *) i);
+	for(long i = 0; i < n_threads; i++)
+		pthread_join(threads[i], NULL);
+	log_drain();
+	fflush(stdout);
+	int64_t elapsed = bench_now_ns() - begin;
+
+	free(threads);
+	return (n_records / n_threads) * n_threads / (elapsed / 1e9);
+}
+
+
+int main(int argc, char const *argv[]) {
+	char *USAGE = "[USAGE]: <executable code> [--threads N] [--records N] [--output FILE]\n";
+	const char *output = DEFAULT_OUTPUT;
+	const char *names[] = {"printf", "log_debug at level debug", "log_debug at level info"};
+	double rates[3];
+
+	for(int i = 1; i < argc; i++) {
+		long *option = NULL;
+
+		if(strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			output = argv[++i];
+			continue;
+		}
+		if(strcmp(argv[i], "--threads") == 0)
+			option = &n_threads;
+		else if(strcmp(argv[i], "--records") == 0)
+			option = &n_records;
+		if(option == NULL || i + 1 == argc || (*option = bench_parse_count(argv[++i])) < 0) {
+			printf("%s", USAGE);
+			return 0;
+		}
+	}
+	if(n_records < n_threads) {
+		printf("[ERROR]: At least one record per thread\n");
+		return 0;
+	}
+	log_init(LOG_DEBUG);
+
+	// The records go to output, the results to the real stdout once every record is out
+	fflush(stdout);
+	int saved_stdout = dup(STDOUT_FILENO);
+	int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(saved_stdout < 0 || fd < 0) {
+		printf("[ERROR]: Unable to write the records to %s\n", output);
+		return 1;
+	}
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+	for(int run_mode = MODE_PRINTF; run_mode <= MODE_DISABLED; run_mode++)
+		rates[run_mode] = runMode(run_mode);
+	fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+
+	printf("[RESULT]: %ld thread(s) logging %ld records to %s\n", n_threads, n_records, output);
+	for(int run_mode = MODE_PRINTF; run_mode <= MODE_DISABLED; run_mode++) {
+		if(rates[run_mode] < 0) {
+			printf("[ERROR]: Out of memory\n");
+			return 1;
+		}
+		printf("[RESULT]: %s: %.2fM records/s, %.1f ns per record\n", names[run_mode], rates[run_mode] / 1e6,
+			1e9 / rates[run_mode]);
+	}
+	return 0;
+}
@@ -0,0 +1,169 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "dbformat.h"
+#include "bench.h"
+
+#define DEFAULT_RECORDS 100000
+#define DEFAULT_QUERIES 1000000
+#define DEFAULT_SCANS 200
+#define MAX_KEYS 1048576
+#define MISS_PERCENT 10
+
+
+// The name and address of record number i, every address distinct
+void recordName(long i, char *name, size_t len) {
+	snprintf(name, len, "host%ld.bench.example", i);
+}
+
+uint32_t recordAddress(long i) {
+	return (10u << 24) + (uint32_t) i + 1;
+}
+
+
+// Writing a database.txt of n_records lines, in no particular order
+bool writeDatabase(const char *path, long n_records) {
+	FILE *fp = fopen(path, "w");
+	if(fp == NULL)
+		return false;
+
+	for(long i = 0; i < n_records; i++) {
+		char name[64];
+		uint32_t ip = recordAddress(i);
+
+		recordName(i, name, sizeof name);
+		fprintf(fp, "%s %u.%u.%u.%u\n", name, ip >> 24, (ip >> 16) & 255, (ip >> 8) & 255, ip & 255);
+	}
+	return fclose(fp) == 0;
+}
+
+
+// The lookup of the server before it indexed the database: reading database.txt from the start for every query
+bool scanDatabase(const char *path, const char *request, char *answer) {
+	FILE *fp = fopen(path, "r");
+	char *line = NULL;
+	size_t len = 0;
+	bool found = false;
+
+	if(fp == NULL)
+		return false;
+	while(getline(&line, &len, fp) != -1) {
+		char *exists = strstr(line, request);
+
+		if(exists == line && dbf_is_blank(line[strlen(request)])) {
+			strcpy(answer, line + strlen(request) + 1);
+			found = true;
+			break;
+		}
+	}
+	free(line);
+	fclose(fp);
+	return found;
+}
+
+
+int main(int argc, char const *argv[]) {
+	char *USAGE = "[USAGE]: <executable code> [--records N] [--queries N] [--scans N]\n";
+	long n_records = DEFAULT_RECORDS;
+	long n_queries = DEFAULT_QUERIES;
+	long n_scans = DEFAULT_SCANS;
+
+	for(int i = 1; i < argc; i++) {
+		long *option = NULL;
+
+		if(strcmp(argv[i], "--records") == 0)
+			option = &n_records;
+		else if(strcmp(argv[i], "--queries") == 0)
+			option = &n_queries;
+		else if(strcmp(argv[i], "--scans") == 0)
+			option = &n_scans;
+		if(option == NULL || i + 1 == argc || (*option = bench_parse_count(argv[++i])) < 0) {
+			printf("%s", USAGE);
+			return 0;
+		}
+	}
+	if(n_records >= (1L << 24)) {
+		printf("[ERROR]: At most %ld records, one per address of 10.0.0.0/8\n", (1L << 24) - 1);
+		return 1;
+	}
+
+	char txt_path[64], bin_path[64];
+	snprintf(txt_path, sizeof txt_path, "/tmp/bench_lookup.%d.txt", (int) getpid());
+	snprintf(bin_path, sizeof bin_path, "/tmp/bench_lookup.%d.bin", (int) getpid());
+	if(!writeDatabase(txt_path, n_records)) {
+		printf("[ERROR]: Unable to write %s\n", txt_path);
+		return 1;
+	}
+
+	// Loading the way the server does at startup: compiling database.txt, then mapping the result
+	struct dbf_file db;
+	int64_t begin = bench_now_ns();
+	long n_compiled = dbf_compile(txt_path, bin_path);
+	int64_t compiled = bench_now_ns();
+	if(n_compiled < 0 || dbf_open(bin_path, &db) < 0) {
+		printf("[ERROR]: Unable to compile and open %s\n", bin_path);
+		unlink(txt_path);
+		unlink(bin_path);
+		return 1;
+	}
+	int64_t opened = bench_now_ns();
+	printf("[RESULT]: Compiled %ld records in %.1f ms, mapped them in %.3f ms\n", n_compiled,
+		(compiled - begin) / 1e6, (opened - compiled) / 1e6);
+
+	// The queries are made up ahead, half by name and half by address, MISS_PERCENT of them for missing records
+	long n_keys = n_queries < MAX_KEYS ? n_queries : MAX_KEYS;
+	char (*names)[64] = malloc(n_keys * sizeof *names);
+	uint32_t *ips = malloc(n_keys * sizeof *ips);
+	uint64_t seed = 88172645463325252ULL;
+	if(names == NULL || ips == NULL) {
+		printf("[ERROR]: Out of memory\n");
+		return 1;
+	}
+	for(long i = 0; i < n_keys; i++) {
+		long record = bench_random(&seed) % n_records;
+		bool miss = bench_random(&seed) % 100 < MISS_PERCENT;
+
+		recordName(miss ? record + n_records : record, names[i], sizeof names[i]);
+		ips[i] = miss ? recordAddress(record + n_records) : recordAddress(record);
+	}
+
+	long n_found = 0;
+	begin = bench_now_ns();
+	for(long i = 0; i < n_queries; i++) {
+		uint32_t ip, ttl;
+		long key = i % n_keys;
+
+		if(i & 1)
+			n_found += dbf_find_ip(&db, ips[key], &ttl) != NULL;
+		else
+			n_found += dbf_find_name(&db, names[key], &ip, &ttl);
+	}
+	int64_t index_ns = bench_now_ns() - begin;
+	printf("[RESULT]: Index: %ld lookups (%ld found) in %.1f ms, %.0f ns per lookup\n", n_queries, n_found,
+		index_ns / 1e6, (double) index_ns / n_queries);
+
+	// The text scan only by name, reading half the file on average for a record that is there
+	char answer[DBF_MAX_FIELD + 32];
+	n_found = 0;
+	begin = bench_now_ns();
+	for(long i = 0; i < n_scans; i++) {
+		char name[64];
+
+		recordName(bench_random(&seed) % n_records, name, sizeof name);
+		n_found += scanDatabase(txt_path, name, answer);
+	}
+	int64_t scan_ns = bench_now_ns() - begin;
+	printf("[RESULT]: Text scan: %ld lookups (%ld found) in %.1f ms, %.1f us per lookup\n", n_scans, n_found,
+		scan_ns / 1e6, scan_ns / 1e3 / n_scans);
+	printf("[RESULT]: The index answers %.0f times faster\n", ((double) scan_ns / n_scans) / ((double) index_ns / n_queries));
+
+	free(names);
+	free(ips);
+	dbf_close(&db);
+	unlink(txt_path);
+	unlink(bin_path);
+	return 0;
+}
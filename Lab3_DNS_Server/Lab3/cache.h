@@ -0,0 +1,950 @@
+/*
+ * Record cache of the proxies
+ *
+ * The cache maps (type of query, domain name or IP address) to the answer.
+ * It is split into lock-striped shards, picked by the high bits of the key
+ * hash, so that threads working on different keys rarely meet on a lock.
+ * Each shard owns a fixed pool of entries, an open-addressing index over
+ * them (linear probing, backward-shift deletion) and two CLOCK hands: a
+ * hit sets the entry's referenced bit, and eviction sweeps a hand past
+ * referenced entries, clearing their bit, until it finds one that was not
+ * used since the last sweep.
+ *
+ * Eviction follows W-TinyLFU. The first CACHE_WINDOW_PERCENT of a shard's
+ * entries are a window that takes every new record. Once the shard is full,
+ * the window's CLOCK victim only moves on to the main part of the shard if
+ * the sketch below counts more recent lookups for it than for the main
+ * part's CLOCK victim, and is dropped otherwise. A scan of names that are
+ * looked up once churns through the window and leaves the hot records of
+ * the main part alone.
+ *
+ * Every record carries an expiry time in seconds of CLOCK_MONOTONIC, which
+ * reads the same in every process. Expiry is lazy: a lookup treats an
+ * expired record as a miss and the CLOCK hand takes it before any live one.
+ * cache_sweep(), run periodically by the proxies, looks at a bounded number
+ * of entries per shard and call, and moves the expired ones it finds to the
+ * shard's free list. Negative records remember that a name or address is
+ * not in the database, without an answer.
+ *
+ * Lookups take no lock: every shard carries a sequence count that writers
+ * make odd for the length of a change and even again afterwards, under the
+ * shard mutex. A reader probes and copies the answer optimistically, then
+ * checks that the count was even and did not move, retrying otherwise;
+ * cache_get_stats() counts the retries, a measure of readers meeting writers.
+ * Entries are never freed, only overwritten in place, so a reader racing
+ * an eviction sees a stale or torn copy that the count check discards but
+ * never dereferences freed memory. Keys and values are moved a word at a
+ * time with relaxed atomics, zero-padded to the word that ends them, so the
+ * readers' copies race nothing and stay within the fixed arrays.
+ *
+ * The whole cache lives in one contiguous region addressed by offsets, so
+ * it can sit in a shared memory segment mapped by forked workers. There the
+ * shard mutexes are process-shared and robust: a worker that dies mid-write
+ * leaves its shard's count odd, and the next process to take the lock empties
+ * that shard rather than trusting a half-written index.
+ *
+ * Every lookup is counted in a count-min sketch over the key hashes:
+ * four rows of saturating counters, updated conservatively and halved once
+ * the cache has seen ten lookups per entry, so that the estimates follow
+ * what is popular now. Besides admission, cache_scan_hot() hands the proxies the frequently
+ * looked up records that are about to expire, to be refreshed before they
+ * do; records refreshed that way count a prefetch hit on their first hit.
+ *
+ * cache_save() writes the live records with the seconds they have left to a
+ * snapshot file, reading them the way lookups do, so no writer waits on it.
+ * cache_load() maps a snapshot and inserts what has not expired since, for a
+ * restarted proxy to begin with a warm cache.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#define CACHE_KEY_MAX 256
+#define CACHE_VALUE_MAX 256
+#define CACHE_SWEEP_BUDGET 4096
+#define CACHE_WINDOW_PERCENT 1
+#define CACHE_SKETCH_ROWS 4
+#define CACHE_SKETCH_WIDTH 4
+#define CACHE_SKETCH_MAX 15
+#define CACHE_SKETCH_AGING 10
+#define CACHE_HOT_FREQUENCY 4
+#define CACHE_SNAPSHOT_MAGIC 0x434e5344u
+#define CACHE_SNAPSHOT_VERSION 1
+
+// Outcomes of cache_lookup()
+#define CACHE_MISS 0
+#define CACHE_HIT 1
+#define CACHE_NEGATIVE 2
+
+
+struct cache_entry {
+	uint32_t hash;
+	uint32_t expires;
+	uint32_t next_free;
+	uint8_t type;
+	uint8_t referenced;
+	uint8_t negative;
+	uint8_t live;
+	uint8_t prefetched;
+	char key[CACHE_KEY_MAX] __attribute__((aligned(8)));
+	char value[CACHE_VALUE_MAX] __attribute__((aligned(8)));
+};
+
+struct cache_shard {
+	uint32_t seq;
+	pthread_mutex_t lock;
+	uint32_t capacity;
+	uint32_t n_used;
+	uint32_t hand;
+	uint32_t window_size;
+	uint32_t window_hand;
+	uint32_t sweep_hand;
+	uint32_t free_head;
+	uint32_t n_free;
+	uint32_t index_mask;
+	size_t entries_off;
+	size_t index_off;
+	uint64_t evictions;
+	uint64_t expirations;
+	uint64_t prefetches;
+	// Bumped by lock-free readers, kept off the line they read
+	uint64_t hits __attribute__((aligned(64)));
+	uint64_t misses;
+	uint64_t prefetch_hits;
+	uint64_t read_retries;
+} __attribute__((aligned(64)));
+
+struct cache {
+	size_t region_len;
+	uint32_t n_shards;
+	uint32_t shard_shift;
+	size_t shards_off;
+	size_t sketch_off;
+	uint32_t sketch_bits;
+	uint64_t sketch_aged_at;
+};
+
+
+static inline struct cache_shard *cache_shards(struct cache *cache) {
+	return (struct cache_shard *) ((char *) cache + cache->shards_off);
+}
+
+static inline struct cache_entry *cache_entries(struct cache *cache, struct cache_shard *shard) {
+	return (struct cache_entry *) ((char *) cache + shard->entries_off);
+}
+
+// Index slots hold entry number + 1, 0 marks an empty slot
+static inline uint32_t *cache_index(struct cache *cache, struct cache_shard *shard) {
+	return (uint32_t *) ((char *) cache + shard->index_off);
+}
+
+
+static inline uint32_t cache_hash(int type, const char *key) {
+	uint32_t hash = 2166136261u ^ (uint32_t) type;
+
+	for(; *key; key++) {
+		hash ^= (unsigned char) *key;
+		hash *= 16777619u;
+	}
+	// Final avalanche, the shard comes from the high bits and the index slot from the low ones
+	hash ^= hash >> 15;
+	hash *= 0x2c1b3c6dU;
+	hash ^= hash >> 12;
+	return hash;
+}
+
+
+static inline size_t cache_align(size_t off) {
+	return (off + 63) & ~(size_t) 63;
+}
+
+
+// Each sketch row has CACHE_SKETCH_WIDTH counters per entry of the cache, rounded up to a power of two.
+// Fewer let the keys of a scan share counters with the hot ones and win admission by collision
+static inline uint32_t cache_sketch_bits(size_t capacity) {
+	uint32_t bits = 6;
+
+	while(bits < 31 && ((size_t) 1 << bits) < CACHE_SKETCH_WIDTH * capacity)
+		bits++;
+	return bits;
+}
+
+
+// Bytes needed for a cache of capacity entries spread over n_shards shards (a power of two)
+static inline size_t cache_region_size(size_t capacity, uint32_t n_shards) {
+	size_t per_shard = (capacity + n_shards - 1) / n_shards;
+	size_t index_size = 16;
+
+	while(index_size < 2 * per_shard)
+		index_size *= 2;
+
+	return cache_align(sizeof(struct cache))
+		+ cache_align(n_shards * sizeof(struct cache_shard))
+		+ n_shards * (cache_align(per_shard * sizeof(struct cache_entry)) + cache_align(index_size * sizeof(uint32_t)))
+		+ cache_align(CACHE_SKETCH_ROWS * ((size_t) 1 << cache_sketch_bits(capacity)));
+}
+
+
+// Laying the cache out in a zeroed region of cache_region_size() bytes
+static inline struct cache *cache_init(void *region, size_t capacity, uint32_t n_shards, bool process_shared) {
+	struct cache *cache = (struct cache *) region;
+	size_t per_shard = (capacity + n_shards - 1) / n_shards;
+	size_t index_size = 16;
+	pthread_mutexattr_t attr;
+
+	while(index_size < 2 * per_shard)
+		index_size *= 2;
+
+	cache->region_len = cache_region_size(capacity, n_shards);
+	cache->n_shards = n_shards;
+	cache->shard_shift = 32;
+	for(uint32_t n = n_shards; n > 1; n >>= 1)
+		cache->shard_shift--;
+	cache->shards_off = cache_align(sizeof(struct cache));
+
+	pthread_mutexattr_init(&attr);
+	if(process_shared) {
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	}
+
+	size_t off = cache->shards_off + cache_align(n_shards * sizeof(struct cache_shard));
+	for(uint32_t i = 0; i < n_shards; i++) {
+		struct cache_shard *shard = &cache_shards(cache)[i];
+
+		pthread_mutex_init(&shard->lock, &attr);
+		shard->capacity = per_shard;
+		shard->window_size = per_shard * CACHE_WINDOW_PERCENT / 100 > 0 ? per_shard * CACHE_WINDOW_PERCENT / 100 : 1;
+		shard->window_hand = 0;
+		shard->hand = shard->window_size < per_shard ? shard->window_size : 0;
+		shard->index_mask = index_size - 1;
+		shard->entries_off = off;
+		off += cache_align(per_shard * sizeof(struct cache_entry));
+		shard->index_off = off;
+		off += cache_align(index_size * sizeof(uint32_t));
+	}
+	cache->sketch_off = off;
+	cache->sketch_bits = cache_sketch_bits(capacity);
+
+	pthread_mutexattr_destroy(&attr);
+	return cache;
+}
+
+
+// A private cache for the threads of one process, NULL when n_shards is not a power of two
+static inline struct cache *cache_create(size_t capacity, uint32_t n_shards) {
+	if(capacity < 1 || n_shards < 1 || (n_shards & (n_shards - 1)) != 0)
+		return NULL;
+
+	void *region = calloc(1, cache_region_size(capacity, n_shards));
+	if(region == NULL)
+		return NULL;
+	return cache_init(region, capacity, n_shards, false);
+}
+
+
+// A cache shared by every process forked after this call, NULL on failure.
+// The segment is unlinked at once and lives as long as some process maps it
+static inline struct cache *cache_create_shared(size_t capacity, uint32_t n_shards) {
+	char name[64];
+	size_t len = cache_region_size(capacity, n_shards);
+
+	if(capacity < 1 || n_shards < 1 || (n_shards & (n_shards - 1)) != 0)
+		return NULL;
+
+	snprintf(name, sizeof name, "/dns_proxy_cache.%d", (int) getpid());
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(fd < 0)
+		return NULL;
+	shm_unlink(name);
+
+	if(ftruncate(fd, len) < 0) {
+		close(fd);
+		return NULL;
+	}
+	void *region = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(region == MAP_FAILED)
+		return NULL;
+
+	// A fresh segment reads as zeros, as cache_init() expects
+	return cache_init(region, capacity, n_shards, true);
+}
+
+
+static inline struct cache_shard *cache_shard_of(struct cache *cache, uint32_t hash) {
+	return &cache_shards(cache)[cache->shard_shift == 32 ? 0 : hash >> cache->shard_shift];
+}
+
+
+// Writing a string of at most max - 1 characters word by word, zero-padding its last word
+static inline void cache_store_string(char *dst, const char *src) {
+	uint64_t *to = (uint64_t *) dst;
+	size_t len = strlen(src) + 1;
+
+	for(size_t i = 0; i * 8 < len; i++) {
+		uint64_t word = 0;
+		memcpy(&word, src + i * 8, len - i * 8 < 8 ? len - i * 8 : 8);
+		__atomic_store_n(&to[i], word, __ATOMIC_RELAXED);
+	}
+}
+
+// Reading a stored string word by word into dst of max bytes, always terminated
+static inline void cache_load_string(char *dst, const char *src, size_t max) {
+	const uint64_t *from = (const uint64_t *) src;
+
+	for(size_t i = 0; i < max / 8; i++) {
+		uint64_t word = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+		memcpy(dst + i * 8, &word, 8);
+		if(memchr(&word, 0, 8) != NULL)
+			return;
+	}
+	dst[max - 1] = '\0';
+}
+
+// Comparing a stored key with one laid out the same way by cache_store_string()
+static inline bool cache_key_equal(const char *stored, const char *key) {
+	const uint64_t *a = (const uint64_t *) stored;
+	const uint64_t *b = (const uint64_t *) key;
+
+	for(size_t i = 0; i < CACHE_KEY_MAX / 8; i++) {
+		uint64_t word = __atomic_load_n(&a[i], __ATOMIC_RELAXED);
+		if(word != b[i])
+			return false;
+		if(memchr(&word, 0, 8) != NULL)
+			return true;
+	}
+	return false;
+}
+
+
+// Counter of row for a key hash, each row spreading the hashes with its own multiplier
+static inline uint8_t *cache_sketch_counter(struct cache *cache, uint32_t hash, int row) {
+	static const uint32_t seeds[CACHE_SKETCH_ROWS] = {0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu};
+	uint32_t column = (hash * seeds[row]) >> (32 - cache->sketch_bits);
+
+	return (uint8_t *) cache + cache->sketch_off + ((size_t) row << cache->sketch_bits) + column;
+}
+
+// Counting a lookup of hash. Only the smallest counters are raised, and nothing is written
+// once they saturate, so the counters of hot keys stay shared among readers
+static inline void cache_sketch_touch(struct cache *cache, uint32_t hash) {
+	uint8_t *counters[CACHE_SKETCH_ROWS];
+	uint8_t least = CACHE_SKETCH_MAX;
+
+	for(int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+		counters[row] = cache_sketch_counter(cache, hash, row);
+		uint8_t count = __atomic_load_n(counters[row], __ATOMIC_RELAXED);
+		if(count < least)
+			least = count;
+	}
+	if(least == CACHE_SKETCH_MAX)
+		return;
+
+	for(int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+		if(__atomic_load_n(counters[row], __ATOMIC_RELAXED) == least)
+			__atomic_store_n(counters[row], least + 1, __ATOMIC_RELAXED);
+	}
+}
+
+// How often hash was looked up lately, never less than the truth up to CACHE_SKETCH_MAX
+static inline uint32_t cache_sketch_estimate(struct cache *cache, uint32_t hash) {
+	uint32_t least = CACHE_SKETCH_MAX;
+
+	for(int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+		uint8_t count = __atomic_load_n(cache_sketch_counter(cache, hash, row), __ATOMIC_RELAXED);
+		if(count < least)
+			least = count;
+	}
+	return least;
+}
+
+
+// Index slot holding the entry for (type, key), or of the empty slot ending its probe.
+// key is laid out by cache_store_string(). Safe to run without the lock, the probe is
+// bounded even if the index changes under it
+static inline uint32_t cache_probe(struct cache *cache, struct cache_shard *shard, uint32_t hash, int type, const char *key) {
+	uint32_t *index = cache_index(cache, shard);
+	struct cache_entry *entries = cache_entries(cache, shard);
+	uint32_t slot = hash & shard->index_mask;
+	uint32_t entry_no;
+
+	for(uint32_t probes = 0; probes <= shard->index_mask; probes++) {
+		entry_no = __atomic_load_n(&index[slot], __ATOMIC_RELAXED);
+		if(entry_no == 0 || entry_no > shard->capacity)
+			break;
+
+		struct cache_entry *entry = &entries[entry_no - 1];
+		if(__atomic_load_n(&entry->hash, __ATOMIC_RELAXED) == hash
+			&& __atomic_load_n(&entry->type, __ATOMIC_RELAXED) == type
+			&& cache_key_equal(entry->key, key))
+			break;
+		slot = (slot + 1) & shard->index_mask;
+	}
+	return slot;
+}
+
+
+static inline uint32_t cache_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return now.tv_sec;
+}
+
+
+// Taking a shard's mutex, emptying the shard if its last owner died in the middle of a write
+static inline void cache_shard_lock(struct cache *cache, struct cache_shard *shard) {
+	if(pthread_mutex_lock(&shard->lock) != EOWNERDEAD)
+		return;
+
+	pthread_mutex_consistent(&shard->lock);
+	if(shard->seq & 1) {
+		uint32_t *index = cache_index(cache, shard);
+
+		// Readers keep retrying while the count is odd
+		for(uint32_t slot = 0; slot <= shard->index_mask; slot++)
+			__atomic_store_n(&index[slot], 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&shard->n_used, 0, __ATOMIC_RELAXED);
+		shard->hand = shard->window_size < shard->capacity ? shard->window_size : 0;
+		shard->window_hand = 0;
+		shard->sweep_hand = 0;
+		shard->free_head = 0;
+		shard->n_free = 0;
+		__atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+	}
+}
+
+// Writers hold the mutex and keep the sequence count odd while they change the shard
+static inline void cache_seq_open(struct cache_shard *shard) {
+	__atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void cache_seq_close(struct cache_shard *shard) {
+	__atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline void cache_write_begin(struct cache *cache, struct cache_shard *shard) {
+	cache_shard_lock(cache, shard);
+	cache_seq_open(shard);
+}
+
+static inline void cache_write_end(struct cache_shard *shard) {
+	cache_seq_close(shard);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+
+// Removing an index slot, shifting back the entries of its probe chain
+static inline void cache_unlink(struct cache *cache, struct cache_shard *shard, uint32_t slot) {
+	uint32_t *index = cache_index(cache, shard);
+	struct cache_entry *entries = cache_entries(cache, shard);
+	uint32_t hole = slot;
+
+	__atomic_store_n(&index[hole], 0, __ATOMIC_RELAXED);
+	for(uint32_t next = (hole + 1) & shard->index_mask; index[next] != 0; next = (next + 1) & shard->index_mask) {
+		uint32_t home = entries[index[next] - 1].hash & shard->index_mask;
+
+		// Moving the entry into the hole unless its home lies cyclically in (hole, next]
+		if(((next - home) & shard->index_mask) >= ((next - hole) & shard->index_mask)) {
+			__atomic_store_n(&index[hole], index[next], __ATOMIC_RELAXED);
+			__atomic_store_n(&index[next], 0, __ATOMIC_RELAXED);
+			hole = next;
+		}
+	}
+}
+
+
+// Looking up (type, key) without taking a lock. On CACHE_HIT the answer is copied into value;
+// on CACHE_HIT and CACHE_NEGATIVE *ttl is set to the seconds the record has left to live
+static inline int cache_lookup(struct cache *cache, int type, const char *key, char *value, uint32_t *ttl) {
+	uint32_t hash = cache_hash(type, key);
+	struct cache_shard *shard = cache_shard_of(cache, hash);
+	struct cache_entry *entry = NULL;
+	uint32_t expires = 0;
+	uint8_t negative = 0;
+	char padded[CACHE_KEY_MAX] __attribute__((aligned(8)));
+	char answer[CACHE_VALUE_MAX];
+
+	if(strlen(key) >= CACHE_KEY_MAX)
+		return CACHE_MISS;
+	cache_store_string(padded, key);
+	cache_sketch_touch(cache, hash);
+
+	while(1) {
+		uint32_t seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+		if(seq & 1) {
+			__atomic_fetch_add(&shard->read_retries, 1, __ATOMIC_RELAXED);
+			sched_yield();
+			continue;
+		}
+
+		uint32_t slot = cache_probe(cache, shard, hash, type, padded);
+		uint32_t entry_no = __atomic_load_n(&cache_index(cache, shard)[slot], __ATOMIC_RELAXED);
+
+		entry = NULL;
+		if(entry_no != 0 && entry_no <= shard->capacity) {
+			entry = &cache_entries(cache, shard)[entry_no - 1];
+			expires = __atomic_load_n(&entry->expires, __ATOMIC_RELAXED);
+			negative = __atomic_load_n(&entry->negative, __ATOMIC_RELAXED);
+			cache_load_string(answer, entry->value, CACHE_VALUE_MAX);
+		}
+
+		// Whatever was read is only trusted if no writer ran meanwhile
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&shard->seq, __ATOMIC_RELAXED) == seq)
+			break;
+		__atomic_fetch_add(&shard->read_retries, 1, __ATOMIC_RELAXED);
+	}
+
+	// An expired record stays in place until it is swept, evicted or refreshed
+	uint32_t now = cache_now();
+	if(entry == NULL || expires <= now) {
+		__atomic_fetch_add(&shard->misses, 1, __ATOMIC_RELAXED);
+		return CACHE_MISS;
+	}
+
+	// Only writing the line when the bit is clear, so hot entries stay shared among readers
+	if(!__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED))
+		__atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard->hits, 1, __ATOMIC_RELAXED);
+	if(__atomic_load_n(&entry->prefetched, __ATOMIC_RELAXED) && __atomic_exchange_n(&entry->prefetched, 0, __ATOMIC_RELAXED))
+		__atomic_fetch_add(&shard->prefetch_hits, 1, __ATOMIC_RELAXED);
+
+	*ttl = expires - now;
+	if(negative)
+		return CACHE_NEGATIVE;
+	strcpy(value, answer);
+	return CACHE_HIT;
+}
+
+
+// Sweeping a CLOCK hand over entries [first, end) to the first one that is expired or was not
+// referenced since the hand last passed it, giving every other one a second chance
+static inline uint32_t cache_clock(struct cache_entry *entries, uint32_t *hand, uint32_t first, uint32_t end, uint32_t now) {
+	while(entries[*hand].expires > now && __atomic_load_n(&entries[*hand].referenced, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&entries[*hand].referenced, 0, __ATOMIC_RELAXED);
+		*hand = *hand + 1 < end ? *hand + 1 : first;
+	}
+	uint32_t entry_no = *hand;
+	*hand = *hand + 1 < end ? *hand + 1 : first;
+	return entry_no;
+}
+
+// Taking a record out of the index, counted as an eviction or an expiration
+static inline void cache_evict(struct cache *cache, struct cache_shard *shard, struct cache_entry *victim, uint32_t now) {
+	cache_unlink(cache, shard, cache_probe(cache, shard, victim->hash, victim->type, victim->key));
+	if(victim->expires > now)
+		shard->evictions++;
+	else
+		shard->expirations++;
+}
+
+// Moving the record of entry from into entry to, whose own record is already out of the index
+static inline void cache_move(struct cache *cache, struct cache_shard *shard, uint32_t from, uint32_t to) {
+	struct cache_entry *entries = cache_entries(cache, shard);
+	struct cache_entry *source = &entries[from], *target = &entries[to];
+	uint32_t slot = cache_probe(cache, shard, source->hash, source->type, source->key);
+
+	__atomic_store_n(&target->hash, source->hash, __ATOMIC_RELAXED);
+	__atomic_store_n(&target->type, source->type, __ATOMIC_RELAXED);
+	__atomic_store_n(&target->expires, source->expires, __ATOMIC_RELAXED);
+	__atomic_store_n(&target->negative, source->negative, __ATOMIC_RELAXED);
+	__atomic_store_n(&target->prefetched, source->prefetched, __ATOMIC_RELAXED);
+	__atomic_store_n(&target->referenced, 0, __ATOMIC_RELAXED);
+	cache_store_string(target->key, source->key);
+	cache_store_string(target->value, source->value);
+	__atomic_store_n(&target->live, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&cache_index(cache, shard)[slot], to + 1, __ATOMIC_RELAXED);
+}
+
+
+// Picking the entry for a new record, called with the write section open. A full shard frees the
+// window's CLOCK victim, after moving it over the main part's victim if it is looked up more often
+static inline uint32_t cache_allocate(struct cache *cache, struct cache_shard *shard, uint32_t now) {
+	struct cache_entry *entries = cache_entries(cache, shard);
+	uint32_t entry_no;
+
+	if(shard->free_head != 0) {
+		entry_no = shard->free_head - 1;
+		shard->free_head = entries[entry_no].next_free;
+		shard->n_free--;
+		return entry_no;
+	}
+	// Read without the lock by cache_save and cache_scan_hot, which only look at entries below it
+	if(shard->n_used < shard->capacity) {
+		__atomic_store_n(&shard->n_used, shard->n_used + 1, __ATOMIC_RELEASE);
+		return shard->n_used - 1;
+	}
+
+	// A shard too small for a main part is one plain CLOCK
+	if(shard->window_size >= shard->capacity) {
+		entry_no = cache_clock(entries, &shard->hand, 0, shard->capacity, now);
+		cache_evict(cache, shard, &entries[entry_no], now);
+		return entry_no;
+	}
+
+	uint32_t candidate = cache_clock(entries, &shard->window_hand, 0, shard->window_size, now);
+	if(entries[candidate].expires > now) {
+		uint32_t victim = cache_clock(entries, &shard->hand, shard->window_size, shard->capacity, now);
+
+		if(entries[victim].expires <= now
+				|| cache_sketch_estimate(cache, entries[candidate].hash) > cache_sketch_estimate(cache, entries[victim].hash)) {
+			cache_evict(cache, shard, &entries[victim], now);
+			cache_move(cache, shard, candidate, victim);
+			return candidate;
+		}
+	}
+	cache_evict(cache, shard, &entries[candidate], now);
+	return candidate;
+}
+
+
+// Inserting or refreshing (type, key) for ttl seconds, prefetched when the refresh came ahead of expiry
+// rather than from a miss. A NULL value records a negative answer
+static inline void cache_store(struct cache *cache, int type, const char *key, const char *value, uint32_t ttl, bool prefetched) {
+	uint32_t hash = cache_hash(type, key);
+	struct cache_shard *shard = cache_shard_of(cache, hash);
+	struct cache_entry *entries = cache_entries(cache, shard);
+	uint32_t *index = cache_index(cache, shard);
+	uint32_t now = cache_now();
+	char padded[CACHE_KEY_MAX] __attribute__((aligned(8)));
+
+	if(ttl == 0 || strlen(key) >= CACHE_KEY_MAX || (value != NULL && strlen(value) >= CACHE_VALUE_MAX))
+		return;
+	cache_store_string(padded, key);
+
+	cache_write_begin(cache, shard);
+	uint32_t slot = cache_probe(cache, shard, hash, type, padded);
+	struct cache_entry *entry;
+
+	if(index[slot] != 0) {
+		entry = &entries[index[slot] - 1];
+	}
+	else {
+		uint32_t entry_no = cache_allocate(cache, shard, now);
+
+		// An eviction may have shifted the probe chain of the new key
+		slot = cache_probe(cache, shard, hash, type, padded);
+		entry = &entries[entry_no];
+		__atomic_store_n(&entry->hash, hash, __ATOMIC_RELAXED);
+		__atomic_store_n(&entry->type, type, __ATOMIC_RELAXED);
+		__atomic_store_n(&entry->referenced, 0, __ATOMIC_RELAXED);
+		cache_store_string(entry->key, key);
+		__atomic_store_n(&entry->live, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&index[slot], entry_no + 1, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&entry->expires, now + ttl, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->negative, value == NULL, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->prefetched, prefetched, __ATOMIC_RELAXED);
+	cache_store_string(entry->value, value != NULL ? value : "");
+	if(prefetched)
+		shard->prefetches++;
+
+	cache_write_end(shard);
+}
+
+// Inserting or refreshing (type, key) for ttl seconds. A NULL value records a negative answer.
+// The CLOCK hand makes room when the shard is full
+static inline void cache_insert(struct cache *cache, int type, const char *key, const char *value, uint32_t ttl) {
+	cache_store(cache, type, key, value, ttl, false);
+}
+
+
+// Halving every sketch counter once there were CACHE_SKETCH_AGING lookups per entry since the last time
+static inline void cache_sketch_age(struct cache *cache) {
+	uint64_t lookups = 0, capacity = 0;
+
+	for(uint32_t i = 0; i < cache->n_shards; i++) {
+		struct cache_shard *shard = &cache_shards(cache)[i];
+		lookups += __atomic_load_n(&shard->hits, __ATOMIC_RELAXED) + __atomic_load_n(&shard->misses, __ATOMIC_RELAXED);
+		capacity += shard->capacity;
+	}
+	if(lookups - cache->sketch_aged_at < CACHE_SKETCH_AGING * capacity)
+		return;
+	cache->sketch_aged_at = lookups;
+
+	// Lookups racing this lose an increment at most
+	uint8_t *counters = (uint8_t *) cache + cache->sketch_off;
+	for(size_t i = 0; i < CACHE_SKETCH_ROWS * ((size_t) 1 << cache->sketch_bits); i++)
+		__atomic_store_n(&counters[i], __atomic_load_n(&counters[i], __ATOMIC_RELAXED) >> 1, __ATOMIC_RELAXED);
+}
+
+
+// Freeing expired records, looking at no more than budget entries of each shard, and aging the sketch.
+// Called by one thread at a time
+static inline void cache_sweep(struct cache *cache, uint32_t budget) {
+	uint32_t now = cache_now();
+
+	cache_sketch_age(cache);
+
+	for(uint32_t i = 0; i < cache->n_shards; i++) {
+		struct cache_shard *shard = &cache_shards(cache)[i];
+		struct cache_entry *entries = cache_entries(cache, shard);
+
+		cache_shard_lock(cache, shard);
+		for(uint32_t seen = 0; seen < budget && seen < shard->n_used; seen++) {
+			if(shard->sweep_hand >= shard->n_used)
+				shard->sweep_hand = 0;
+			uint32_t entry_no = shard->sweep_hand++;
+			struct cache_entry *entry = &entries[entry_no];
+
+			if(!entry->live || entry->expires > now)
+				continue;
+
+			// Readers only need to be kept out while the index changes
+			cache_seq_open(shard);
+			cache_unlink(cache, shard, cache_probe(cache, shard, entry->hash, entry->type, entry->key));
+			cache_seq_close(shard);
+
+			__atomic_store_n(&entry->live, 0, __ATOMIC_RELAXED);
+			entry->next_free = shard->free_head;
+			shard->free_head = entry_no + 1;
+			shard->n_free++;
+			shard->expirations++;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+
+struct cache_stats {
+	uint64_t entries;
+	uint64_t capacity;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t expirations;
+	uint64_t prefetches;
+	uint64_t prefetch_hits;
+	uint64_t read_retries;
+};
+
+static inline void cache_get_stats(struct cache *cache, struct cache_stats *stats) {
+	memset(stats, 0, sizeof *stats);
+
+	for(uint32_t i = 0; i < cache->n_shards; i++) {
+		struct cache_shard *shard = &cache_shards(cache)[i];
+
+		cache_shard_lock(cache, shard);
+		stats->entries += shard->n_used - shard->n_free;
+		stats->capacity += shard->capacity;
+		stats->evictions += shard->evictions;
+		stats->expirations += shard->expirations;
+		stats->prefetches += shard->prefetches;
+		pthread_mutex_unlock(&shard->lock);
+		stats->hits += __atomic_load_n(&shard->hits, __ATOMIC_RELAXED);
+		stats->misses += __atomic_load_n(&shard->misses, __ATOMIC_RELAXED);
+		stats->prefetch_hits += __atomic_load_n(&shard->prefetch_hits, __ATOMIC_RELAXED);
+		stats->read_retries += __atomic_load_n(&shard->read_retries, __ATOMIC_RELAXED);
+	}
+}
+
+
+// Writing the occupancy and turnover of the cache in the same text format as stats_write()
+static inline void cache_write_stats(struct cache *cache, FILE *out) {
+	struct cache_stats stats;
+
+	cache_get_stats(cache, &stats);
+	fprintf(out, "# TYPE dns_cache_entries gauge\ndns_cache_entries %llu\n", (unsigned long long) stats.entries);
+	fprintf(out, "# TYPE dns_cache_capacity gauge\ndns_cache_capacity %llu\n", (unsigned long long) stats.capacity);
+	fprintf(out, "# TYPE dns_cache_evictions_total counter\ndns_cache_evictions_total %llu\n", (unsigned long long) stats.evictions);
+	fprintf(out, "# TYPE dns_cache_expirations_total counter\ndns_cache_expirations_total %llu\n", (unsigned long long) stats.expirations);
+	fprintf(out, "# TYPE dns_cache_prefetches_total counter\ndns_cache_prefetches_total %llu\n", (unsigned long long) stats.prefetches);
+	fprintf(out, "# TYPE dns_cache_prefetch_hits_total counter\ndns_cache_prefetch_hits_total %llu\n", (unsigned long long) stats.prefetch_hits);
+	fprintf(out, "# TYPE dns_cache_read_retries_total counter\ndns_cache_read_retries_total %llu\n", (unsigned long long) stats.read_retries);
+}
+
+
+// Snapshot file: this header, then n_records of a cache_snapshot_record each followed by
+// its key and value, not terminated. Written in host byte order, to be read back on the same host
+struct cache_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t saved_at;
+	uint32_t n_records;
+	uint32_t reserved;
+};
+
+struct cache_snapshot_record {
+	uint32_t ttl;
+	uint8_t type;
+	uint8_t negative;
+	uint8_t key_len;
+	uint8_t value_len;
+};
+
+
+// Copying entry entry_no of a shard without the lock, false if it holds no live record
+static inline bool cache_read_entry(struct cache *cache, struct cache_shard *shard, uint32_t entry_no, uint32_t now,
+		struct cache_snapshot_record *record, char *key, char *value) {
+	struct cache_entry *entry = &cache_entries(cache, shard)[entry_no];
+
+	while(1) {
+		uint32_t seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+		if(seq & 1) {
+			sched_yield();
+			continue;
+		}
+
+		bool live = __atomic_load_n(&entry->live, __ATOMIC_RELAXED);
+		uint32_t expires = __atomic_load_n(&entry->expires, __ATOMIC_RELAXED);
+		record->type = __atomic_load_n(&entry->type, __ATOMIC_RELAXED);
+		record->negative = __atomic_load_n(&entry->negative, __ATOMIC_RELAXED);
+		cache_load_string(key, entry->key, CACHE_KEY_MAX);
+		cache_load_string(value, entry->value, CACHE_VALUE_MAX);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(__atomic_load_n(&shard->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		if(!live || expires <= now)
+			return false;
+		record->ttl = expires - now;
+		record->key_len = strlen(key);
+		record->value_len = record->negative ? 0 : strlen(value);
+		return true;
+	}
+}
+
+
+// Writing every live record to path, through a temporary file renamed over it once complete.
+// Returns the number of records written, -1 on failure
+static inline long cache_save(struct cache *cache, const char *path) {
+	struct cache_snapshot_header header = {CACHE_SNAPSHOT_MAGIC, CACHE_SNAPSHOT_VERSION, (uint64_t) time(NULL), 0, 0};
+	char tmp_path[4096];
+	uint32_t now = cache_now();
+
+	snprintf(tmp_path, sizeof tmp_path, "%s.tmp", path);
+	FILE *out = fopen(tmp_path, "wb");
+	if(out == NULL)
+		return -1;
+
+	// The header is written again once the records are counted
+	bool ok = fwrite(&header, sizeof header, 1, out) == 1;
+	for(uint32_t i = 0; ok && i < cache->n_shards; i++) {
+		struct cache_shard *shard = &cache_shards(cache)[i];
+		uint32_t n_used = __atomic_load_n(&shard->n_used, __ATOMIC_RELAXED);
+
+		for(uint32_t entry_no = 0; ok && entry_no < n_used && entry_no < shard->capacity; entry_no++) {
+			struct cache_snapshot_record record;
+			char key[CACHE_KEY_MAX], value[CACHE_VALUE_MAX];
+
+			if(!cache_read_entry(cache, shard, entry_no, now, &record, key, value))
+				continue;
+			ok = fwrite(&record, sizeof record, 1, out) == 1
+				&& fwrite(key, 1, record.key_len, out) == record.key_len
+				&& fwrite(value, 1, record.value_len, out) == record.value_len;
+			header.n_records++;
+		}
+	}
+
+	ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof header, 1, out) == 1 && fflush(out) == 0 && fsync(fileno(out)) == 0;
+	if(fclose(out) != 0 || !ok || rename(tmp_path, path) < 0) {
+		unlink(tmp_path);
+		return -1;
+	}
+	return header.n_records;
+}
+
+
+// Inserting the records of a snapshot that are still alive, each for what is left of its time
+// to live. Returns the number of records inserted, -1 when there is no valid snapshot at path
+static inline long cache_load(struct cache *cache, const char *path) {
+	struct stat file_stat;
+	int fd = open(path, O_RDONLY);
+
+	if(fd < 0)
+		return -1;
+	if(fstat(fd, &file_stat) < 0 || (size_t) file_stat.st_size < sizeof(struct cache_snapshot_header)) {
+		close(fd);
+		return -1;
+	}
+	size_t len = file_stat.st_size;
+	const char *map = (const char *) mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return -1;
+
+	struct cache_snapshot_header header;
+	memcpy(&header, map, sizeof header);
+	if(header.magic != CACHE_SNAPSHOT_MAGIC || header.version != CACHE_SNAPSHOT_VERSION) {
+		munmap((void *) map, len);
+		return -1;
+	}
+
+	uint64_t now = (uint64_t) time(NULL);
+	uint64_t elapsed = now > header.saved_at ? now - header.saved_at : 0;
+	size_t off = sizeof header;
+	long n_loaded = 0;
+
+	for(uint32_t i = 0; i < header.n_records && off + sizeof(struct cache_snapshot_record) <= len; i++) {
+		struct cache_snapshot_record record;
+		char key[CACHE_KEY_MAX], value[CACHE_VALUE_MAX];
+
+		memcpy(&record, map + off, sizeof record);
+		off += sizeof record;
+		if(off + record.key_len + record.value_len > len)
+			break;
+
+		memcpy(key, map + off, record.key_len);
+		key[record.key_len] = '\0';
+		memcpy(value, map + off + record.key_len, record.value_len);
+		value[record.value_len] = '\0';
+		off += record.key_len + record.value_len;
+
+		if(record.ttl <= elapsed)
+			continue;
+		cache_insert(cache, record.type, key, record.negative ? NULL : value, record.ttl - elapsed);
+		n_loaded++;
+	}
+
+	munmap((void *) map, len);
+	return n_loaded;
+}
+
+
+// Calling refresh() with the type and key of every positive record that expires within window seconds
+// and was looked up at least CACHE_HOT_FREQUENCY times lately. Takes no lock, returns how many it found
+static inline long cache_scan_hot(struct cache *cache, uint32_t window, void (*refresh)(int type, const char *key)) {
+	uint32_t now = cache_now();
+	long n_hot = 0;
+
+	for(uint32_t i = 0; i < cache->n_shards; i++) {
+		struct cache_shard *shard = &cache_shards(cache)[i];
+		struct cache_entry *entries = cache_entries(cache, shard);
+		uint32_t n_used = __atomic_load_n(&shard->n_used, __ATOMIC_RELAXED);
+
+		for(uint32_t entry_no = 0; entry_no < n_used && entry_no < shard->capacity; entry_no++) {
+			struct cache_entry *entry = &entries[entry_no];
+			struct cache_snapshot_record record;
+			char key[CACHE_KEY_MAX], value[CACHE_VALUE_MAX];
+
+			// Looking at the expiry and the sketch first, most entries are not due yet
+			uint32_t expires = __atomic_load_n(&entry->expires, __ATOMIC_RELAXED);
+			if(expires <= now || expires - now > window || __atomic_load_n(&entry->negative, __ATOMIC_RELAXED)
+					|| cache_sketch_estimate(cache, __atomic_load_n(&entry->hash, __ATOMIC_RELAXED)) < CACHE_HOT_FREQUENCY)
+				continue;
+
+			if(!cache_read_entry(cache, shard, entry_no, now, &record, key, value) || record.negative || record.ttl > window)
+				continue;
+			refresh(record.type, key);
+			n_hot++;
+		}
+	}
+	return n_hot;
+}
@@ -5,21 +5,245 @@
 #include <string.h> 
 #include <stdlib.h>
 #include <stdbool.h>
+#include <time.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "proto.h"
+
+#define UDP_TIMEOUT_SEC 2
+#define RECV_BUFFER 65536
+#define DEFAULT_WINDOW 128
+
+
+// Waiting for the reply to request_id, dropping stale replies to earlier requests.
+// Returns the answer length with the answer NUL terminated and its time to live in *ttl (0 when
+// the reply carries none), or -1 when the proxy is gone
+int receiveReply(int socket_fd, bool use_udp, char *in, size_t *in_len, uint32_t request_id, struct frame_header *header, char *payload_out, uint32_t *ttl) {
+	while(1) {
+		size_t offset = 0;
+		const char *payload;
+		int parsed;
+		
+		while((parsed = frame_parse(in, *in_len, &offset, header, &payload)) == 1) {
+			if(header->request_id != request_id)
+				continue;
+			
+			size_t length = header->length;
+			*ttl = 0;
+			frame_take_ttl(header->flags, &payload, &length, ttl);
+			memcpy(payload_out, payload, length);
+			payload_out[length] = '\0';
+			memmove(in, in + offset, *in_len - offset);
+			*in_len -= offset;
+			return length;
+		}
+		if(parsed < 0)
+			return -1;
+		
+		// Datagrams are whole frames, stale ones are simply dropped
+		if(use_udp)
+			*in_len = 0;
+		else {
+			memmove(in, in + offset, *in_len - offset);
+			*in_len -= offset;
+		}
+		
+		int valread = recv(socket_fd, in + *in_len, RECV_BUFFER - *in_len, 0);
+		if(valread <= 0)
+			return -1;
+		*in_len += valread;
+	}
+}
+
+
+// Loading a batch file: one domain name or IP address per line, blanks around it trimmed and blank lines skipped.
+// A line is one query even with blanks inside it, which the server then rejects as a whole
+char **loadBatch(const char *path, size_t *n_queries, char **text_out) {
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL) {
+		return NULL;
+	}
+	
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	
+	char *text = (char *) malloc(size + 1);
+	size_t got = fread(text, 1, size, fp);
+	text[got] = '\0';
+	fclose(fp);
+	*text_out = text;
+	
+	size_t capacity = 1024;
+	char **queries = (char **) malloc(capacity * sizeof *queries);
+	*n_queries = 0;
+	
+	for(char *save_ptr, *line = strtok_r(text, "\n", &save_ptr); line; line = strtok_r(NULL, "\n", &save_ptr)) {
+		line += strspn(line, " \t\r");
+		size_t len = strlen(line);
+		while(len > 0 && strchr(" \t\r", line[len - 1]) != NULL)
+			line[--len] = '\0';
+		if(len == 0 || len > MAX_FRAME_BODY)
+			continue;
+		if(*n_queries == capacity) {
+			capacity *= 2;
+			queries = (char **) realloc(queries, capacity * sizeof *queries);
+		}
+		queries[(*n_queries)++] = line;
+	}
+	return queries;
+}
+
+
+// Resolving every query of the batch file over one connection, keeping up to window requests
+// in flight. Request ids are line numbers, so replies are matched whatever order they come in
+int runBatch(int socket_fd, const char *path, size_t window) {
+	struct timespec begin, end;
+	size_t n_queries, n_sent = 0, n_done = 0, n_found = 0, n_not_found = 0, n_errors = 0;
+	char in[RECV_BUFFER], out[RECV_BUFFER];
+	size_t in_len = 0, out_len = 0, out_sent = 0;
+	
+	char *text;
+	char **queries = loadBatch(path, &n_queries, &text);
+	if(queries == NULL) {
+		printf("[ERROR]: Unable to open %s\n", path);
+		return -1;
+	}
+	printf("[PROGRESS]: Resolving %zu queries with a window of %zu\n", n_queries, window);
+	
+	fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL, 0) | O_NONBLOCK);
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	
+	while(n_done < n_queries) {
+		// Topping up the window, as many frames per send as fit in the buffer
+		while(n_sent < n_queries && n_sent - n_done < window && sizeof out - out_len >= MAX_FRAME_LEN) {
+			struct in_addr addr;
+			int type = inet_pton(AF_INET, queries[n_sent], &addr) == 1 ? OP_QUERY_ADDR : OP_QUERY_NAME;
+			
+			out_len += frame_encode(out + out_len, n_sent, type, 0, queries[n_sent], strlen(queries[n_sent]));
+			n_sent++;
+		}
+		
+		struct pollfd pfd = {socket_fd, POLLIN | (out_sent < out_len ? POLLOUT : 0), 0};
+		if(poll(&pfd, 1, -1) < 0) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		
+		if(pfd.revents & POLLOUT) {
+			ssize_t sent = send(socket_fd, out + out_sent, out_len - out_sent, MSG_NOSIGNAL);
+			if(sent < 0 && errno != EAGAIN && errno != EINTR)
+				break;
+			if(sent > 0)
+				out_sent += sent;
+			if(out_sent == out_len)
+				out_len = out_sent = 0;
+		}
+		
+		if(pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			ssize_t got = recv(socket_fd, in + in_len, sizeof in - in_len, 0);
+			if(got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+				printf("[ERROR]: Connection to the proxy lost\n");
+				break;
+			}
+			if(got > 0)
+				in_len += got;
+			
+			size_t offset = 0;
+			struct frame_header header;
+			const char *payload;
+			while(frame_parse(in, in_len, &offset, &header, &payload) == 1) {
+				if(header.request_id >= n_sent)
+					continue;
+				
+				if(header.flags & (FLAG_SERVER_ERROR | FLAG_BAD_REQUEST)) {
+					n_errors++;
+					printf("%s\t[ERROR]\n", queries[header.request_id]);
+				}
+				else if(header.flags & FLAG_NOT_FOUND) {
+					n_not_found++;
+					printf("%s\tEntry Not Found\n", queries[header.request_id]);
+				}
+				else {
+					size_t length = header.length;
+					uint32_t ttl;
+					
+					frame_take_ttl(header.flags, &payload, &length, &ttl);
+					n_found++;
+					printf("%s\t%.*s\n", queries[header.request_id], (int) length, payload);
+				}
+				n_done++;
+			}
+			memmove(in, in + offset, in_len - offset);
+			in_len -= offset;
+		}
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+	
+	printf("[RESULT]: %zu of %zu queries resolved (%zu found, %zu not found, %zu errors) in %.3f s, %.0f queries/s\n",
+		n_done, n_queries, n_found, n_not_found, n_errors, elapsed, elapsed > 0 ? n_done / elapsed : 0.0);
+	
+	free(queries);
+	free(text);
+	return n_done == n_queries ? 0 : -1;
+}
+
 
 int main(int argc, char const *argv[]) 
 { 
 	struct sockaddr_in serverAddress;
 	int socket_fd, connection_fd;
 	
+	char *USAGE = "[USAGE]: <executable code> <Server IP Address> <Server Port number> [--udp] [--batch <file> [--window N]]\n";
+	bool use_udp = false;
+	const char *batch_path = NULL;
+	size_t window = DEFAULT_WINDOW;
+	
 	// Validating User Parameters
-	if(argc != 3) {
-		printf("[USAGE]: <executable code> <Server IP Address> <Server Port number>\n");
+	if(argc < 3) {
+		printf("%s", USAGE);
+		return 0;
+	}
+	for(int i = 3; i < argc; i++) {
+		if(strcmp(argv[i], "--udp") == 0) {
+			use_udp = true;
+		}
+		else if(strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+			batch_path = argv[++i];
+		}
+		else if(strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+			char *end;
+			long value = strtol(argv[++i], &end, 10);
+			
+			// Not a number, or a window that would never let a query out
+			if(end == argv[i] || *end != '\0' || value < 1) {
+				printf("[ERROR]: --window takes a number of queries of at least 1\n");
+				printf("%s", USAGE);
+				return 0;
+			}
+			window = value;
+		}
+		else {
+			printf("%s", USAGE);
+			return 0;
+		}
+	}
+	
+	// Pipelining relies on the ordered, reliable stream
+	if(batch_path != NULL && use_udp) {
+		printf("[ERROR]: Batch mode runs over TCP\n");
 		return 0;
 	}
 	
 	
 	// Creating the socket
-	socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+	socket_fd = socket(AF_INET, use_udp ? SOCK_DGRAM : SOCK_STREAM, 0);
 	if(socket_fd < 0) {
 		printf("[ERROR]: Unable to create socket\n");
 		exit(EXIT_FAILURE); 
@@ -37,7 +261,14 @@ int main(int argc, char const *argv[])
 	serverAddress.sin_port = htons(atoi(argv[2]));
 	
 	
-	// Setting up the connection with DNS Proxy
+	// Datagrams can be lost, a request without reply gives up after a while
+	if(use_udp) {
+		struct timeval timeout = {UDP_TIMEOUT_SEC, 0};
+		setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+	}
+	
+	
+	// Setting up the connection with DNS Proxy (for UDP this only fixes the peer address)
 	connection_fd = connect(socket_fd, (struct sockaddr *)&serverAddress, sizeof serverAddress);
 	if(connection_fd < 0) {
 		printf("[ERROR]: Failed to connect to the server\n");
@@ -47,6 +278,12 @@ int main(int argc, char const *argv[])
 		printf("[SUCCESS]: Connected to the server\n");
 	}
 	
+	if(batch_path != NULL) {
+		int batch_status = runBatch(socket_fd, batch_path, window);
+		close(socket_fd);
+		return batch_status == 0 ? 0 : EXIT_FAILURE;
+	}
+	
 	/*
 	char *message = "Requesting Host Name"; 
 	char buffer[1024] = {0}; 
@@ -63,52 +300,61 @@ int main(int argc, char const *argv[])
 	
 	printf("[USAGE]:\nMessage Type - 1: Request for IP address corresponding to the Domain Name\nMessage Type - 2: Request for Domain Name corresponding to the IP address\n");
 		printf("[Command]:\n1\tIP Address\n2\tDomain Name\n0\t[Terminate Session]\n\n");
-		
+	
+	char in[RECV_BUFFER];
+	size_t in_len = 0;
+	uint32_t request_id = 0;
+	
 	// Infinite loop to query for multiple requests from the clients
 	while(1) {
 			
 		int status;
-		scanf("%d", &status);
+		if(scanf("%d", &status) != 1)
+			break;
 		
 		char dns_request1[1024];
-		scanf("%s", dns_request1);
-		//  TO DO: ======================================= Implement if buffer size exceeds
-		
-		// Combining User parameters in a single message
-		char dns_request2[1024];
-		dns_request2[0] = ('0' + status);
-		dns_request2[1] = '#';
+		if(scanf("%1000s", dns_request1) != 1)
+			break;
 		
-		for(int i = 0; i < strlen(dns_request1); i++) {
-			dns_request2[i + 2] = dns_request1[i];
+		// Closing the connection ends the session
+		if(status == 0) {
+			break;
 		}
 		
+		// Framing the User parameters in a single message
+		char dns_request2[MAX_FRAME_LEN];
+		size_t request_len = frame_encode(dns_request2, ++request_id, status, 0, dns_request1, strlen(dns_request1));
+		
 		// Sending query to the DNS Proxy
-		send(socket_fd, dns_request2, strlen(dns_request2), 0); 
-		if(status != 0)
-			printf("[PROGRESS]: Requested\n"); 
+		struct timespec sent_at, received_at;
+		clock_gettime(CLOCK_MONOTONIC, &sent_at);
+		send(socket_fd, dns_request2, request_len, 0); 
+		printf("[PROGRESS]: Requested\n"); 
 		
 		// Receiving reply from the DNS Proxy
-		char dns_reply[1024] = {0}; 
-		int valread = recv(socket_fd, dns_reply, 1024, 0);
+		struct frame_header header;
+		char dns_reply[MAX_FRAME_BODY + 1];
+		uint32_t ttl;
+		int valread = receiveReply(socket_fd, use_udp, in, &in_len, request_id, &header, dns_reply, &ttl);
+		clock_gettime(CLOCK_MONOTONIC, &received_at);
+		double latency_ms = (received_at.tv_sec - sent_at.tv_sec) * 1e3 + (received_at.tv_nsec - sent_at.tv_nsec) / 1e6;
 		
-		if(dns_reply[0] == '-') {
-			printf("server is down\n");
-			break;
+		if(use_udp && valread < 0) {
+			printf("[ERROR]: Request timed out\n\n");
+			continue;
 		}
-		if(status == 0) {
+		
+		if(valread < 0 || (header.flags & FLAG_SERVER_ERROR)) {
+			printf("server is down\n");
 			break;
 		}
 		
-		int res_status = dns_reply[0] - '0';
-		if(res_status == 0)
-			printf("[RESULT]: %s\n\n", dns_reply + 2); 
+		if(header.flags & FLAG_BAD_REQUEST)
+			printf("[RESULT]: Invalid request\n\n");
+		else if(header.flags & FLAG_NOT_FOUND)
+			printf("[RESULT]: Entry Not Found\t(%.3f ms over %s)\n\n", latency_ms, use_udp ? "UDP" : "TCP");
 		else
-			printf("[RESULT]: %s\n\n", dns_reply + 2);
-		
-		
-		memset(dns_request1, 0, strlen(dns_request1));
-		memset(dns_request2, 0, strlen(dns_request2));
+			printf("[RESULT]: %s\t(%.3f ms over %s, TTL %u s)\n\n", dns_reply, latency_ms, use_udp ? "UDP" : "TCP", ttl);
 	}
 	
 	
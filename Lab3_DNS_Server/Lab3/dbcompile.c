@@ -0,0 +1,28 @@
+#include <stdio.h> 
+#include <time.h>
+#include "dbformat.h"
+
+
+int main(int argc, char const *argv[]) 
+{ 
+	struct timespec begin, end;
+	
+	// Validating User Parameters
+	if(argc != 3) {
+		printf("[USAGE]: <executable code> <Text database> <Compiled database>\n");
+		return 0;
+	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	long n_records = dbf_compile(argv[1], argv[2]);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	
+	if(n_records < 0) {
+		printf("[ERROR]: Compilation failed\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	printf("[SUCCESS]: Compiled %ld records into %s in %.1f ms\n", n_records, argv[2],
+		(end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6);
+	return 0; 
+} 
@@ -0,0 +1,494 @@
+/*
+ * Compiled form of database.txt, shared by dbcompile.c and server.c
+ *
+ * Layout of database.bin, every section starting on a page boundary:
+ *
+ *	[header][name index][ip index][string table]
+ *
+ * The name index is sorted by (hash, name) and the ip index by the IPv4
+ * address, so both kinds of query are a binary search over fixed-width
+ * entries. Only the final comparison of a name lookup touches the string
+ * table, which holds every domain name once, NUL terminated.
+ *
+ * A line of database.txt is "<name> <IPv4 address> [TTL]", the time to live
+ * in seconds defaulting to DBF_DEFAULT_TTL; both indexes carry it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+#define DBF_MAGIC "DNSDB02"
+#define DBF_PAGE 4096
+#define DBF_MAX_FIELD 1000
+#define DBF_DEFAULT_TTL 300
+
+
+struct dbf_header {
+	char magic[8];
+	uint32_t n_names;
+	uint32_t n_ips;
+	uint64_t source_size;
+	int64_t source_mtime_sec;
+	int64_t source_mtime_nsec;
+	uint64_t names_off;
+	uint64_t ips_off;
+	uint64_t strings_off;
+	uint64_t strings_len;
+	uint64_t file_len;
+};
+
+struct dbf_name_entry {
+	uint32_t hash;
+	uint32_t name_off;
+	uint32_t name_len;
+	uint32_t ip;
+	uint32_t ttl;
+};
+
+struct dbf_ip_entry {
+	uint32_t ip;
+	uint32_t name_off;
+	uint32_t ttl;
+};
+
+// An opened database.bin
+struct dbf_file {
+	const char *map;
+	size_t map_len;
+	const struct dbf_header *header;
+	const struct dbf_name_entry *names;
+	const struct dbf_ip_entry *ips;
+	const char *strings;
+};
+
+
+// FNV-1a hash of len bytes
+static inline uint32_t dbf_hash(const char *str, size_t len) {
+	uint32_t hash = 2166136261u;
+
+	for(size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char) str[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+
+static inline uint64_t dbf_align(uint64_t off) {
+	return (off + DBF_PAGE - 1) & ~(uint64_t) (DBF_PAGE - 1);
+}
+
+
+static inline bool dbf_is_blank(char c) {
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+
+// One parsed line of database.txt, pointing into the mapped text file
+struct dbf_line {
+	const char *name;
+	uint32_t hash;
+	uint32_t name_len;
+	uint32_t ip;
+	uint32_t ttl;
+	uint32_t line_no;
+	uint32_t name_off;
+};
+
+static inline int dbf_compare_names(const void *a, const void *b) {
+	const struct dbf_line *x = a, *y = b;
+
+	if(x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	if(x->name_len != y->name_len)
+		return x->name_len < y->name_len ? -1 : 1;
+	int cmp = memcmp(x->name, y->name, x->name_len);
+	if(cmp != 0)
+		return cmp;
+	return x->line_no < y->line_no ? -1 : (x->line_no > y->line_no);
+}
+
+static inline int dbf_compare_ips(const void *a, const void *b) {
+	const struct dbf_line *x = a, *y = b;
+
+	if(x->ip != y->ip)
+		return x->ip < y->ip ? -1 : 1;
+	return x->line_no < y->line_no ? -1 : (x->line_no > y->line_no);
+}
+
+
+static inline bool dbf_write_at(int fd, const void *buf, size_t len, uint64_t off) {
+	const char *p = buf;
+
+	while(len > 0) {
+		ssize_t written = pwrite(fd, p, len, off);
+		if(written <= 0)
+			return false;
+		p += written;
+		len -= written;
+		off += written;
+	}
+	return true;
+}
+
+
+// Compiling the text database at txt_path into bin_path, returns the number of records or -1
+static inline long dbf_compile(const char *txt_path, const char *bin_path) {
+	struct stat st;
+	struct dbf_header header;
+	const char *text = NULL;
+	long skipped = 0;
+
+	int fd = open(txt_path, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) < 0) {
+		printf("[ERROR]: Unable to open %s\n", txt_path);
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if(st.st_size > 0) {
+		text = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(text == MAP_FAILED) {
+			printf("[ERROR]: Unable to map %s\n", txt_path);
+			close(fd);
+			return -1;
+		}
+		madvise((void *) text, st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	// A line is at least "a b\n", which bounds the number of records
+	size_t capacity = st.st_size / 4 + 1;
+	struct dbf_line *lines = (struct dbf_line *) malloc(capacity * sizeof *lines);
+	size_t n_lines = 0;
+	if(lines == NULL) {
+		printf("[ERROR]: Out of memory compiling %s\n", txt_path);
+		if(text != NULL)
+			munmap((void *) text, st.st_size);
+		return -1;
+	}
+
+	const char *p = text;
+	const char *file_end = text + st.st_size;
+	while(p < file_end) {
+		const char *line_end = memchr(p, '\n', file_end - p);
+		if(line_end == NULL)
+			line_end = file_end;
+
+		const char *name = p;
+		while(name < line_end && dbf_is_blank(*name))
+			name++;
+		const char *name_end = name;
+		while(name_end < line_end && !dbf_is_blank(*name_end))
+			name_end++;
+		const char *ip = name_end;
+		while(ip < line_end && dbf_is_blank(*ip))
+			ip++;
+		const char *ip_end = ip;
+		while(ip_end < line_end && !dbf_is_blank(*ip_end))
+			ip_end++;
+		const char *ttl = ip_end;
+		while(ttl < line_end && dbf_is_blank(*ttl))
+			ttl++;
+		const char *ttl_end = ttl;
+		while(ttl_end < line_end && !dbf_is_blank(*ttl_end))
+			ttl_end++;
+
+		p = line_end + 1;
+
+		if(name == line_end)
+			continue;
+
+		// Only well formed "<name> <IPv4 address> [TTL]" lines make it into the index
+		char ip_str[INET_ADDRSTRLEN];
+		struct in_addr addr;
+		if(name_end - name >= DBF_MAX_FIELD || ip == ip_end || ip_end - ip >= INET_ADDRSTRLEN) {
+			skipped++;
+			continue;
+		}
+		memcpy(ip_str, ip, ip_end - ip);
+		ip_str[ip_end - ip] = '\0';
+		if(inet_pton(AF_INET, ip_str, &addr) != 1) {
+			skipped++;
+			continue;
+		}
+
+		uint64_t ttl_value = ttl == ttl_end ? DBF_DEFAULT_TTL : 0;
+		for(const char *digit = ttl; digit < ttl_end && ttl_value <= UINT32_MAX; digit++) {
+			if(*digit < '0' || *digit > '9') {
+				ttl_value = UINT64_MAX;
+				break;
+			}
+			ttl_value = ttl_value * 10 + (*digit - '0');
+		}
+		if(ttl_value > UINT32_MAX) {
+			skipped++;
+			continue;
+		}
+
+		struct dbf_line *line = &lines[n_lines];
+		line->name = name;
+		line->name_len = name_end - name;
+		line->hash = dbf_hash(name, line->name_len);
+		line->ip = ntohl(addr.s_addr);
+		line->ttl = ttl_value;
+		line->line_no = n_lines;
+		n_lines++;
+	}
+
+	// Interning the names: sorted by (hash, name, line) the duplicates are adjacent
+	qsort(lines, n_lines, sizeof *lines, dbf_compare_names);
+
+	struct dbf_name_entry *names = (struct dbf_name_entry *) malloc((n_lines + 1) * sizeof *names);
+	char *strings = (char *) malloc(st.st_size + n_lines + 1);
+	struct dbf_ip_entry *ips = (struct dbf_ip_entry *) malloc((n_lines + 1) * sizeof *ips);
+	size_t n_names = 0, strings_len = 0;
+	if(names == NULL || strings == NULL || ips == NULL) {
+		printf("[ERROR]: Out of memory compiling %s\n", txt_path);
+		if(text != NULL)
+			munmap((void *) text, st.st_size);
+		free(lines);
+		free(names);
+		free(strings);
+		free(ips);
+		return -1;
+	}
+
+	for(size_t i = 0; i < n_lines; i++) {
+		struct dbf_line *line = &lines[i];
+
+		if(n_names > 0 && names[n_names - 1].name_len == line->name_len
+				&& memcmp(strings + names[n_names - 1].name_off, line->name, line->name_len) == 0) {
+			// The first line of the file wins for a repeated name, as in the text scan
+			line->name_off = names[n_names - 1].name_off;
+			continue;
+		}
+
+		line->name_off = strings_len;
+		memcpy(strings + strings_len, line->name, line->name_len);
+		strings_len += line->name_len;
+		strings[strings_len++] = '\0';
+
+		names[n_names].hash = line->hash;
+		names[n_names].name_off = line->name_off;
+		names[n_names].name_len = line->name_len;
+		names[n_names].ip = line->ip;
+		names[n_names].ttl = line->ttl;
+		n_names++;
+	}
+
+	// Reverse lookups, again keeping the first line for a repeated address
+	qsort(lines, n_lines, sizeof *lines, dbf_compare_ips);
+
+	size_t n_ips = 0;
+
+	for(size_t i = 0; i < n_lines; i++) {
+		if(n_ips > 0 && ips[n_ips - 1].ip == lines[i].ip)
+			continue;
+		ips[n_ips].ip = lines[i].ip;
+		ips[n_ips].name_off = lines[i].name_off;
+		ips[n_ips].ttl = lines[i].ttl;
+		n_ips++;
+	}
+
+	if(text != NULL)
+		munmap((void *) text, st.st_size);
+	free(lines);
+
+	memset(&header, 0, sizeof header);
+	memcpy(header.magic, DBF_MAGIC, sizeof header.magic);
+	header.n_names = n_names;
+	header.n_ips = n_ips;
+	header.source_size = st.st_size;
+	header.source_mtime_sec = st.st_mtim.tv_sec;
+	header.source_mtime_nsec = st.st_mtim.tv_nsec;
+	header.names_off = dbf_align(sizeof header);
+	header.ips_off = dbf_align(header.names_off + n_names * sizeof *names);
+	header.strings_off = dbf_align(header.ips_off + n_ips * sizeof *ips);
+	header.strings_len = strings_len;
+	header.file_len = dbf_align(header.strings_off + strings_len);
+
+	// Writing next to the target and renaming, so that readers never see a half written file
+	char tmp_path[4096];
+	snprintf(tmp_path, sizeof tmp_path, "%s.tmp.%d", bin_path, (int) getpid());
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	bool ok = fd >= 0
+		&& ftruncate(fd, header.file_len) == 0
+		&& dbf_write_at(fd, &header, sizeof header, 0)
+		&& dbf_write_at(fd, names, n_names * sizeof *names, header.names_off)
+		&& dbf_write_at(fd, ips, n_ips * sizeof *ips, header.ips_off)
+		&& dbf_write_at(fd, strings, strings_len, header.strings_off);
+	if(fd >= 0)
+		close(fd);
+
+	free(names);
+	free(ips);
+	free(strings);
+
+	if(!ok || rename(tmp_path, bin_path) < 0) {
+		printf("[ERROR]: Unable to write %s\n", bin_path);
+		unlink(tmp_path);
+		return -1;
+	}
+
+	if(skipped > 0)
+		printf("[WARNING]: Skipped %ld malformed lines of %s\n", skipped, txt_path);
+	return n_names;
+}
+
+
+// True when bin_path is missing, unreadable or was compiled from another version of txt_path
+static inline bool dbf_is_stale(const char *txt_path, const char *bin_path) {
+	struct stat st;
+	struct dbf_header header;
+
+	if(stat(txt_path, &st) < 0)
+		return false;
+
+	int fd = open(bin_path, O_RDONLY);
+	if(fd < 0)
+		return true;
+	ssize_t got = pread(fd, &header, sizeof header, 0);
+	close(fd);
+
+	return got != sizeof header
+		|| memcmp(header.magic, DBF_MAGIC, sizeof header.magic) != 0
+		|| header.source_size != (uint64_t) st.st_size
+		|| header.source_mtime_sec != st.st_mtim.tv_sec
+		|| header.source_mtime_nsec != st.st_mtim.tv_nsec;
+}
+
+
+// True when every section of the header lies, in order and page aligned, within the map_len bytes mapped,
+// and every entry of the indexes points at a NUL terminated name of the string table
+static inline bool dbf_is_valid(const char *map, size_t map_len) {
+	const struct dbf_header *header = (const struct dbf_header *) map;
+
+	if(memcmp(header->magic, DBF_MAGIC, sizeof header->magic) != 0 || header->file_len > map_len)
+		return false;
+	if(header->names_off < sizeof *header || header->names_off % DBF_PAGE != 0 || header->ips_off % DBF_PAGE != 0
+			|| header->strings_off % DBF_PAGE != 0)
+		return false;
+	if(header->names_off > header->ips_off || header->ips_off > header->strings_off || header->strings_off > map_len)
+		return false;
+	if((uint64_t) header->n_names * sizeof(struct dbf_name_entry) > header->ips_off - header->names_off
+			|| (uint64_t) header->n_ips * sizeof(struct dbf_ip_entry) > header->strings_off - header->ips_off
+			|| header->strings_len > map_len - header->strings_off)
+		return false;
+
+	const struct dbf_name_entry *names = (const struct dbf_name_entry *) (map + header->names_off);
+	const struct dbf_ip_entry *ips = (const struct dbf_ip_entry *) (map + header->ips_off);
+	const char *strings = map + header->strings_off;
+
+	// Every name ends in a NUL, so the string table does too and a name found by address stays within it
+	if(header->strings_len > 0 && strings[header->strings_len - 1] != '\0')
+		return false;
+	for(uint32_t i = 0; i < header->n_names; i++) {
+		if((uint64_t) names[i].name_off + names[i].name_len >= header->strings_len)
+			return false;
+	}
+	for(uint32_t i = 0; i < header->n_ips; i++) {
+		if(ips[i].name_off >= header->strings_len)
+			return false;
+	}
+	return true;
+}
+
+
+static inline int dbf_open(const char *bin_path, struct dbf_file *db) {
+	struct stat st;
+
+	memset(db, 0, sizeof *db);
+
+	int fd = open(bin_path, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(struct dbf_header)) {
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	db->map_len = st.st_size;
+	db->map = (const char *) mmap(NULL, db->map_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(db->map == MAP_FAILED) {
+		db->map = NULL;
+		return -1;
+	}
+
+	db->header = (const struct dbf_header *) db->map;
+	if(!dbf_is_valid(db->map, db->map_len)) {
+		munmap((void *) db->map, db->map_len);
+		memset(db, 0, sizeof *db);
+		return -1;
+	}
+
+	db->names = (const struct dbf_name_entry *) (db->map + db->header->names_off);
+	db->ips = (const struct dbf_ip_entry *) (db->map + db->header->ips_off);
+	db->strings = db->map + db->header->strings_off;
+
+	// The indexes are small and hot, the string table is only touched on a hit
+	madvise((void *) db->names, db->header->ips_off - db->header->names_off, MADV_WILLNEED);
+	madvise((void *) db->ips, db->header->strings_off - db->header->ips_off, MADV_WILLNEED);
+	return 0;
+}
+
+
+static inline void dbf_close(struct dbf_file *db) {
+	if(db->map != NULL)
+		munmap((void *) db->map, db->map_len);
+	memset(db, 0, sizeof *db);
+}
+
+
+// Domain name -> IPv4 address in host order and the record's time to live
+static inline bool dbf_find_name(const struct dbf_file *db, const char *name, uint32_t *ip, uint32_t *ttl) {
+	size_t len = strlen(name);
+	uint32_t hash = dbf_hash(name, len);
+	size_t lo = 0, hi = db->header->n_names;
+
+	// Lower bound on the hash, then the (rare) entries sharing it
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(db->names[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for(; lo < db->header->n_names && db->names[lo].hash == hash; lo++) {
+		if(db->names[lo].name_len == len && memcmp(db->strings + db->names[lo].name_off, name, len) == 0) {
+			*ip = db->names[lo].ip;
+			*ttl = db->names[lo].ttl;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+// IPv4 address in host order -> domain name and the record's time to live
+static inline const char *dbf_find_ip(const struct dbf_file *db, uint32_t ip, uint32_t *ttl) {
+	size_t lo = 0, hi = db->header->n_ips;
+
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(db->ips[mid].ip < ip)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if(lo < db->header->n_ips && db->ips[lo].ip == ip) {
+		*ttl = db->ips[lo].ttl;
+		return db->strings + db->ips[lo].name_off;
+	}
+	return NULL;
+}
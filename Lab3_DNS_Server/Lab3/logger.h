@@ -0,0 +1,253 @@
+/*
+ * Leveled logger that keeps stdout off the request path
+ *
+ * log_error(), log_info() and log_debug() take printf arguments, and
+ * cost one comparison when their level is above log_level. An enabled
+ * record is formatted into a ring owned by the calling thread, with no
+ * lock and no system call. A drain thread empties every ring into stdout
+ * in batches, every LOG_DRAIN_MS. A thread that fills its ring faster
+ * than that writes the batch out itself, so no record is ever lost.
+ *
+ * Each record takes a sequence number and the drain merges the rings by
+ * it, so records come out in the order they were logged, give or take
+ * those logged while a batch is written. Whatever is left is written at
+ * exit, and a forked child starts its own drain thread on its first record.
+ *
+ * Levels: error for failures, info for connections and state changes,
+ * debug for every query.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+
+#define LOG_ERROR 0
+#define LOG_INFO 1
+#define LOG_DEBUG 2
+
+#define LOG_RING_SLOTS 512
+#define LOG_LINE_MAX 256
+#define LOG_DRAIN_MS 20
+#define LOG_BATCH 65536
+
+
+#define log_enabled(level) ((level) <= log_level)
+#define log_error(...) do { if(log_enabled(LOG_ERROR)) log_write(__VA_ARGS__); } while(0)
+#define log_info(...) do { if(log_enabled(LOG_INFO)) log_write(__VA_ARGS__); } while(0)
+#define log_debug(...) do { if(log_enabled(LOG_DEBUG)) log_write(__VA_ARGS__); } while(0)
+
+
+struct log_record {
+	uint64_t sequence;
+	uint16_t len;
+	char line[LOG_LINE_MAX];
+};
+
+// Written only by its thread at head, read only by the drain at tail. drained, end and closed_seen
+// are the drain's own cursors while it merges a batch
+struct log_ring {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t drained;
+	uint32_t end;
+	bool closed;
+	bool closed_seen;
+	struct log_ring *next;
+	struct log_record records[LOG_RING_SLOTS];
+};
+
+static int log_level = LOG_INFO;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_mutex_t drain_lock;
+	pthread_key_t key;
+	struct log_ring *rings;
+	bool drain_running;
+	uint64_t sequence;
+} logger = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER};
+
+static __thread struct log_ring *log_thread_ring;
+
+
+// Parsing a --log-level argument, -1 when it is none of error, info or debug
+static inline int log_parse_level(const char *name) {
+	if(strcmp(name, "error") == 0)
+		return LOG_ERROR;
+	if(strcmp(name, "info") == 0)
+		return LOG_INFO;
+	if(strcmp(name, "debug") == 0)
+		return LOG_DEBUG;
+	return -1;
+}
+
+
+// Writing out every record waiting in the rings, and freeing the rings of threads that are gone
+static inline void log_drain(void) {
+	static char batch[LOG_BATCH];
+	size_t len = 0;
+
+	pthread_mutex_lock(&logger.drain_lock);
+	pthread_mutex_lock(&logger.lock);
+	for(struct log_ring *ring = logger.rings; ring; ring = ring->next) {
+		ring->closed_seen = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+		ring->drained = ring->tail;
+		ring->end = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	}
+
+	// Merging what the rings hold by sequence number
+	while(1) {
+		struct log_ring *next = NULL;
+		uint64_t next_sequence = 0;
+
+		for(struct log_ring *ring = logger.rings; ring; ring = ring->next) {
+			if(ring->drained == ring->end)
+				continue;
+			uint64_t sequence = ring->records[ring->drained % LOG_RING_SLOTS].sequence;
+			if(next == NULL || sequence < next_sequence) {
+				next = ring;
+				next_sequence = sequence;
+			}
+		}
+		if(next == NULL)
+			break;
+
+		struct log_record *record = &next->records[next->drained++ % LOG_RING_SLOTS];
+		if(len + record->len > sizeof batch) {
+			fwrite(batch, 1, len, stdout);
+			len = 0;
+		}
+		memcpy(batch + len, record->line, record->len);
+		len += record->len;
+	}
+
+	for(struct log_ring **link = &logger.rings; *link; ) {
+		struct log_ring *ring = *link;
+
+		__atomic_store_n(&ring->tail, ring->drained, __ATOMIC_RELEASE);
+		if(ring->closed_seen) {
+			*link = ring->next;
+			free(ring);
+			continue;
+		}
+		link = &ring->next;
+	}
+	pthread_mutex_unlock(&logger.lock);
+
+	if(len > 0) {
+		fwrite(batch, 1, len, stdout);
+		fflush(stdout);
+	}
+	pthread_mutex_unlock(&logger.drain_lock);
+}
+
+
+static inline void *log_drain_thread(void *args) {
+	pthread_detach(pthread_self());
+
+	while(1) {
+		struct timespec pause = {0, LOG_DRAIN_MS * 1000000L};
+		nanosleep(&pause, NULL);
+		log_drain();
+	}
+	return NULL;
+}
+
+
+// A thread that exits leaves its ring to the drain, which frees it once empty
+static inline void log_thread_exit(void *ring) {
+	__atomic_store_n(&((struct log_ring *) ring)->closed, true, __ATOMIC_RELEASE);
+}
+
+
+static inline void log_fork_prepare(void) {
+	pthread_mutex_lock(&logger.lock);
+	fflush(stdout);
+}
+
+static inline void log_fork_parent(void) {
+	pthread_mutex_unlock(&logger.lock);
+}
+
+// The child has only the forking thread: the records of the others are the parent's to write
+static inline void log_fork_child(void) {
+	pthread_mutex_init(&logger.lock, NULL);
+	pthread_mutex_init(&logger.drain_lock, NULL);
+	logger.drain_running = false;
+
+	for(struct log_ring *ring = logger.rings; ring; ring = ring->next) {
+		ring->tail = ring->head;
+		if(ring != log_thread_ring)
+			ring->closed = true;
+	}
+}
+
+
+static inline void log_exit(void) {
+	log_drain();
+}
+
+
+// Setting the level, called once at startup before any thread logs
+static inline void log_init(int level) {
+	log_level = level;
+	pthread_key_create(&logger.key, log_thread_exit);
+	pthread_atfork(log_fork_prepare, log_fork_parent, log_fork_child);
+	atexit(log_exit);
+}
+
+
+static inline void log_start_drain(void) {
+	pthread_mutex_lock(&logger.lock);
+	if(!logger.drain_running) {
+		pthread_t drain_id;
+		__atomic_store_n(&logger.drain_running, pthread_create(&drain_id, NULL, log_drain_thread, NULL) == 0, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&logger.lock);
+}
+
+
+static inline struct log_ring *log_new_ring(void) {
+	struct log_ring *ring = (struct log_ring *) calloc(1, sizeof *ring);
+
+	if(ring == NULL)
+		return NULL;
+	pthread_setspecific(logger.key, ring);
+
+	pthread_mutex_lock(&logger.lock);
+	ring->next = logger.rings;
+	logger.rings = ring;
+	pthread_mutex_unlock(&logger.lock);
+	return ring;
+}
+
+
+// Formatting one record into the calling thread's ring, use the log_* macros instead
+static inline void __attribute__((format(printf, 1, 2))) log_write(const char *format, ...) {
+	struct log_ring *ring = log_thread_ring;
+	va_list args;
+
+	if(ring == NULL && (ring = log_thread_ring = log_new_ring()) == NULL)
+		return;
+	if(!__atomic_load_n(&logger.drain_running, __ATOMIC_RELAXED))
+		log_start_drain();
+
+	uint32_t head = ring->head;
+	if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS)
+		log_drain();
+
+	struct log_record *record = &ring->records[head % LOG_RING_SLOTS];
+	record->sequence = __atomic_fetch_add(&logger.sequence, 1, __ATOMIC_RELAXED);
+	va_start(args, format);
+	int len = vsnprintf(record->line, LOG_LINE_MAX, format, args);
+	va_end(args);
+	record->len = len < 0 ? 0 : (len < LOG_LINE_MAX ? len : LOG_LINE_MAX - 1);
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -7,14 +7,41 @@
 #include <stdbool.h>
 #include <arpa/inet.h> 
 #include <ctype.h>
+#include <signal.h>
+#include <sys/wait.h>
 
-#define MAX_CONCURRENT_CLIENTS 5
+#include "upstream.h"
+#include "cache.h"
+
+#define DEFAULT_BACKLOG 1024
+#define CLIENT_BUFFER 8192
+#define DEFAULT_CACHE_SIZE 65536
+#define DEFAULT_CACHE_SHARDS 64
+#define DEFAULT_NEGATIVE_TTL 30
+#define DEFAULT_SNAPSHOT_INTERVAL 60
+#define DEFAULT_REFRESH_AHEAD 10
 
 
 const char *DNS_addr;
-char host_cache[3][1024];
-char ip_cache[3][1024];
-int idx = 0;
+bool use_udp = false;
+struct upstream_pool upstream;
+struct upstream_pool refresh_upstream;
+struct cache *cache;
+uint32_t negative_ttl = DEFAULT_NEGATIVE_TTL;
+const char *snapshot_path;
+int snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+int refresh_ahead = DEFAULT_REFRESH_AHEAD;
+int stats_port = 0;
+volatile sig_atomic_t stopping = 0;
+pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+// A pre-forked worker process, restarted by the supervisor whenever it exits
+struct worker {
+	pid_t pid;
+	time_t started;
+	bool datagram;
+};
 
 
 bool isDomainName(char *str){
@@ -25,125 +52,503 @@ bool isIPAddress(char *str){
 	return 1;
 }
 
-bool existsInCache(int status, char *request_msg){
+// Both directions of a resolved pair are cached, so the reverse query hits as well. A prefetched
+// answer was queried ahead of expiry, which only holds for the direction that was asked
+void updateCache(char *request_msg, char *message, int status, uint32_t ttl, bool prefetched){
 
-	if(status == 1) {
-		for(int i = 0; i < 3; i++) {
-			if(strcmp(request_msg, host_cache[i]) == 0)
-				return 1;
-		}
+	if(status == OP_QUERY_NAME) {
+		cache_store(cache, OP_QUERY_NAME, request_msg, message, ttl, prefetched);
+		cache_insert(cache, OP_QUERY_ADDR, message, request_msg, ttl);
 	}
-	else if(status == 2) {
-		for(int i = 0; i < 3; i++) {
-			if(strcmp(request_msg, ip_cache[i]) == 0)
-				return 1;
-		}
+	else if(status == OP_QUERY_ADDR) {
+		cache_store(cache, OP_QUERY_ADDR, request_msg, message, ttl, prefetched);
+		cache_insert(cache, OP_QUERY_NAME, message, request_msg, ttl);
 	}
+}
 
-	return 0;
+
+void printCache() {
+	struct cache_stats stats;
+	
+	cache_get_stats(cache, &stats);
+	log_debug("**************** CACHE *******************\n");
+	log_debug("Entries: %llu/%llu\tHits: %llu\tMisses: %llu\tEvictions: %llu\tExpired: %llu\n\n",
+		(unsigned long long) stats.entries, (unsigned long long) stats.capacity,
+		(unsigned long long) stats.hits, (unsigned long long) stats.misses,
+		(unsigned long long) stats.evictions, (unsigned long long) stats.expirations);
+	for(int i = 0; i < upstream.n_servers; i++) {
+		struct upstream_server *server = &upstream.servers[i];
+		log_debug("DNS Server %s\t%s\tLatency: %.3f ms\n", server->name,
+			__atomic_load_n(&server->healthy, __ATOMIC_RELAXED) ? "up" : "down",
+			__atomic_load_n(&server->ewma_us, __ATOMIC_RELAXED) / 1000.0);
+	}
+	log_debug("Hedged queries: %llu\tFailovers: %llu\n\n",
+		(unsigned long long) stats_total(STAT_UPSTREAM_HEDGES),
+		(unsigned long long) stats_total(STAT_UPSTREAM_FAILOVERS));
 }
 
 
-void updateCache(char *request_msg, char *message, int status){
+// The shared cache, after the counters and histograms on the stats port. Each child keeps
+// its own connections to the DNS Servers, so there is no server state to report from here
+void writeStats(FILE *out) {
+	cache_write_stats(cache, out);
+}
 
-	if(status == 1) {
-		strcpy(host_cache[idx], request_msg);
-		strcpy(ip_cache[idx], message);
-	}
-	else if(status == 2) {
-		strcpy(host_cache[idx], message);
-		strcpy(ip_cache[idx], request_msg);
-	}
-	else {
-		printf("\n\n**************************\n\n");
+
+// Freeing expired records in the background, a slice of every shard each second
+void *sweeper_thread(void *args) {
+	while(1) {
+		sleep(1);
+		cache_sweep(cache, CACHE_SWEEP_BUDGET);
 	}
-	
-	idx = (idx + 1) % 3;
+	return NULL;
 }
 
 
-void retrieveQuery(char *request_msg, char *reply, int status) {
-	if(status == 1) {
-		for(int i = 0; i < 3; i++) {
-			if(strcmp(request_msg, host_cache[i]) == 0)
-				strcpy(reply, ip_cache[i]);
-		}
-	}
-	else if(status == 2) {
-		for(int i = 0; i < 3; i++) {
-			if(strcmp(request_msg, ip_cache[i]) == 0)
-				strcpy(reply, host_cache[i]);
-		}
+// Saving the cache to --snapshot, one save at a time since they all write through the same temporary file
+void saveSnapshot() {
+	pthread_mutex_lock(&snapshot_lock);
+	long n_saved = cache_save(cache, snapshot_path);
+	pthread_mutex_unlock(&snapshot_lock);
+	
+	if(n_saved < 0)
+		log_error("[ERROR]: Unable to save the cache to %s\n", snapshot_path);
+	else
+		log_info("[PROGRESS]: Saved %ld records to %s\n", n_saved, snapshot_path);
+}
+
+// Saving the shared cache to --snapshot every snapshot_interval seconds, from the parent.
+// Saving reads the cache like a lookup, so the children never wait on it
+void *snapshot_thread(void *args) {
+	while(1) {
+		sleep(snapshot_interval);
+		saveSnapshot();
 	}
+	return NULL;
+}
 
+
+// Querying the DNS Server again for a hot record about to expire. The parent has a pool of its own
+// for this, the children must not inherit connections and threads of the one they query through
+void refreshRecord(int type, const char *key) {
+	char reply[MAX_FRAME_BODY];
+	uint32_t ttl = 0;
+	
+	log_debug("[PROGRESS]: Refreshing %s ahead of its expiry\n", key);
+	stats_count(STAT_UPSTREAM_QUERIES);
+	int status = upstream_query(&refresh_upstream, type, key, reply, &ttl);
+	if(status == STATUS_FOUND)
+		updateCache((char *) key, reply, type, ttl, true);
+	else if(status == STATUS_NOT_FOUND)
+		cache_insert(cache, type, key, NULL, negative_ttl);
 }
 
 
-void printCache() {
+// Refreshing, once a second, the records looked up often lately that expire within refresh_ahead seconds
+void *refresher_thread(void *args) {
+	while(1) {
+		sleep(1);
+		cache_scan_hot(cache, refresh_ahead, refreshRecord);
+	}
+	return NULL;
+}
+
+
+int queryServer(int type_of_message, char *request_msg, char *reply, uint32_t *ttl){
+	
+	log_debug("[PROGRESS]: Contacting the server\n");
+	log_debug("[REQUESTED FOR]: %s\n", request_msg);
+	stats_count(STAT_UPSTREAM_QUERIES);
 	
-	printf("**************** CACHE *******************\n");
-	printf("SI NO\tHost\tIP\n");
-	for(int i = 0; i < 3; i++) {
-		printf("%d\t%s\t%s\n", i, host_cache[i], ip_cache[i]);
+	// Multiplexing the query over the long-lived connections to the DNS Server, with --udp a datagram
+	// goes first and TCP only carries the queries it did not answer in time
+	int status = upstream_query(&upstream, type_of_message, request_msg, reply, ttl);
+	if(status == -1) {
+		log_error("[ERROR]: Failed to query the server\n");
 	}
 	
+	return status;
 }
 
 
-int queryServer(char *request_msg, char *reply){
+// Resolving one query, from the cache or the DNS Server. Returns STATUS_FOUND with the answer in
+// reply and its time to live in *ttl, STATUS_NOT_FOUND, 0 for an invalid request or -1 when the server is down
+int resolveQuery(int type_of_message, char *request_msg, char *reply, uint32_t *ttl) {
+	int server_status = 0;
 	
-	printf("[PROGRESS]: Contacting the server\n");
-	printf("[REQUESTED FOR]: %s\n", request_msg);
-	struct sockaddr_in serverAddress;
-	int socket_fd, connection_fd;
 	
+	// Validating the correctess of the domain name/IP addresses
+	if(type_of_message == OP_QUERY_NAME && isDomainName(request_msg) == 0){
+		log_debug("[ERROR]: Invalid Domain Name\n\n");
+		stats_count(STAT_BAD_REQUESTS);
+		return 0;
+	}
+	if(type_of_message == OP_QUERY_ADDR && isIPAddress(request_msg) == 0) {
+		log_debug("[ERROR]: Invalid IP Address\n\n");
+		stats_count(STAT_BAD_REQUESTS);
+		return 0;
+	}
 	
-	// Creating the socket
-	socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if(socket_fd < 0) {
-		printf("[ERROR]: Unable to create socket\n");
-		return -1;
+	if(type_of_message == OP_QUERY_NAME) {
+		stats_count(STAT_QUERIES_NAME);
+		log_debug("Domain Name = %s\n", request_msg);
+		log_debug("[SEARCHING]...\n\n");
+	}
+	else if (type_of_message == OP_QUERY_ADDR) {
+		stats_count(STAT_QUERIES_ADDR);
+		log_debug("I/P Address = %s\n", request_msg);
+		log_debug("[SEARCHING]...\n\n");
 	}
 	else {
-		printf("[SUCCESS]: Socket created\n");
+		log_debug("[ERROR]: Unknown type of message\n\n");
+		stats_count(STAT_BAD_REQUESTS);
+		return 0;
 	}
 	
 	
-	// Configuring socket parameters
-	memset(&serverAddress, '\0', sizeof serverAddress);
+	// Going over every shard for the cache report is only worth it when debugging
+	if(log_enabled(LOG_DEBUG))
+		printCache();
 	
-	serverAddress.sin_family = AF_INET;
-	serverAddress.sin_addr.s_addr = inet_addr(DNS_addr);
-	serverAddress.sin_port = htons(12005);
+	int cached = cache_lookup(cache, type_of_message, request_msg, reply, ttl);
+	if(cached == CACHE_HIT) {
+		stats_count(STAT_CACHE_HITS);
+		log_debug("[PROGRESS]: Found in the Cache!! Retrieving from the Cache\n");
+		return STATUS_FOUND;
+	}
+	if(cached == CACHE_NEGATIVE) {
+		stats_count(STAT_CACHE_NEGATIVE_HITS);
+		log_debug("[PROGRESS]: Known to be missing, from the Cache\n");
+		return STATUS_NOT_FOUND;
+	}
 	
+	log_debug("[PROGRESS]: Record not found in the cache\n");
+	stats_count(STAT_CACHE_MISSES);
+	// Querying the DNS Server
+	server_status = queryServer(type_of_message, request_msg, reply, ttl);
 	
-	// Setting up the connection with DNS Server
-	connection_fd = connect(socket_fd, (struct sockaddr *)&serverAddress, sizeof serverAddress);
+	log_debug("server_status = %d\n", server_status);
+	if(server_status == STATUS_FOUND) {
+		updateCache(request_msg, reply, type_of_message, *ttl, false);
+		log_debug("[PROGRESS]: Cache Updated\n");
+	}
+	else if(server_status == STATUS_NOT_FOUND) {
+		// Remembering misses for a shorter while, so unknown names stop reaching the server
+		cache_insert(cache, type_of_message, request_msg, NULL, negative_ttl);
+	}
+	else if(server_status == -1) {
+		log_error("[ERROR]: Server is down\n");
+	}
+	
+	return server_status;
+}
+
+
+size_t resolveFrame(const struct frame_header *header, const char *payload, char *out) {
+	char request_msg[MAX_FRAME_BODY + 1];
+	char reply[1024] = {0};
+	uint32_t ttl = 0;
+	
+	memcpy(request_msg, payload, header->length);
+	request_msg[header->length] = '\0';
 	
-	if(connection_fd < 0) {
-		printf("[ERROR]: Failed to connect to the server\n");
-		return -1;
+	if(header->flags & FLAG_REPLY) {
+		stats_count(STAT_BAD_REQUESTS);
+		return frame_encode(out, header->request_id, header->opcode, FLAG_REPLY | FLAG_BAD_REQUEST, NULL, 0);
 	}
-	else {
-		printf("[SUCCESS]: Connected to the server\n");
+	
+	int status = resolveQuery(header->opcode, request_msg, reply, &ttl);
+	if(status == 0) {
+		return frame_encode(out, header->request_id, header->opcode, FLAG_REPLY | FLAG_BAD_REQUEST, NULL, 0);
+	}
+	if(status != STATUS_FOUND) {
+		return frame_encode(out, header->request_id, header->opcode, status_flags(status), NULL, 0);
 	}
 	
-	// Sending query to the DNS Server
-	send(socket_fd, request_msg, strlen(request_msg), 0);
+	log_debug("[RESULT]: %s\n\n", reply);
+	return frame_encode_answer(out, header->request_id, header->opcode, ttl, reply, strlen(reply));
+}
+
+
+// Answering one query frame from a client, writes the whole reply frame into out and returns its length
+size_t answerFrame(const struct frame_header *header, const char *payload, char *out) {
+	uint64_t started = stats_now_ns();
+	size_t out_len = resolveFrame(header, payload, out);
 	
+	stats_observe(STAT_QUERY_LATENCY, stats_now_ns() - started);
+	return out_len;
+}
+
+
+// Serving one client connection: every recv may bring several pipelined queries,
+// whose replies go back together in one send
+// Sending a whole buffer on a blocking socket: a signal such as SIGCHLD can cut a send short,
+// which would leave half a frame on the stream. False when the client is gone
+bool sendAll(int fd, const char *buf, size_t len) {
+	while(len > 0) {
+		ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+		if(sent > 0) {
+			buf += sent;
+			len -= sent;
+		}
+		else if(sent < 0 && errno == EINTR) {
+			continue;
+		}
+		else {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+void serveClient(int connection_fd) {
+	char in[CLIENT_BUFFER];
+	char out[CLIENT_BUFFER];
+	size_t in_len = 0;
 	
-	memset(reply, 0, strlen(reply));
-	int recv_status = recv(socket_fd, reply, 1024, 0); 
-	close(socket_fd);
+	while(1) {
+		// Receiving the requested messages from the client
+		int recv_status = recv(connection_fd, in + in_len, sizeof in - in_len, 0); 
+		
+		// Client closed the connection
+		if(recv_status <= 0) {
+			log_info("[CLOSE]: Client is down\n\n");
+			break;
+		}
+		in_len += recv_status;
+		
+		size_t offset = 0, out_len = 0;
+		struct frame_header header;
+		const char *payload;
+		int parsed;
+		
+		while((parsed = frame_parse(in, in_len, &offset, &header, &payload)) == 1) {
+			if(sizeof out - out_len < MAX_FRAME_LEN) {
+				if(!sendAll(connection_fd, out, out_len))
+					break;
+				out_len = 0;
+			}
+			out_len += answerFrame(&header, payload, out + out_len);
+		}
+		if(parsed < 0) {
+			log_error("[ERROR]: Malformed frame from the client\n");
+			break;
+		}
+		// Only a failed send leaves the loop on a parsed frame
+		if(parsed == 1)
+			break;
+		
+		// Replying to the Client
+		if(out_len > 0 && !sendAll(connection_fd, out, out_len)) {
+			break;
+		}
+		
+		memmove(in, in + offset, in_len - offset);
+		in_len -= offset;
+	}
+}
+
+
+// Answering clients that query over UDP, one frame per datagram
+void serveDatagrams(int socket_fd) {
 	
-	if(reply[0] == '-') {
-		return -1;
+	while(1) {
+		char buffer[MAX_FRAME_LEN];
+		char reply[MAX_FRAME_LEN];
+		struct sockaddr_in clientAddress;
+		socklen_t clientAddress_len = sizeof clientAddress;
+		struct frame_header header;
+		const char *payload;
+		size_t offset = 0;
+		
+		int recv_status = recvfrom(socket_fd, buffer, sizeof buffer, 0, (struct sockaddr *)&clientAddress, &clientAddress_len);
+		if(recv_status <= 0 || frame_parse(buffer, recv_status, &offset, &header, &payload) != 1) {
+			continue;
+		}
+		
+		size_t reply_len = answerFrame(&header, payload, reply);
+		sendto(socket_fd, reply, reply_len, 0, (struct sockaddr *)&clientAddress, clientAddress_len);
+	}
+}
+
+
+// Reaping the children of fork-per-connection mode as they exit, so none is left a zombie
+void reapChildren(int signal_no) {
+	int saved_errno = errno;
+	
+	while(waitpid(-1, NULL, WNOHANG) > 0)
+		;
+	errno = saved_errno;
+}
+
+
+void requestStop(int signal_no) {
+	stopping = 1;
+}
+
+
+// Body of a pre-forked worker: accepting and serving one client at a time, for as long as it lives.
+// The workers block in accept on the listening socket they inherited, and the kernel hands
+// each connection to one of them
+void acceptLoop(int socket_fd) {
+	while(1) {
+		int connection_fd = accept(socket_fd, NULL, NULL);
+		if(connection_fd < 0) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			log_error("[ERROR]: Refused to connect\n");
+			exit(EXIT_FAILURE);
+		}
+		log_info("[SUCCESS]: Connection Established\n");
+		stats_count(STAT_CONNECTIONS_OPENED);
+		
+		serveClient(connection_fd);
+		close(connection_fd);
+		stats_count(STAT_CONNECTIONS_CLOSED);
+	}
+}
+
+
+// The stop signals are held back across fork() until the child has dropped the supervisor's handler for them,
+// or a SIGTERM sent to a worker that just started would only set its copy of stopping
+void startWorker(struct worker *worker, int socket_fd, int datagram_fd) {
+	sigset_t stop_signals, saved_mask;
+	
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGTERM);
+	sigaddset(&stop_signals, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &saved_mask);
+	pid_t pid = fork();
+	
+	if(pid == 0) {
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+		if(worker->datagram) {
+			close(socket_fd);
+			serveDatagrams(datagram_fd);
+		}
+		else {
+			if(datagram_fd >= 0)
+				close(datagram_fd);
+			acceptLoop(socket_fd);
+		}
+		exit(0);
+	}
+	pthread_sigmask(SIG_SETMASK, &saved_mask, NULL);
+	if(pid < 0)
+		log_error("[ERROR]: Could not start a worker\n");
+	worker->pid = pid;
+	worker->started = time(NULL);
+}
+
+
+// Starting the threads of the parent: the stats port, the snapshots, the sweeper and the refresher.
+// A child forked after this inherits the state of threads it does not have: the cache locks are shared
+// with the parent's threads that hold them, and upstream.h, stats.h and logger.h reset the rest in the child
+bool startHousekeeping() {
+	
+	// The parent adds up the slots of every child on 127.0.0.1 when asked for
+	if(stats_port > 0 && !stats_serve(stats_port, writeStats)) {
+		printf("[ERROR]: Unable to serve statistics on port %d\n", stats_port);
+		return false;
+	}
+	
+	pthread_t snapshot_id;
+	if(snapshot_path != NULL && pthread_create(&snapshot_id, NULL, snapshot_thread, NULL) != 0) {
+		printf("[ERROR]: Could not create thread\n");
+		return false;
 	}
 	
-	return (reply[0] - '0');
+	// The parent only accepts, its sweeper frees expired records on behalf of every child
+	pthread_t sweeper_id;
+	if(pthread_create(&sweeper_id, NULL, sweeper_thread, NULL) != 0) {
+		printf("[ERROR]: Could not create thread\n");
+		return false;
+	}
+	
+	// Keeping hot records from ever expiring under the clients that ask for them
+	pthread_t refresher_id;
+	if(refresh_ahead > 0 && pthread_create(&refresher_id, NULL, refresher_thread, NULL) != 0) {
+		printf("[ERROR]: Could not create thread\n");
+		return false;
+	}
+	return true;
 }
 
 
+// Keeping n_workers accepting processes, and the datagram one with --udp, running until SIGTERM:
+// every worker that exits is reaped and replaced, after a second if it did not last one. The first
+// workers are forked before the parent starts any thread. False if those threads could not be started
+bool superviseWorkers(int socket_fd, int datagram_fd, int n_workers) {
+	int n = n_workers + (datagram_fd >= 0 ? 1 : 0);
+	struct worker *workers = (struct worker *) calloc(n, sizeof *workers);
+	struct sigaction stop_action;
+	
+	memset(&stop_action, 0, sizeof stop_action);
+	stop_action.sa_handler = requestStop;
+	sigaction(SIGTERM, &stop_action, NULL);
+	sigaction(SIGINT, &stop_action, NULL);
+	
+	for(int i = 0; i < n; i++) {
+		workers[i].datagram = i == n_workers;
+		startWorker(&workers[i], socket_fd, datagram_fd);
+	}
+	printf("[SUCCESS]: Started %d worker(s)\n", n_workers);
+	
+	bool started = startHousekeeping();
+	if(!started)
+		stopping = 1;
+	
+	while(!stopping) {
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if(pid < 0) {
+			if(errno == EINTR)
+				continue;
+			
+			// Nothing left to wait for: workers that could not be forked are tried again
+			sleep(1);
+			for(int i = 0; i < n; i++) {
+				if(workers[i].pid < 0)
+					startWorker(&workers[i], socket_fd, datagram_fd);
+			}
+			continue;
+		}
+		
+		for(int i = 0; i < n; i++) {
+			if(workers[i].pid != pid)
+				continue;
+			
+			if(WIFSIGNALED(status))
+				log_error("[ERROR]: Worker %d killed by signal %d, restarting it\n", (int) pid, WTERMSIG(status));
+			else
+				log_error("[ERROR]: Worker %d exited with status %d, restarting it\n", (int) pid, WEXITSTATUS(status));
+			
+			// Not forking in a tight loop when a worker dies as soon as it starts
+			if(time(NULL) - workers[i].started < 1)
+				sleep(1);
+			if(!stopping)
+				startWorker(&workers[i], socket_fd, datagram_fd);
+			break;
+		}
+	}
+	
+	for(int i = 0; i < n; i++) {
+		if(workers[i].pid > 0)
+			kill(workers[i].pid, SIGTERM);
+	}
+	while(waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+		;
+	free(workers);
+	
+	// Nothing writes to the cache any more, the snapshot holds all of it
+	if(started && snapshot_path != NULL)
+		saveSnapshot();
+	return started;
+}
+
 
 int main(int argc, char const *argv[]) 
 { 
@@ -152,13 +557,114 @@ int main(int argc, char const *argv[])
 	
 	
 	// Validating User Parameters
-	if(argc != 3) {
-		printf("[USAGE]: <executable code> <DNS IP Address> <Server Port number>\n");
+	char *USAGE = "[USAGE]: <executable code> <DNS IP Address> <Server Port number> [--udp] [--upstream-conns N] [--cache-size N] [--cache-shards N] [--negative-ttl N] [--upstream host[:port],...] [--log-level error|info|debug] [--stats-port N] [--prefork N] [--backlog N] [--snapshot FILE] [--snapshot-interval N] [--refresh-ahead N]\n";
+	int n_upstream_conns = 1;
+	long cache_size = DEFAULT_CACHE_SIZE;
+	int level = LOG_INFO;
+	long cache_shards = DEFAULT_CACHE_SHARDS;
+	int n_prefork = 0;
+	int backlog = DEFAULT_BACKLOG;
+	
+	if(argc < 3) {
+		printf("%s", USAGE);
 		return 0;
 	}
+	for(int i = 3; i < argc; i++) {
+		if(strcmp(argv[i], "--udp") == 0) {
+			use_udp = true;
+		}
+		else if(strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+			snapshot_path = argv[++i];
+		}
+		else if(strcmp(argv[i], "--snapshot-interval") == 0 && i + 1 < argc) {
+			snapshot_interval = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--refresh-ahead") == 0 && i + 1 < argc) {
+			refresh_ahead = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--prefork") == 0 && i + 1 < argc) {
+			n_prefork = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+			backlog = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--stats-port") == 0 && i + 1 < argc) {
+			stats_port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+			level = log_parse_level(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--upstream") == 0 && i + 1 < argc) {
+			DNS_addr = argv[++i];
+		}
+		else if(strcmp(argv[i], "--upstream-conns") == 0 && i + 1 < argc) {
+			n_upstream_conns = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+			cache_size = atol(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--cache-shards") == 0 && i + 1 < argc) {
+			cache_shards = atol(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--negative-ttl") == 0 && i + 1 < argc) {
+			negative_ttl = atoi(argv[++i]);
+		}
+		else {
+			printf("%s", USAGE);
+			return 0;
+		}
+	}
+	if(n_upstream_conns < 1 || level < 0 || n_prefork < 0 || backlog < 1 || snapshot_interval < 1 || refresh_ahead < 0) {
+		printf("%s", USAGE);
+		return 0;
+	}
+	log_init(level);
+	
+	// Every child records into its own slot of the same shared statistics
+	if(!stats_create(STATS_PROXY, true)) {
+		printf("[ERROR]: Unable to map the shared statistics\n");
+		exit(EXIT_FAILURE);
+	}
 	
 	int PORT_NO = atoi(argv[2]);
-	DNS_addr = argv[1];
+	
+	// The DNS Servers default to the one given on the command line, on its usual port
+	if(DNS_addr == NULL)
+		DNS_addr = argv[1];
+	if(!upstream_init(&upstream, DNS_addr, 12005, n_upstream_conns)) {
+		printf("[ERROR]: Invalid DNS Server address in %s\n", DNS_addr);
+		printf("%s", USAGE);
+		return 0;
+	}
+	upstream.use_udp = use_udp;
+	upstream_init(&refresh_upstream, DNS_addr, 12005, 1);
+	refresh_upstream.use_udp = use_udp;
+	
+	// Shards must be a power of two, the shard is picked by the top bits of the key hash
+	if(cache_size < 1 || cache_shards < 1 || (cache_shards & (cache_shards - 1)) != 0) {
+		printf("[ERROR]: --cache-shards must be a power of two\n");
+		printf("%s", USAGE);
+		return 0;
+	}
+	if(cache_shards > cache_size) {
+		cache_shards = 1;
+		while(cache_shards * 2 <= cache_size)
+			cache_shards *= 2;
+	}
+	
+	// Mapping the cache into shared memory before any fork, so every child answers from the same records
+	cache = cache_create_shared(cache_size, cache_shards);
+	if(cache == NULL) {
+		printf("[ERROR]: Unable to map the shared cache\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	// Starting warm from the last snapshot, less what expired while the proxy was down
+	if(snapshot_path != NULL) {
+		long n_loaded = cache_load(cache, snapshot_path);
+		if(n_loaded >= 0)
+			printf("[SUCCESS]: Loaded %ld records from %s\n", n_loaded, snapshot_path);
+	}
 	
 	
 	// Creating the socket  
@@ -190,8 +696,9 @@ int main(int argc, char const *argv[])
 	}
 	
 	
-	// Listening for the requests from the Clients
-	if(listen(socket_fd, MAX_CONCURRENT_CLIENTS) < 0) { 
+	// Listening for the requests from the Clients, the kernel caps the backlog at net.core.somaxconn.
+	// With --prefork every worker accepts from this one queue, so it must absorb bursts for all of them
+	if(listen(socket_fd, backlog) < 0) { 
 		printf("[ERROR]: Unable to Listen\n");
 		exit(EXIT_FAILURE); 
 	} 
@@ -200,6 +707,43 @@ int main(int argc, char const *argv[])
 	}
 	
 	
+	// Serving UDP clients on the same port number alongside TCP, from a process of their own
+	int datagram_fd = -1;
+	if(use_udp) {
+		datagram_fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if(datagram_fd < 0 || bind(datagram_fd, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0) {
+			printf("[ERROR]: Failed to bind to the socket\n");
+			exit(EXIT_FAILURE);
+		}
+		printf("[SUCCESS]: Listening for datagrams\n");
+	}
+	
+	// With --prefork the workers accept for themselves and this process only supervises them
+	if(n_prefork > 0) {
+		if(!superviseWorkers(socket_fd, datagram_fd, n_prefork))
+			exit(EXIT_FAILURE);
+		printf("[COMPLETED]: Proxy Server Closed\n");
+		close(socket_fd);
+		return 0;
+	}
+	
+	struct sigaction reap_action;
+	memset(&reap_action, 0, sizeof reap_action);
+	reap_action.sa_handler = reapChildren;
+	reap_action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &reap_action, NULL);
+	
+	if(use_udp) {
+		if(fork() == 0) {
+			close(socket_fd);
+			serveDatagrams(datagram_fd);
+			exit(0);
+		}
+		close(datagram_fd);
+	}
+	
+	if(!startHousekeeping())
+		exit(EXIT_FAILURE);
 	
 	while(1) {
 		
@@ -207,98 +751,28 @@ int main(int argc, char const *argv[])
 		int clientAddress_len = sizeof clientAddress ;
 		connection_fd =  accept(socket_fd, (struct sockaddr *)&clientAddress, &clientAddress_len);
 
+		if(connection_fd < 0 && (errno == EINTR || errno == ECONNABORTED)) {
+			continue;
+		}
 		if(connection_fd < 0) { 
 			printf("[ERROR]: Refused to connect\n"); 
 			exit(EXIT_FAILURE); 
 		} 
 		else {
-			printf("[SUCCESS]: Connection Established\n");
+			log_info("[SUCCESS]: Connection Established\n");
+			stats_count(STAT_CONNECTIONS_OPENED);
 		}
 		
 		// Using multiprocess technique to serve for concurrent clients
 		int child = fork();
 		if(child == 0){
 			
-			//Infinite loop to serve for multiple requets from the single client
-			while(1) {
-				char *reply = (char *) malloc(1024);
-				char buffer[1024] = {0}; 
-	
-				memset(buffer, 0, strlen(buffer));
-				
-				// Receiving the requested message from the client
-				int recv_status = recv(connection_fd, buffer, 1024, 0); 
-				int type_of_message = buffer[0] - '0';
-				printf("[PROGRESS]: Type of message received from the Client = %d\n", type_of_message);
-				
-				// Client closed the connection
-				if(type_of_message == 0) {
-					break;
-				}
-				
-				int server_status = 0;
-				char request_msg[strlen(buffer) - 2];
-				memcpy(request_msg, &buffer[2], strlen(buffer) - 2);
-				request_msg[strlen(buffer) - 2] = '\0';
-	
-				
-				// Validating the correctess of the domain name/IP addresses
-				if(type_of_message == 1 && isDomainName(request_msg) == 0){
-					printf("[ERROR]: Invalid Domain Name\n\n");
-					continue;
-				}
-				if(type_of_message == 2 && isIPAddress(request_msg) == 0) {
-					printf("[ERROR]: Invalid IP Address\n\n");
-					continue;
-				}
-				
-				if(type_of_message == 1) {
-					printf("Domain Name = %s\n", request_msg);
-					printf("[SEARCHING]...\n\n");
-				}
-				else if (type_of_message == 2) {
-					printf("I/P Address = %s\n", request_msg);
-					printf("[SEARCHING]...\n\n");
-				}
-				else {
-					printf("[CLOSE]: Client is down\n\n");
-				}
-
-				
-				printCache();
-				bool flg = existsInCache(type_of_message, request_msg);
-				
-				if(recv_status != 0) {
-					if(flg) {
-						retrieveQuery(request_msg, reply, type_of_message);
-						printf("[PROGRESS]: Found in the Cache!! Retrieving from the Cache\n");
-					}
-					else {
-						
-						printf("[PROGRESS]: Record not found in the cache\n");
-						// Querying the DNS Server
-						server_status = queryServer(buffer, reply);
-						
-						printf("server_status = %d\n", server_status);
-						if(server_status == 3) {
-							updateCache(request_msg, reply, type_of_message);
-							printf("[PROGRESS]: Cache Updated\n");
-						}
-						else if(server_status == -1) {
-							printf("[ERROR]: Server is down\n");
-							break;
-						}
-					}
-				}
-				printf("[RESULT]: %s\n", reply);
-				
-				// Replying to the Client
-				send(connection_fd, reply, strlen(reply), 0);
-				
-			}
+			// Serving for multiple requets from the single client
+			serveClient(connection_fd);
 			
 			// Client closed
 			close(connection_fd);
+			stats_count(STAT_CONNECTIONS_CLOSED);
 			exit(0);
 		}
 		close(connection_fd);
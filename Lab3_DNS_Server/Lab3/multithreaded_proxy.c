@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h> 
 #include <stdio.h> 
 #include <sys/socket.h> 
@@ -8,15 +9,116 @@
 #include <arpa/inet.h> 
 #include <ctype.h>
 #include <pthread.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
 
-#define MAX_CONCURRENT_CLIENTS 5
+#include "upstream.h"
+#include "cache.h"
+#include "pool.h"
+
+#define MAX_CONCURRENT_CLIENTS 256
+#define DEFAULT_WORKERS 8
+#define WORK_QUEUE_LEN 128
+#define MAX_EVENTS 256
+#define CLIENT_BUFFER 8192
+#define DEFAULT_UPSTREAM_CONNS 4
+#define DEFAULT_CACHE_SIZE 65536
+#define DEFAULT_CACHE_SHARDS 64
+#define DEFAULT_NEGATIVE_TTL 30
+#define DEFAULT_SNAPSHOT_INTERVAL 60
+#define DEFAULT_REFRESH_AHEAD 10
+#define FLIGHT_STRIPES 64
 
 
 const char *DNS_addr;
 int PORT_NO;
-char host_cache[3][1024];
-char ip_cache[3][1024];
-int idx = 0;
+bool use_udp = false;
+struct upstream_pool upstream;
+struct cache *cache;
+uint32_t negative_ttl = DEFAULT_NEGATIVE_TTL;
+const char *snapshot_path;
+int snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+int refresh_ahead = DEFAULT_REFRESH_AHEAD;
+sigset_t stop_signals;
+
+
+// A unit of work for the pool: serving a readable client or delivering an answer from the DNS Server
+struct task {
+	void (*run)(struct task *task);
+	struct task *next;
+};
+
+// Tasks waiting for a worker. The acceptor blocks while WORK_QUEUE_LEN are queued, leaving further
+// requests in the kernel; answers from the DNS Server are always queued, as their reader must not block
+struct work_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	struct task *head;
+	struct task *tail;
+	size_t len;
+} work;
+
+
+// One connected client. Its read task runs each time the socket turns readable, and every answer still
+// awaited from the DNS Server holds a reference, so the socket is closed only once the last one is delivered
+struct client {
+	struct task read;
+	int fd;
+	int refs;
+	bool closed;
+	pthread_mutex_t send_lock;
+	size_t in_len;
+	char in[CLIENT_BUFFER];
+};
+
+// Where an answer goes: a TCP client, or the sender of a datagram when client is NULL
+struct reply_to {
+	struct client *client;
+	int datagram_fd;
+	struct sockaddr_in address;
+	socklen_t address_len;
+};
+
+// A query answered once the DNS Server replies, delivered by a worker
+struct answer_waiter {
+	struct task deliver;
+	struct reply_to to;
+	uint32_t request_id;
+	uint64_t started;
+	int opcode;
+	int status;
+	uint32_t ttl;
+	char reply[MAX_FRAME_BODY];
+	struct answer_waiter *next;
+};
+
+// A query to the DNS Server in progress, answering every query that missed the same record meanwhile.
+// A refresh of a hot record ahead of its expiry starts with no waiter
+struct flight {
+	struct upstream_pending pending;
+	bool refresh;
+	struct answer_waiter *waiters;
+	struct flight *next;
+};
+
+struct flight_stripe {
+	pthread_mutex_t lock;
+	struct flight *head;
+} flights[FLIGHT_STRIPES];
+
+// Clients, waiters and flights are recycled, so a query that misses the cache allocates nothing
+struct pool client_pool, waiter_pool, flight_pool;
+
+
+int epoll_fd;
+int listen_fd;
+int max_clients = MAX_CONCURRENT_CLIENTS;
+int n_clients = 0;
+pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 bool isDomainName(char *str){
@@ -27,225 +129,737 @@ bool isIPAddress(char *str){
 	return 1;
 }
 
-bool existsInCache(int status, char *request_msg){
+// Both directions of a resolved pair are cached, so the reverse query hits as well. A prefetched
+// answer was queried ahead of expiry, which only holds for the direction that was asked
+void updateCache(char *request_msg, char *message, int status, uint32_t ttl, bool prefetched){
 
-	if(status == 1) {
-		for(int i = 0; i < 3; i++) {
-			if(strcmp(request_msg, host_cache[i]) == 0)
-				return 1;
-		}
+	if(status == OP_QUERY_NAME) {
+		cache_store(cache, OP_QUERY_NAME, request_msg, message, ttl, prefetched);
+		cache_insert(cache, OP_QUERY_ADDR, message, request_msg, ttl);
+	}
+	else if(status == OP_QUERY_ADDR) {
+		cache_store(cache, OP_QUERY_ADDR, request_msg, message, ttl, prefetched);
+		cache_insert(cache, OP_QUERY_NAME, message, request_msg, ttl);
+	}
+}
+
+
+void printCache() {
+	struct cache_stats stats;
+	
+	cache_get_stats(cache, &stats);
+	log_debug("**************** CACHE *******************\n");
+	log_debug("Entries: %llu/%llu\tHits: %llu\tMisses: %llu\tEvictions: %llu\tExpired: %llu\n\n",
+		(unsigned long long) stats.entries, (unsigned long long) stats.capacity,
+		(unsigned long long) stats.hits, (unsigned long long) stats.misses,
+		(unsigned long long) stats.evictions, (unsigned long long) stats.expirations);
+	for(int i = 0; i < upstream.n_servers; i++) {
+		struct upstream_server *server = &upstream.servers[i];
+		log_debug("DNS Server %s\t%s\tLatency: %.3f ms\n", server->name,
+			__atomic_load_n(&server->healthy, __ATOMIC_RELAXED) ? "up" : "down",
+			__atomic_load_n(&server->ewma_us, __ATOMIC_RELAXED) / 1000.0);
+	}
+	log_debug("Hedged queries: %llu\tFailovers: %llu\n\n",
+		(unsigned long long) stats_total(STAT_UPSTREAM_HEDGES),
+		(unsigned long long) stats_total(STAT_UPSTREAM_FAILOVERS));
+	log_debug("Upstream queries: %llu\tCoalesced misses: %llu\n\n",
+		(unsigned long long) stats_total(STAT_UPSTREAM_QUERIES),
+		(unsigned long long) stats_total(STAT_COALESCED));
+}
+
+
+// The cache and the DNS Servers, after the counters and histograms on the stats port
+void writeStats(FILE *out) {
+	cache_write_stats(cache, out);
+	upstream_write_stats(&upstream, out);
+	pool_write_stats(out);
+}
+
+
+// Freeing expired records in the background, a slice of every shard each second
+void *sweeper_thread(void *args) {
+	while(1) {
+		sleep(1);
+		cache_sweep(cache, CACHE_SWEEP_BUDGET);
 	}
-	else if(status == 2) {
-		for(int i = 0; i < 3; i++) {
-			if(strcmp(request_msg, ip_cache[i]) == 0)
-				return 1;
+	return NULL;
+}
+
+
+// Saving the cache to --snapshot every snapshot_interval seconds, and a last time on SIGTERM or SIGINT,
+// which every other thread keeps blocked. Saving reads the cache like a lookup and holds no lock
+void *snapshot_thread(void *args) {
+	while(1) {
+		struct timespec interval = {snapshot_interval, 0};
+		int signal_no = sigtimedwait(&stop_signals, NULL, &interval);
+		if(signal_no < 0 && errno == EINTR)
+			continue;
+		
+		long n_saved = cache_save(cache, snapshot_path);
+		if(n_saved < 0)
+			log_error("[ERROR]: Unable to save the cache to %s\n", snapshot_path);
+		else
+			log_info("[PROGRESS]: Saved %ld records to %s\n", n_saved, snapshot_path);
+		
+		if(signal_no > 0) {
+			printf("[COMPLETED]: Proxy Server Closed\n");
+			exit(0);
 		}
 	}
+	return NULL;
+}
 
-	return 0;
+
+void workPush(struct task *task, bool bounded) {
+	pthread_mutex_lock(&work.lock);
+	while(bounded && work.len >= WORK_QUEUE_LEN)
+		pthread_cond_wait(&work.not_full, &work.lock);
+	task->next = NULL;
+	if(work.tail != NULL)
+		work.tail->next = task;
+	else
+		work.head = task;
+	work.tail = task;
+	work.len++;
+	pthread_cond_signal(&work.not_empty);
+	pthread_mutex_unlock(&work.lock);
 }
 
 
-void updateCache(char *request_msg, char *message, int status){
+struct task *workPop() {
+	pthread_mutex_lock(&work.lock);
+	while(work.head == NULL)
+		pthread_cond_wait(&work.not_empty, &work.lock);
+	struct task *task = work.head;
+	work.head = task->next;
+	if(work.head == NULL)
+		work.tail = NULL;
+	if(work.len-- == WORK_QUEUE_LEN)
+		pthread_cond_signal(&work.not_full);
+	pthread_mutex_unlock(&work.lock);
+	return task;
+}
+
 
-	if(status == 1) {
-		strcpy(host_cache[idx], request_msg);
-		strcpy(ip_cache[idx], message);
+// Sending a whole buffer on a non-blocking socket, false when the client is gone
+bool sendAll(int fd, const char *buf, size_t len) {
+	while(len > 0) {
+		ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+		if(sent > 0) {
+			buf += sent;
+			len -= sent;
+		}
+		else if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd writable = {fd, POLLOUT, 0};
+			if(poll(&writable, 1, UPSTREAM_TIMEOUT_MS) <= 0)
+				return false;
+		}
+		else if(sent < 0 && errno == EINTR) {
+			continue;
+		}
+		else {
+			return false;
+		}
 	}
-	else if(status == 2) {
-		strcpy(host_cache[idx], message);
-		strcpy(ip_cache[idx], request_msg);
+	return true;
+}
+
+
+// Dropping a reference to a client, the last one closes its socket
+void releaseClient(struct client *client) {
+	if(__atomic_sub_fetch(&client->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		close(client->fd);
+		pthread_mutex_destroy(&client->send_lock);
+		pool_put(&client_pool, client);
+	}
+}
+
+
+// Sending replies to a client, whole frames at a time so that answers delivered meanwhile never interleave.
+// A client that stopped reading is shut down, and its read task then closes it
+void replyToClient(struct client *client, const char *out, size_t out_len) {
+	pthread_mutex_lock(&client->send_lock);
+	if(!client->closed && !sendAll(client->fd, out, out_len))
+		shutdown(client->fd, SHUT_RDWR);
+	pthread_mutex_unlock(&client->send_lock);
+}
+
+
+// Sending an answer that arrived from the DNS Server to the query waiting for it
+void deliverAnswer(struct task *task) {
+	struct answer_waiter *waiter = (struct answer_waiter *) task;
+	char out[MAX_FRAME_LEN];
+	size_t out_len;
+	
+	if(waiter->status == STATUS_FOUND) {
+		log_debug("[RESULT]: %s\n\n", waiter->reply);
+		out_len = frame_encode_answer(out, waiter->request_id, waiter->opcode, waiter->ttl, waiter->reply, strlen(waiter->reply));
 	}
 	else {
-		printf("\n\n**************************\n\n");
+		out_len = frame_encode(out, waiter->request_id, waiter->opcode, status_flags(waiter->status), NULL, 0);
 	}
 	
-	idx = (idx + 1) % 3;
+	if(waiter->to.client != NULL) {
+		replyToClient(waiter->to.client, out, out_len);
+		releaseClient(waiter->to.client);
+	}
+	else {
+		sendto(waiter->to.datagram_fd, out, out_len, 0, (struct sockaddr *) &waiter->to.address, waiter->to.address_len);
+	}
+	stats_observe(STAT_QUERY_LATENCY, stats_now_ns() - waiter->started);
+	pool_put(&waiter_pool, waiter);
 }
 
 
-void retrieveQuery(char *request_msg, char *reply, int status) {
-	if(status == 1) {
-		for(int i = 0; i < 3; i++) {
-			if(strcmp(request_msg, host_cache[i]) == 0)
-				strcpy(reply, ip_cache[i]);
+// Handing the answer of a flight to every query waiting on it
+void landFlight(struct flight *flight) {
+	struct flight_stripe *stripe = &flights[cache_hash(flight->pending.opcode, flight->pending.request) % FLIGHT_STRIPES];
+	
+	// The answer is cached by now, so queries missing from here on find it there
+	pthread_mutex_lock(&stripe->lock);
+	for(struct flight **link = &stripe->head; *link; link = &(*link)->next) {
+		if(*link == flight) {
+			*link = flight->next;
+			break;
 		}
 	}
-	else if(status == 2) {
-		for(int i = 0; i < 3; i++) {
-			if(strcmp(request_msg, ip_cache[i]) == 0)
-				strcpy(reply, host_cache[i]);
-		}
+	pthread_mutex_unlock(&stripe->lock);
+	
+	while(flight->waiters != NULL) {
+		struct answer_waiter *waiter = flight->waiters;
+		flight->waiters = waiter->next;
+		
+		waiter->status = flight->pending.status;
+		waiter->ttl = flight->pending.ttl;
+		strcpy(waiter->reply, flight->pending.reply);
+		workPush(&waiter->deliver, false);
 	}
+	pool_put(&flight_pool, flight);
+}
+
 
+// Caching the answer of the DNS Server, called by the upstream pool when the query completes
+void flightAnswered(struct upstream_pending *pending) {
+	struct flight *flight = (struct flight *) pending;
+	
+	log_debug("server_status = %d\n", pending->status);
+	if(pending->status == STATUS_FOUND) {
+		updateCache(pending->request, pending->reply, pending->opcode, pending->ttl, flight->refresh);
+		log_debug("[PROGRESS]: Cache Updated\n");
+	}
+	else if(pending->status == STATUS_NOT_FOUND) {
+		// Remembering misses for a shorter while, so unknown names stop reaching the server
+		cache_insert(cache, pending->opcode, pending->request, NULL, negative_ttl);
+	}
+	else {
+		log_error("[ERROR]: Server is down\n");
+	}
+	
+	landFlight(flight);
 }
 
 
-void printCache() {
+// Answering a missed record once the DNS Server replies, with at most one query in flight per record:
+// the first miss sends it, the others that miss the record meanwhile wait on the same flight
+void deferAnswer(const struct reply_to *to, const struct frame_header *header, char *request_msg, uint64_t started) {
+	struct flight_stripe *stripe = &flights[cache_hash(header->opcode, request_msg) % FLIGHT_STRIPES];
+	struct answer_waiter *waiter = (struct answer_waiter *) pool_get(&waiter_pool);
+	struct flight *flight;
+	
+	if(waiter == NULL) {
+		log_error("[ERROR]: Out of memory, dropping the query\n");
+		return;
+	}
+	memset(waiter, 0, offsetof(struct answer_waiter, reply));
+	waiter->next = NULL;
+	waiter->deliver.run = deliverAnswer;
+	waiter->to = *to;
+	waiter->request_id = header->request_id;
+	waiter->started = started;
+	waiter->opcode = header->opcode;
+	if(to->client != NULL)
+		__atomic_add_fetch(&to->client->refs, 1, __ATOMIC_RELAXED);
+	
+	pthread_mutex_lock(&stripe->lock);
+	for(flight = stripe->head; flight; flight = flight->next) {
+		if(flight->pending.opcode == header->opcode && strcmp(flight->pending.request, request_msg) == 0)
+			break;
+	}
+	
+	if(flight != NULL) {
+		waiter->next = flight->waiters;
+		flight->waiters = waiter;
+		pthread_mutex_unlock(&stripe->lock);
+		stats_count(STAT_COALESCED);
+		log_debug("[PROGRESS]: Waiting for the query already sent for this record\n");
+		return;
+	}
 	
-	printf("**************** CACHE *******************\n");
-	printf("SI NO\tHost\tIP\n");
-	for(int i = 0; i < 3; i++) {
-		printf("%d\t%s\t%s\n", i, host_cache[i], ip_cache[i]);
+	// Without a flight the query is answered as if the server were down
+	flight = (struct flight *) pool_get(&flight_pool);
+	if(flight == NULL) {
+		pthread_mutex_unlock(&stripe->lock);
+		log_error("[ERROR]: Out of memory, unable to query the server\n");
+		workPush(&waiter->deliver, false);
+		return;
+	}
+	memset(flight, 0, sizeof *flight);
+	upstream_prepare(&upstream, &flight->pending, header->opcode, request_msg);
+	flight->pending.done = flightAnswered;
+	flight->waiters = waiter;
+	flight->next = stripe->head;
+	stripe->head = flight;
+	pthread_mutex_unlock(&stripe->lock);
+	
+	// The previous flight for this record may have landed between our cache miss and now
+	int cached = cache_lookup(cache, header->opcode, request_msg, flight->pending.reply, &flight->pending.ttl);
+	if(cached != CACHE_MISS) {
+		flight->pending.status = cached == CACHE_HIT ? STATUS_FOUND : STATUS_NOT_FOUND;
+		landFlight(flight);
+		return;
 	}
-	printf("\n");
+	
+	log_debug("[PROGRESS]: Contacting the server\n");
+	log_debug("[REQUESTED FOR]: %s\n", request_msg);
+	stats_count(STAT_UPSTREAM_QUERIES);
+	
+	// Multiplexing the query over the long-lived connections to the DNS Server, with --udp a datagram
+	// goes first and TCP only carries the queries it did not answer in time
+	upstream_submit(&upstream, &flight->pending);
 }
 
 
-int queryServer(char *request_msg, char *reply){
-	
-	printf("[PROGRESS]: Contacting the server\n");
-	printf("[REQUESTED FOR]: %s\n", request_msg);
-	struct sockaddr_in serverAddress;
-	int socket_fd, connection_fd;
+size_t resolveFrame(const struct reply_to *to, const struct frame_header *header, const char *payload, char *out, uint64_t started) {
+	char request_msg[MAX_FRAME_BODY + 1];
+	char reply[CACHE_VALUE_MAX];
+	uint32_t ttl = 0;
+	int type_of_message = header->opcode;
+	
+	memcpy(request_msg, payload, header->length);
+	request_msg[header->length] = '\0';
+	
+	if(header->flags & FLAG_REPLY) {
+		stats_count(STAT_BAD_REQUESTS);
+		return frame_encode(out, header->request_id, header->opcode, FLAG_REPLY | FLAG_BAD_REQUEST, NULL, 0);
+	}
 	
+	// Validating the correctess of the domain name/IP addresses
+	if(type_of_message == OP_QUERY_NAME && isDomainName(request_msg) == 0){
+		log_debug("[ERROR]: Invalid Domain Name\n\n");
+		stats_count(STAT_BAD_REQUESTS);
+		return frame_encode(out, header->request_id, header->opcode, FLAG_REPLY | FLAG_BAD_REQUEST, NULL, 0);
+	}
+	if(type_of_message == OP_QUERY_ADDR && isIPAddress(request_msg) == 0) {
+		log_debug("[ERROR]: Invalid IP Address\n\n");
+		stats_count(STAT_BAD_REQUESTS);
+		return frame_encode(out, header->request_id, header->opcode, FLAG_REPLY | FLAG_BAD_REQUEST, NULL, 0);
+	}
 	
-	// Creating the socket
-	socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if(socket_fd < 0) {
-		printf("[ERROR]: Unable to create socket\n");
-		return -1;
+	if(type_of_message == OP_QUERY_NAME) {
+		stats_count(STAT_QUERIES_NAME);
+		log_debug("Domain Name = %s\n", request_msg);
+		log_debug("[SEARCHING]...\n\n");
+	}
+	else if (type_of_message == OP_QUERY_ADDR) {
+		stats_count(STAT_QUERIES_ADDR);
+		log_debug("I/P Address = %s\n", request_msg);
+		log_debug("[SEARCHING]...\n\n");
 	}
 	else {
-		printf("[SUCCESS]: Socket created\n");
+		log_debug("[ERROR]: Unknown type of message\n\n");
+		stats_count(STAT_BAD_REQUESTS);
+		return frame_encode(out, header->request_id, header->opcode, FLAG_REPLY | FLAG_BAD_REQUEST, NULL, 0);
 	}
 	
 	
-	// Configuring socket parameters
-	memset(&serverAddress, '\0', sizeof serverAddress);
-	
-	serverAddress.sin_family = AF_INET;
-	serverAddress.sin_addr.s_addr = inet_addr(DNS_addr);
-	serverAddress.sin_port = htons(12005);
+	// Going over every shard for the cache report is only worth it when debugging
+	if(log_enabled(LOG_DEBUG))
+		printCache();
 	
+	int cached = cache_lookup(cache, type_of_message, request_msg, reply, &ttl);
+	if(cached == CACHE_HIT) {
+		stats_count(STAT_CACHE_HITS);
+		log_debug("[PROGRESS]: Found in the Cache!! Retrieving from the Cache\n");
+		log_debug("[RESULT]: %s\n\n", reply);
+		return frame_encode_answer(out, header->request_id, header->opcode, ttl, reply, strlen(reply));
+	}
+	if(cached == CACHE_NEGATIVE) {
+		stats_count(STAT_CACHE_NEGATIVE_HITS);
+		log_debug("[PROGRESS]: Known to be missing, from the Cache\n");
+		return frame_encode(out, header->request_id, header->opcode, status_flags(STATUS_NOT_FOUND), NULL, 0);
+	}
 	
-	// Setting up the connection with DNS Server
-	connection_fd = connect(socket_fd, (struct sockaddr *)&serverAddress, sizeof serverAddress);
+	log_debug("[PROGRESS]: Record not found in the cache\n");
+	stats_count(STAT_CACHE_MISSES);
+	deferAnswer(to, header, request_msg, started);
+	return 0;
+}
+
+
+// Querying the DNS Server again for a hot record about to expire, unless a query for it is already in flight.
+// Clients that miss the record meanwhile wait on this flight like on any other
+void refreshRecord(int type, const char *key) {
+	struct flight_stripe *stripe = &flights[cache_hash(type, key) % FLIGHT_STRIPES];
+	struct flight *flight;
+	
+	pthread_mutex_lock(&stripe->lock);
+	for(flight = stripe->head; flight; flight = flight->next) {
+		if(flight->pending.opcode == type && strcmp(flight->pending.request, key) == 0)
+			break;
+	}
+	if(flight != NULL) {
+		pthread_mutex_unlock(&stripe->lock);
+		return;
+	}
 	
-	if(connection_fd < 0) {
-		printf("[ERROR]: Failed to connect to the server\n");
-		return -1;
+	flight = (struct flight *) pool_get(&flight_pool);
+	if(flight == NULL) {
+		pthread_mutex_unlock(&stripe->lock);
+		return;
 	}
-	else {
-		printf("[SUCCESS]: Connected to the server\n");
+	memset(flight, 0, sizeof *flight);
+	upstream_prepare(&upstream, &flight->pending, type, key);
+	flight->pending.done = flightAnswered;
+	flight->refresh = true;
+	flight->next = stripe->head;
+	stripe->head = flight;
+	pthread_mutex_unlock(&stripe->lock);
+	
+	log_debug("[PROGRESS]: Refreshing %s ahead of its expiry\n", key);
+	stats_count(STAT_UPSTREAM_QUERIES);
+	upstream_submit(&upstream, &flight->pending);
+}
+
+
+// Refreshing, once a second, the records looked up often lately that expire within refresh_ahead seconds
+void *refresher_thread(void *args) {
+	while(1) {
+		sleep(1);
+		cache_scan_hot(cache, refresh_ahead, refreshRecord);
+	}
+	return NULL;
+}
+
+
+// Answering one query frame from a client. A query answered at once writes its reply frame into out and
+// returns its length; a cache miss returns 0 and is answered to the client later, once the server replies
+size_t answerFrame(const struct reply_to *to, const struct frame_header *header, const char *payload, char *out) {
+	uint64_t started = stats_now_ns();
+	size_t out_len = resolveFrame(to, header, payload, out, started);
+	
+	if(out_len > 0)
+		stats_observe(STAT_QUERY_LATENCY, stats_now_ns() - started);
+	return out_len;
+}
+
+
+// Serving what one readable client sent: a recv may bring several pipelined queries, whose immediate
+// replies go back together in one send. Returns false once the client is gone
+bool serveClient(struct client *client) {
+	char out[CLIENT_BUFFER];
+	struct reply_to to = {.client = client};
+	
+	// Receiving the requested messages from the client
+	int recv_status = recv(client->fd, client->in + client->in_len, sizeof client->in - client->in_len, 0); 
+	if(recv_status < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return true;
 	}
 	
-	// Sending query to the DNS Server
-	send(socket_fd, request_msg, strlen(request_msg), 0);
+	// Client closed the connection
+	if(recv_status <= 0) {
+		log_info("[CLOSE]: Client is down\n\n");
+		return false;
+	}
+	client->in_len += recv_status;
 	
+	size_t offset = 0, out_len = 0;
+	struct frame_header header;
+	const char *payload;
+	int parsed;
 	
-	memset(reply, 0, strlen(reply));
-	int recv_status = recv(socket_fd, reply, 1024, 0); 
-	close(socket_fd);
+	while((parsed = frame_parse(client->in, client->in_len, &offset, &header, &payload)) == 1) {
+		if(sizeof out - out_len < MAX_FRAME_LEN) {
+			replyToClient(client, out, out_len);
+			out_len = 0;
+		}
+		out_len += answerFrame(&to, &header, payload, out + out_len);
+	}
+	if(parsed < 0) {
+		log_error("[ERROR]: Malformed frame from the client\n");
+		return false;
+	}
 	
-	if(reply[0] == '-') {
-		return -1;
+	// Replying to the Client
+	if(out_len > 0) {
+		replyToClient(client, out, out_len);
 	}
 	
-	return (reply[0] - '0');
+	memmove(client->in, client->in + offset, client->in_len - offset);
+	client->in_len -= offset;
+	return true;
 }
 
-void *child_thread(void *args) {
 
-	int connection_fd = *(int*)args;
-	pthread_detach(pthread_self());
-		
+// Dropping a client, and accepting again if the limit of clients had stopped the acceptor.
+// Answers still on their way hold the socket open until they are delivered, and are then discarded
+void closeClient(struct client *client) {
+	pthread_mutex_lock(&client->send_lock);
+	client->closed = true;
+	pthread_mutex_unlock(&client->send_lock);
+	
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+	shutdown(client->fd, SHUT_RDWR);
+	releaseClient(client);
+	stats_count(STAT_CONNECTIONS_CLOSED);
+	
+	pthread_mutex_lock(&clients_lock);
+	if(n_clients-- == max_clients) {
+		struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fd, &event);
+	}
+	pthread_mutex_unlock(&clients_lock);
+}
+
+
+// Serving one readable client, then handing its socket back to epoll
+void readClient(struct task *task) {
+	struct client *client = (struct client *) task;
+	
+	if(!serveClient(client)) {
+		closeClient(client);
+		return;
+	}
+	
+	// One-shot, so that no other worker picks the client up before it is re-armed
+	struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = client};
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+}
+
+
+// A worker of the pool runs one task at a time. None of them waits on the DNS Server, so a few
+// workers keep serving cache hits while any number of misses are in flight
+void *worker_thread(void *args) {
 	while(1) {
-		char *reply = (char *) malloc(1024);
-		char buffer[1024] = {0}; 
-	
-		memset(buffer, 0, strlen(buffer));
-				
-		// Receiving the requested message from the client
-		int recv_status = recv(connection_fd, buffer, 1024, 0); 
-		int type_of_message = buffer[0] - '0';
-		printf("[PROGRESS]: Type of message received from the Client = %d\n", recv_status);
-				
-		// Client closed the connection
-		if(type_of_message == 0) {
+		struct task *task = workPop();
+		task->run(task);
+	}
+	return NULL;
+}
+
+
+// Accepting waiting clients until the limit, after which the listening socket is left out of epoll
+void acceptClients() {
+	pthread_mutex_lock(&clients_lock);
+	while(n_clients < max_clients) {
+		int connection_fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+		if(connection_fd < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				log_error("[ERROR]: Refused to connect\n");
 			break;
 		}
-				
-		int server_status = 0;
-		char request_msg[strlen(buffer) - 2];
-		memcpy(request_msg, &buffer[2], strlen(buffer) - 2);
-		request_msg[strlen(buffer) - 2] = '\0';
-	
-				
-		// Validating the correctess of the domain name/IP addresses
-		if(type_of_message == 1 && isDomainName(request_msg) == 0){
-			printf("[ERROR]: Invalid Domain Name\n\n");
-			continue;
-		}
-		if(type_of_message == 2 && isIPAddress(request_msg) == 0) {
-			printf("[ERROR]: Invalid IP Address\n\n");
-			continue;
-		}
-				
-		if(type_of_message == 1) {
-			printf("Domain Name = %s\n", request_msg);
-			printf("[SEARCHING]...\n\n");
-		}
-		else if (type_of_message == 2) {
-			printf("I/P Address = %s\n", request_msg);
-			printf("[SEARCHING]...\n\n");
-		}
-		else {
-			printf("[CLOSE]: Client is down\n\n");
+		
+		struct client *client = (struct client *) pool_get(&client_pool);
+		if(client == NULL) {
+			log_error("[ERROR]: Out of memory, refusing the client\n");
+			close(connection_fd);
+			break;
 		}
+		memset(client, 0, offsetof(struct client, in));
+		client->read.run = readClient;
+		client->fd = connection_fd;
+		client->refs = 1;
+		pthread_mutex_init(&client->send_lock, NULL);
+		n_clients++;
+		
+		struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = client};
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection_fd, &event);
+		log_info("\n\n[WELCOME]: New client connected\n\n");
+		stats_count(STAT_CONNECTIONS_OPENED);
+	}
+	if(n_clients == max_clients) {
+		struct epoll_event event = {.events = 0, .data.ptr = NULL};
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fd, &event);
+	}
+	pthread_mutex_unlock(&clients_lock);
+}
 
-				
-		printCache();
-		bool flg = existsInCache(type_of_message, request_msg);
+
+// Answering clients that query over UDP, one frame per datagram
+void *datagram_thread(void *args) {
+	
+	int socket_fd = *(int*)args;
+	
+	while(1) {
+		char buffer[MAX_FRAME_LEN];
+		char reply[MAX_FRAME_LEN];
+		struct reply_to to = {.client = NULL, .datagram_fd = socket_fd};
+		struct frame_header header;
+		const char *payload;
+		size_t offset = 0;
 		
-		if(recv_status != 0) {
-			if(flg) {
-				retrieveQuery(request_msg, reply, type_of_message);
-				printf("[PROGRESS]: Found in the Cache!! Retrieving from the Cache\n");
-			}
-			else {
-				
-				printf("[PROGRESS]: Record not found in the cache\n");
-				// Querying the DNS Server
-				server_status = queryServer(buffer, reply);
-						
-				printf("server_status = %d\n", server_status);
-				if(server_status == 3) {
-					updateCache(request_msg, reply, type_of_message);
-					printf("[PROGRESS]: Cache Updated\n");
-				}
-				else if(server_status == -1) {
-					printf("[ERROR]: Server is down\n");
-					break;
-				}
-			}
+		to.address_len = sizeof to.address;
+		int recv_status = recvfrom(socket_fd, buffer, sizeof buffer, 0, (struct sockaddr *)&to.address, &to.address_len);
+		if(recv_status <= 0 || frame_parse(buffer, recv_status, &offset, &header, &payload) != 1) {
+			continue;
 		}
-		printf("[RESULT]: %s\n\n", reply);
-				
-		// Replying to the Client
-		send(connection_fd, reply, strlen(reply), 0);
-				
+		
+		size_t reply_len = answerFrame(&to, &header, payload, reply);
+		if(reply_len > 0)
+			sendto(socket_fd, reply, reply_len, 0, (struct sockaddr *)&to.address, to.address_len);
 	}
-			
-	// Client closed
-	close(connection_fd);	
 	
+	return NULL;
 }
 
+
 int main(int argc, char const *argv[]) 
 { 
-	pthread_t thread_id;
 	// Validating User Parameters
-	if(argc != 3) {
-		printf("[USAGE]: <executable code> <DNS IP Address> <Server Port number>\n");
+	char *USAGE = "[USAGE]: <executable code> <DNS IP Address> <Server Port number> [--udp] [--upstream-conns N] [--cache-size N] [--cache-shards N] [--negative-ttl N] [--workers N] [--max-clients N] [--upstream host[:port],...] [--log-level error|info|debug] [--stats-port N] [--snapshot FILE] [--snapshot-interval N] [--refresh-ahead N]\n";
+	int n_upstream_conns = DEFAULT_UPSTREAM_CONNS;
+	int n_workers = DEFAULT_WORKERS;
+	long cache_size = DEFAULT_CACHE_SIZE;
+	int level = LOG_INFO;
+	long cache_shards = DEFAULT_CACHE_SHARDS;
+	int stats_port = 0;
+	
+	if(argc < 3) {
+		printf("%s", USAGE);
+		return 0;
+	}
+	for(int i = 3; i < argc; i++) {
+		if(strcmp(argv[i], "--udp") == 0) {
+			use_udp = true;
+		}
+		else if(strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+			level = log_parse_level(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--upstream") == 0 && i + 1 < argc) {
+			DNS_addr = argv[++i];
+		}
+		else if(strcmp(argv[i], "--upstream-conns") == 0 && i + 1 < argc) {
+			n_upstream_conns = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+			cache_size = atol(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--cache-shards") == 0 && i + 1 < argc) {
+			cache_shards = atol(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--negative-ttl") == 0 && i + 1 < argc) {
+			negative_ttl = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+			n_workers = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc) {
+			max_clients = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--stats-port") == 0 && i + 1 < argc) {
+			stats_port = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+			snapshot_path = argv[++i];
+		}
+		else if(strcmp(argv[i], "--snapshot-interval") == 0 && i + 1 < argc) {
+			snapshot_interval = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--refresh-ahead") == 0 && i + 1 < argc) {
+			refresh_ahead = atoi(argv[++i]);
+		}
+		else {
+			printf("%s", USAGE);
+			return 0;
+		}
+	}
+	if(n_upstream_conns < 1 || level < 0 || n_workers < 1 || max_clients < 1 || snapshot_interval < 1 || refresh_ahead < 0) {
+		printf("%s", USAGE);
 		return 0;
 	}
+	log_init(level);
+	
+	// Stop signals go to the snapshot thread alone, every thread started from here on inherits the mask
+	if(snapshot_path != NULL) {
+		sigemptyset(&stop_signals);
+		sigaddset(&stop_signals, SIGTERM);
+		sigaddset(&stop_signals, SIGINT);
+		pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+	}
+	if(!stats_create(STATS_PROXY, false)) {
+		printf("[ERROR]: Unable to allocate the statistics\n");
+		exit(EXIT_FAILURE);
+	}
 	
 	PORT_NO = atoi(argv[2]);
-	DNS_addr = argv[1];
 	
-	int socket_fd, connection_fd; 
-	struct sockaddr_in serverAddress, clientAddress; 
+	// The DNS Servers default to the one given on the command line, on its usual port
+	if(DNS_addr == NULL)
+		DNS_addr = argv[1];
+	if(!upstream_init(&upstream, DNS_addr, 12005, n_upstream_conns)) {
+		printf("[ERROR]: Invalid DNS Server address in %s\n", DNS_addr);
+		printf("%s", USAGE);
+		return 0;
+	}
+	upstream.use_udp = use_udp;
+	
+	// Shards must be a power of two, the shard is picked by the top bits of the key hash
+	if(cache_size < 1 || cache_shards < 1 || (cache_shards & (cache_shards - 1)) != 0) {
+		printf("[ERROR]: --cache-shards must be a power of two\n");
+		printf("%s", USAGE);
+		return 0;
+	}
+	if(cache_shards > cache_size) {
+		cache_shards = 1;
+		while(cache_shards * 2 <= cache_size)
+			cache_shards *= 2;
+	}
+	cache = cache_create(cache_size, cache_shards);
+	if(cache == NULL) {
+		printf("[ERROR]: Unable to allocate the cache\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	// Serving the counters and latency histograms on 127.0.0.1 when asked for
+	if(stats_port > 0 && !stats_serve(stats_port, writeStats)) {
+		printf("[ERROR]: Unable to serve statistics on port %d\n", stats_port);
+		exit(EXIT_FAILURE);
+	}
+	
+	for(int i = 0; i < FLIGHT_STRIPES; i++) {
+		pthread_mutex_init(&flights[i].lock, NULL);
+	}
+	pool_init(&client_pool, "client", sizeof(struct client));
+	pool_init(&waiter_pool, "waiter", sizeof(struct answer_waiter));
+	pool_init(&flight_pool, "flight", sizeof(struct flight));
+	
+	// Starting warm from the last snapshot, less what expired while the proxy was down
+	if(snapshot_path != NULL) {
+		long n_loaded = cache_load(cache, snapshot_path);
+		if(n_loaded >= 0)
+			printf("[SUCCESS]: Loaded %ld records from %s\n", n_loaded, snapshot_path);
+		
+		pthread_t snapshot_id;
+		if(pthread_create(&snapshot_id, NULL, snapshot_thread, NULL) != 0) {
+			printf("[ERROR]: Could not create thread\n");
+			return 1;
+		}
+	}
+	
+	pthread_t sweeper_id;
+	if(pthread_create(&sweeper_id, NULL, sweeper_thread, NULL) != 0) {
+		printf("[ERROR]: Could not create thread\n");
+		return 1;
+	}
+	
+	// Keeping hot records from ever expiring under the clients that ask for them
+	pthread_t refresher_id;
+	if(refresh_ahead > 0 && pthread_create(&refresher_id, NULL, refresher_thread, NULL) != 0) {
+		printf("[ERROR]: Could not create thread\n");
+		return 1;
+	}
+	
+	int socket_fd; 
+	struct sockaddr_in serverAddress; 
 	
 	// Creating the socket  
 	socket_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -277,7 +891,7 @@ int main(int argc, char const *argv[])
 	
 	
 	// Listening for the requests from the Clients
-	if(listen(socket_fd, MAX_CONCURRENT_CLIENTS) < 0) { 
+	if(listen(socket_fd, max_clients) < 0) { 
 		printf("[ERROR]: Unable to Listen\n");
 		exit(EXIT_FAILURE); 
 	} 
@@ -285,25 +899,57 @@ int main(int argc, char const *argv[])
 		printf("[SUCCESS]: Listening\n");
 	}
 	
-	int clientAddress_len = sizeof clientAddress ;
 	
-	while(1)
-    {
-    	connection_fd =  accept(socket_fd, (struct sockaddr *)&clientAddress, &clientAddress_len);
-		if(connection_fd < 0) { 
-			printf("[ERROR]: Refused to connect\n"); 
-			exit(EXIT_FAILURE); 
-		} 
-		else {
-			printf("[SUCCESS]: Connection Established\n");
+	// Serving UDP clients on the same port number alongside TCP
+	if(use_udp) {
+		static int datagram_fd;
+		pthread_t datagram_thread_id;
+		
+		datagram_fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if(datagram_fd < 0 || bind(datagram_fd, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0) {
+			printf("[ERROR]: Failed to bind to the socket\n");
+			exit(EXIT_FAILURE);
+		}
+		if(pthread_create(&datagram_thread_id, NULL, datagram_thread, (void *) &datagram_fd) != 0) {
+			printf("[ERROR]: Could not create thread\n");
+			return 1;
 		}
-    	
-		if(pthread_create(&thread_id, NULL, child_thread, (void *) &connection_fd) < 0) {
+		printf("[SUCCESS]: Listening for datagrams\n");
+	}
+	
+	// Accepting from an event loop that feeds a fixed pool of workers
+	listen_fd = socket_fd;
+	fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+	pthread_mutex_init(&work.lock, NULL);
+	pthread_cond_init(&work.not_empty, NULL);
+	pthread_cond_init(&work.not_full, NULL);
+	
+	epoll_fd = epoll_create1(0);
+	struct epoll_event listen_event = {.events = EPOLLIN, .data.ptr = NULL};
+	if(epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_event) < 0) {
+		printf("[ERROR]: Unable to create the event loop\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	for(int i = 0; i < n_workers; i++) {
+		pthread_t worker_id;
+		if(pthread_create(&worker_id, NULL, worker_thread, NULL) != 0) {
 			printf("[ERROR]: Could not create thread\n");
 			return 1;
 		}
-		printf("\n\n[WELCOME]: New client connected\n\n");
+	}
+	printf("[SUCCESS]: %d workers serving up to %d clients\n", n_workers, max_clients);
+	
+	while(1) {
+		struct epoll_event events[MAX_EVENTS];
+		int n_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
 		
+		for(int i = 0; i < n_events; i++) {
+			if(events[i].data.ptr == NULL)
+				acceptClients();
+			else
+				workPush(&((struct client *) events[i].data.ptr)->read, true);
+		}
 	}
 	
 	printf("[COMPLETED]: Proxy Server Closed\n"); 
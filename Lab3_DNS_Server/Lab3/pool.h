@@ -0,0 +1,175 @@
+/*
+ * Slab pools for the fixed-size objects of the request path
+ *
+ * pool_get() and pool_put() recycle objects through a free list of the
+ * calling thread, so a thread in steady state neither locks nor calls the
+ * allocator. Objects often die on another thread than the one that made
+ * them (an answer awaited from the DNS Server is made by the worker that
+ * missed and freed by the one that delivers it), so a thread whose list
+ * grows past POOL_CACHE_MAX hands POOL_BATCH objects over to the pool's
+ * shared list, and a thread that runs out takes a batch back from there.
+ * Only when both are empty does a pool carve POOL_SLAB new objects out of
+ * one malloc(). Objects are never given back to the heap; a thread that
+ * exits returns its list to the shared one.
+ *
+ * pool_get() returns the object as it was put back: callers reset what
+ * they use.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+
+
+#define POOL_MAX 4
+#define POOL_CACHE_MAX 256
+#define POOL_BATCH 64
+#define POOL_SLAB 32
+#define POOL_ALIGN 64
+
+
+struct pool_object {
+	struct pool_object *next;
+	struct pool_object *next_batch;
+	uint32_t count;
+};
+
+struct pool {
+	const char *name;
+	size_t size;
+	int id;
+	pthread_mutex_t lock;
+	struct pool_object *batches;
+	uint64_t n_objects;
+};
+
+struct pool_cache {
+	struct pool_object *head;
+	uint32_t count;
+};
+
+static struct pool *pools[POOL_MAX];
+static int n_pools;
+static pthread_key_t pool_key;
+static __thread struct pool_cache pool_caches[POOL_MAX];
+static __thread bool pool_thread_known;
+
+
+// Moving the first n objects of a thread's list to the shared one as a batch
+static inline void pool_give_back(struct pool *pool, struct pool_cache *cache, uint32_t n) {
+	struct pool_object *batch = cache->head, *last = batch;
+
+	for(uint32_t i = 1; i < n; i++)
+		last = last->next;
+	cache->head = last->next;
+	cache->count -= n;
+	last->next = NULL;
+	batch->count = n;
+
+	pthread_mutex_lock(&pool->lock);
+	batch->next_batch = pool->batches;
+	pool->batches = batch;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// A thread that exits leaves its objects to the others
+static inline void pool_thread_exit(void *unused) {
+	for(int i = 0; i < n_pools; i++) {
+		if(pool_caches[i].count > 0)
+			pool_give_back(pools[i], &pool_caches[i], pool_caches[i].count);
+	}
+}
+
+
+// Setting up a pool of objects of size bytes, at most POOL_MAX of them, before any thread uses one
+static inline bool pool_init(struct pool *pool, const char *name, size_t size) {
+	if(n_pools == POOL_MAX)
+		return false;
+	if(n_pools == 0)
+		pthread_key_create(&pool_key, pool_thread_exit);
+
+	if(size < sizeof(struct pool_object))
+		size = sizeof(struct pool_object);
+
+	memset(pool, 0, sizeof *pool);
+	pool->name = name;
+	pool->size = (size + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
+	pool->id = n_pools;
+	pthread_mutex_init(&pool->lock, NULL);
+	pools[n_pools++] = pool;
+	return true;
+}
+
+
+// Filling an empty thread list with a batch from the shared list, or else with a new slab
+static inline bool pool_refill(struct pool *pool, struct pool_cache *cache) {
+	pthread_mutex_lock(&pool->lock);
+	struct pool_object *batch = pool->batches;
+	if(batch != NULL)
+		pool->batches = batch->next_batch;
+	pthread_mutex_unlock(&pool->lock);
+
+	if(batch != NULL) {
+		cache->head = batch;
+		cache->count = batch->count;
+		return true;
+	}
+
+	char *slab = (char *) aligned_alloc(POOL_ALIGN, POOL_SLAB * pool->size);
+	if(slab == NULL)
+		return false;
+	for(int i = POOL_SLAB - 1; i >= 0; i--) {
+		struct pool_object *object = (struct pool_object *) (slab + i * pool->size);
+		object->next = cache->head;
+		cache->head = object;
+	}
+	cache->count = POOL_SLAB;
+	__atomic_fetch_add(&pool->n_objects, POOL_SLAB, __ATOMIC_RELAXED);
+	return true;
+}
+
+
+// An object of the pool, NULL only when the heap is exhausted
+static inline void *pool_get(struct pool *pool) {
+	struct pool_cache *cache = &pool_caches[pool->id];
+
+	if(!pool_thread_known) {
+		pool_thread_known = true;
+		pthread_setspecific(pool_key, pool_caches);
+	}
+	if(cache->head == NULL && !pool_refill(pool, cache))
+		return NULL;
+
+	struct pool_object *object = cache->head;
+	cache->head = object->next;
+	cache->count--;
+	return object;
+}
+
+
+static inline void pool_put(struct pool *pool, void *ptr) {
+	struct pool_cache *cache = &pool_caches[pool->id];
+	struct pool_object *object = (struct pool_object *) ptr;
+
+	if(!pool_thread_known) {
+		pool_thread_known = true;
+		pthread_setspecific(pool_key, pool_caches);
+	}
+	object->next = cache->head;
+	cache->head = object;
+	if(++cache->count >= POOL_CACHE_MAX)
+		pool_give_back(pool, cache, POOL_BATCH);
+}
+
+
+// Objects ever taken from the heap by every pool, flat once the load is steady
+static inline void pool_write_stats(FILE *out) {
+	fprintf(out, "# TYPE dns_pool_heap_objects_total counter\n");
+	for(int i = 0; i < n_pools; i++)
+		fprintf(out, "dns_pool_heap_objects_total{pool=\"%s\"} %llu\n", pools[i]->name,
+			(unsigned long long) __atomic_load_n(&pools[i]->n_objects, __ATOMIC_RELAXED));
+}
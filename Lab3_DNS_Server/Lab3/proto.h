@@ -0,0 +1,144 @@
+/*
+ * Wire protocol shared by the client, the proxies and the DNS Server
+ *
+ * Every message, over TCP or as a single UDP datagram, is a fixed header
+ * followed by its payload:
+ *
+ *	[request id: 4 bytes][opcode: 1 byte][flags: 1 byte][payload length: 2 bytes][payload]
+ *
+ * multi-byte fields in network byte order. A query carries the domain name
+ * or the IP address as payload; its reply echoes the request id and opcode,
+ * sets FLAG_REPLY and carries the answer, or no payload when a status flag
+ * is set. A reply with FLAG_TTL starts its payload with the record's time
+ * to live, 4 bytes in seconds, ahead of the answer. Replies are matched by id, so any number of queries can be
+ * pipelined on one connection and answered in any order.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+
+#define FRAME_HEADER_LEN 8
+#define MAX_FRAME_BODY 1024
+#define MAX_FRAME_LEN (FRAME_HEADER_LEN + MAX_FRAME_BODY)
+
+// Opcodes, numbered after the message types of the old "type#payload" strings
+#define OP_QUERY_NAME 1		// Domain Name -> IP Address
+#define OP_QUERY_ADDR 2		// IP Address -> Domain Name
+
+#define FLAG_REPLY 0x80
+#define FLAG_NOT_FOUND 0x01
+#define FLAG_SERVER_ERROR 0x02
+#define FLAG_BAD_REQUEST 0x04
+#define FLAG_TTL 0x08
+
+// Outcome of a lookup as the proxies track it, -1 standing for a server error
+#define STATUS_FOUND 3
+#define STATUS_NOT_FOUND 4
+
+
+struct frame_header {
+	uint32_t request_id;
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t length;
+};
+
+
+static inline void frame_encode_header(char *out, uint32_t request_id, uint8_t opcode, uint8_t flags, uint16_t length) {
+	uint32_t id = htonl(request_id);
+	uint16_t len = htons(length);
+
+	memcpy(out, &id, 4);
+	out[4] = opcode;
+	out[5] = flags;
+	memcpy(out + 6, &len, 2);
+}
+
+
+// Writing a whole frame into out, returns its length
+static inline size_t frame_encode(char *out, uint32_t request_id, uint8_t opcode, uint8_t flags, const char *payload, size_t length) {
+	if(length > MAX_FRAME_BODY)
+		length = MAX_FRAME_BODY;
+	frame_encode_header(out, request_id, opcode, flags, length);
+	memcpy(out + FRAME_HEADER_LEN, payload, length);
+	return FRAME_HEADER_LEN + length;
+}
+
+
+// Writing a found answer with its time to live, returns the frame length
+static inline size_t frame_encode_answer(char *out, uint32_t request_id, uint8_t opcode, uint32_t ttl, const char *answer, size_t length) {
+	uint32_t ttl_field = htonl(ttl);
+
+	if(length > MAX_FRAME_BODY - 4)
+		length = MAX_FRAME_BODY - 4;
+	frame_encode_header(out, request_id, opcode, FLAG_REPLY | FLAG_TTL, 4 + length);
+	memcpy(out + FRAME_HEADER_LEN, &ttl_field, 4);
+	memcpy(out + FRAME_HEADER_LEN + 4, answer, length);
+	return FRAME_HEADER_LEN + 4 + length;
+}
+
+
+static inline void frame_decode_header(const char *in, struct frame_header *header) {
+	uint32_t id;
+	uint16_t len;
+
+	memcpy(&id, in, 4);
+	memcpy(&len, in + 6, 2);
+	header->request_id = ntohl(id);
+	header->opcode = in[4];
+	header->flags = in[5];
+	header->length = ntohs(len);
+}
+
+
+// Finding the frame that starts at *offset of a receive buffer.
+// Returns 1 and moves *offset past it when it is complete, 0 when more bytes are needed, -1 when it is malformed
+static inline int frame_parse(const char *buf, size_t len, size_t *offset, struct frame_header *header, const char **payload) {
+	if(len - *offset < FRAME_HEADER_LEN)
+		return 0;
+
+	frame_decode_header(buf + *offset, header);
+	if(header->length > MAX_FRAME_BODY)
+		return -1;
+	if(len - *offset < FRAME_HEADER_LEN + (size_t) header->length)
+		return 0;
+
+	*payload = buf + *offset + FRAME_HEADER_LEN;
+	*offset += FRAME_HEADER_LEN + header->length;
+	return 1;
+}
+
+
+// Taking the time to live off the front of a reply's payload, false when it carries none
+static inline bool frame_take_ttl(uint8_t flags, const char **payload, size_t *length, uint32_t *ttl) {
+	uint32_t ttl_field;
+
+	if((flags & FLAG_TTL) == 0 || *length < 4)
+		return false;
+	memcpy(&ttl_field, *payload, 4);
+	*ttl = ntohl(ttl_field);
+	*payload += 4;
+	*length -= 4;
+	return true;
+}
+
+
+// Status of a reply as the proxies track it
+static inline int frame_status(uint8_t flags) {
+	if(flags & (FLAG_SERVER_ERROR | FLAG_BAD_REQUEST))
+		return -1;
+	return (flags & FLAG_NOT_FOUND) ? STATUS_NOT_FOUND : STATUS_FOUND;
+}
+
+
+// Flags of a reply for a status as the proxies track it
+static inline uint8_t status_flags(int status) {
+	if(status == STATUS_FOUND)
+		return FLAG_REPLY;
+	if(status == STATUS_NOT_FOUND)
+		return FLAG_REPLY | FLAG_NOT_FOUND;
+	return FLAG_REPLY | FLAG_SERVER_ERROR;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <unistd.h> 
 #include <stdio.h> 
 #include <sys/socket.h> 
@@ -5,91 +6,441 @@
 #include <netinet/in.h> 
 #include <string.h> 
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <sys/epoll.h>
 
 
-int search_database(char* request_msg, char* queried_object, int type_of_msg) {
-	FILE *fp;
-	char *line = NULL;
-	size_t len = 0;
-	ssize_t read;
-	int db_status = 0;
+#include "dbformat.h"
+#include "proto.h"
+#include "logger.h"
+#include "stats.h"
+#include "pool.h"
+
+
+#define DATABASE_PATH "./database.txt"
+#define COMPILED_DATABASE_PATH "./database.bin"
+
+
+#define MAX_DB_READERS 64
+#define DEFAULT_BACKLOG 1024
+#define MAX_EVENTS 256
+#define DATAGRAM_BATCH 32
+#define CONN_BUFFER 8192
+
+
+// The database version in use. Lookups run inside db_read_lock()/db_read_unlock(),
+// publishing the epoch they started in, so that a reload can swap in a new
+// version at any time and unmap the old one once no lookup can still see it
+_Atomic(struct dbf_file *) current_database;
+_Atomic unsigned long db_epoch = 1;
+_Atomic unsigned long db_reader_epoch[MAX_DB_READERS];
+_Atomic int n_db_readers;
+__thread int db_reader_slot = -1;
+
+sem_t reload_request;
+
+
+// Opening the compiled database, recompiling it first when database.txt has changed
+int load_database(const char *txt_path, const char *bin_path, struct dbf_file *db) {
+	struct timespec begin, end;
+	struct rusage usage;
 	
-	printf("[REQUESTED FOR]: %s\n", request_msg);
-	fp = fopen("./database.txt", "r");
-		
-	if (fp == NULL) {
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	
+	if(dbf_is_stale(txt_path, bin_path)) {
+		printf("[PROGRESS]: %s is missing or stale, compiling %s\n", bin_path, txt_path);
+		if(dbf_compile(txt_path, bin_path) < 0)
+			return -1;
+	}
+	
+	if(dbf_open(bin_path, db) < 0) {
 		printf("Unable to open File\n");
 		return -1;
 	}
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	getrusage(RUSAGE_SELF, &usage);
+	printf("[SUCCESS]: Loaded %u records from %s in %.1f ms (max RSS %ld KB)\n", db->header->n_names, bin_path,
+		(end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6, usage.ru_maxrss);
+	return 0;
+}
+
+
+const struct dbf_file *db_read_lock() {
+	if(db_reader_slot < 0) {
+		db_reader_slot = atomic_fetch_add(&n_db_readers, 1);
+		if(db_reader_slot >= MAX_DB_READERS) {
+			printf("[ERROR]: Too many database reader threads\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	atomic_store(&db_reader_epoch[db_reader_slot], atomic_load(&db_epoch));
+	return atomic_load(&current_database);
+}
+
 
+void db_read_unlock() {
+	atomic_store_explicit(&db_reader_epoch[db_reader_slot], 0, memory_order_release);
+}
+
+
+// Publishing a new database version and retiring the old one after every lookup that may use it
+void db_replace(struct dbf_file *fresh) {
+	struct dbf_file *old = atomic_exchange(&current_database, fresh);
+	unsigned long epoch = atomic_fetch_add(&db_epoch, 1) + 1;
+	int n_readers = atomic_load(&n_db_readers);
 	
-	// Reading the database.txt file
-	while ((read = getline(&line, &len, fp)) != -1) {
-		char *exists = strstr(line, request_msg);
+	for(int i = 0; i < n_readers && i < MAX_DB_READERS; i++) {
+		unsigned long seen;
+		while((seen = atomic_load(&db_reader_epoch[i])) != 0 && seen < epoch)
+			sched_yield();
+	}
+	
+	if(old != NULL) {
+		dbf_close(old);
+		free(old);
+	}
+}
+
+
+void request_reload(int signal_no) {
+	sem_post(&reload_request);
+}
+
+
+// Rebuilding the database in the background on every SIGHUP
+void *reload_thread(void *args) {
+	while(1) {
+		if(sem_wait(&reload_request) < 0)
+			continue;
 		
-		if(exists) {
-			int idx = line - exists;
-			int flg = 0;
-				
-			if(idx == 0 && type_of_msg == 1) {
-				memcpy(queried_object, &line[strlen(request_msg)], strlen(line) - strlen(request_msg) - 1);
-				flg = 1;
-				}
-			else if(idx != 0 && type_of_msg == 2){
-				memcpy(queried_object, &line[0], strlen(line) - strlen(request_msg) - 1);
-				flg = 1;
-			}
-				
-			if(flg) {
-				queried_object[strlen(line) - strlen(request_msg) - 1] = '\0';
+		printf("[PROGRESS]: Reloading the database\n");
+		struct dbf_file *fresh = (struct dbf_file *) malloc(sizeof *fresh);
+		if(load_database(DATABASE_PATH, COMPILED_DATABASE_PATH, fresh) < 0) {
+			printf("[ERROR]: Reload failed, keeping the current database\n");
+			free(fresh);
+			continue;
+		}
+		
+		db_replace(fresh);
+		printf("[SUCCESS]: Database reloaded\n");
+	}
+	return NULL;
+}
+
+
+int search_database(char* request_msg, char* queried_object, int type_of_msg, uint32_t *ttl) {
+	struct in_addr addr;
+	int db_status = 0;
+	
+	log_debug("[REQUESTED FOR]: %s\n", request_msg);
+	
+	uint64_t started = stats_now_ns();
+	const struct dbf_file *db = db_read_lock();
+	if(db == NULL) {
+		db_read_unlock();
+		return -1;
+	}
+	
+	if(type_of_msg == 1) {
+		uint32_t ip;
+		if(dbf_find_name(db, request_msg, &ip, ttl)) {
+			addr.s_addr = htonl(ip);
+			inet_ntop(AF_INET, &addr, queried_object, INET_ADDRSTRLEN);
+			db_status = 1;
+		}
+	}
+	else if(type_of_msg == 2) {
+		if(inet_pton(AF_INET, request_msg, &addr) == 1) {
+			const char *name = dbf_find_ip(db, ntohl(addr.s_addr), ttl);
+			if(name != NULL) {
+				strcpy(queried_object, name);
 				db_status = 1;
-				break;
 			}
 		}
-		else {
-			strcpy(queried_object, "Entry Not Found");
-		}
 	}
-	fclose(fp);
+	db_read_unlock();
+	stats_observe(STAT_DB_LOOKUP, stats_now_ns() - started);
+	stats_count(db_status == 1 ? STAT_DB_FOUND : STAT_DB_NOT_FOUND);
 	
+	if(db_status == 0)
+		strcpy(queried_object, "Entry Not Found");
 	return db_status;
 }
 
 
-int main(int argc, char const *argv[]) 
-{ 
-	int socket_fd, connection_fd; 
-	struct sockaddr_in serverAddress, clientAddress; 
-	char *ERROR = "-#Database corrputed";
+// Per connection state of the event loop. A proxy keeps its connection open and
+// pipelines framed requests on it; replies are queued in order and flushed as the
+// socket allows. Once the proxy closes its side the connection drains and closes
+enum conn_state {
+	CONN_OPEN,
+	CONN_DRAINING
+};
+
+struct connection {
+	int fd;
+	enum conn_state state;
+	size_t in_len;
+	size_t out_len;
+	size_t out_sent;
+	char in[CONN_BUFFER];
+	char out[CONN_BUFFER];
+};
+
+// Connections are recycled by the worker that closes them, their buffers are never zeroed
+struct pool connection_pool;
+
+
+size_t answer_request(const struct frame_header *header, const char *payload, char *reply) {
+	char queried_object[1024];
+	char request_msg[MAX_FRAME_BODY + 1];
+	uint32_t ttl = 0;
+	int type_of_msg = header->opcode;
 	
-	// Validating User Parameters
-	if(argc != 2) {
-		printf("[USAGE]: <executable code> <Server Port number>\n");
-		return 0;
+	memcpy(request_msg, payload, header->length);
+	request_msg[header->length] = '\0';
+	
+	log_debug("[PROGRESS]: Message type received = %d\n", type_of_msg);
+	if((header->flags & FLAG_REPLY) == 0 && type_of_msg == OP_QUERY_NAME) {
+		stats_count(STAT_QUERIES_NAME);
+		log_debug("Domain Name = %s\n", request_msg);
+		log_debug("[SEARCHING]...\n\n");
+	}
+	else if ((header->flags & FLAG_REPLY) == 0 && type_of_msg == OP_QUERY_ADDR) {
+		stats_count(STAT_QUERIES_ADDR);
+		log_debug("I/P Address = %s\n", request_msg);
+		log_debug("[SEARCHING]...\n\n");
+	}
+	else {
+		stats_count(STAT_BAD_REQUESTS);
+		log_debug("[ERROR]: Unknown type of message\n\n");
+		return frame_encode(reply, header->request_id, header->opcode, FLAG_REPLY | FLAG_BAD_REQUEST, NULL, 0);
 	}
 	
-	int PORT_NO = atoi(argv[1]);
-	socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+	
+	// Searching in Database
+	int server_status = search_database(request_msg, queried_object, type_of_msg, &ttl);
+	
+	if(server_status == -1) {
+		log_error("[ERROR]: Database corrupted\n");
+		return frame_encode(reply, header->request_id, header->opcode, FLAG_REPLY | FLAG_SERVER_ERROR, NULL, 0);
+	}
+	if(server_status == 0) {
+		log_debug("[RESULT]: %s\n", queried_object);
+		return frame_encode(reply, header->request_id, header->opcode, FLAG_REPLY | FLAG_NOT_FOUND, NULL, 0);
+	}
+	
+	
+	// Configuring the Reply from the DNS Server
+	log_debug("[RESULT]: %s\n", queried_object);
+	return frame_encode_answer(reply, header->request_id, header->opcode, ttl, queried_object, strlen(queried_object));
+}
+
+
+// Answering one query frame, writes the whole reply frame into reply and returns its length
+size_t handle_request(const struct frame_header *header, const char *payload, char *reply) {
+	uint64_t started = stats_now_ns();
+	size_t reply_len = answer_request(header, payload, reply);
+	
+	stats_observe(STAT_QUERY_LATENCY, stats_now_ns() - started);
+	return reply_len;
+}
+
+
+void close_connection(struct connection *conn) {
+	stats_count(STAT_CONNECTIONS_CLOSED);
+	close(conn->fd);
+	pool_put(&connection_pool, conn);
+}
+
+
+// Answering every complete frame buffered in conn->in while there is room for the replies
+bool process_frames(struct connection *conn) {
+	size_t offset = 0;
+	struct frame_header header;
+	const char *payload;
+	
+	while(sizeof conn->out - conn->out_len >= MAX_FRAME_LEN) {
+		int parsed = frame_parse(conn->in, conn->in_len, &offset, &header, &payload);
+		if(parsed < 0) {
+			log_error("[ERROR]: Malformed frame, dropping the connection\n");
+			return false;
+		}
+		if(parsed == 0)
+			break;
+		
+		conn->out_len += handle_request(&header, payload, conn->out + conn->out_len);
+	}
+	
+	memmove(conn->in, conn->in + offset, conn->in_len - offset);
+	conn->in_len -= offset;
+	return true;
+}
+
+
+// Sending queued replies, false on a broken connection
+bool flush_replies(struct connection *conn) {
+	while(conn->out_sent < conn->out_len) {
+		ssize_t sent = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+		if(sent > 0) {
+			conn->out_sent += sent;
+		}
+		else if(sent < 0 && errno == EINTR) {
+			continue;
+		}
+		else if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		}
+		else {
+			return false;
+		}
+	}
+	
+	conn->out_len = conn->out_sent = 0;
+	return true;
+}
+
+
+// Whether conn->in still starts with a complete frame, or a malformed one for process_frames to reject
+bool frame_pending(struct connection *conn) {
+	size_t offset = 0;
+	struct frame_header header;
+	const char *payload;
+	
+	return frame_parse(conn->in, conn->in_len, &offset, &header, &payload) != 0;
+}
+
+
+// Advancing a connection as far as its socket allows, returns false once it is closed.
+// Edge-triggered epoll only reports new bytes, so every complete frame already read is answered before waiting
+bool drive_connection(struct connection *conn) {
+	while(1) {
+		if(!flush_replies(conn) || !process_frames(conn)) {
+			close_connection(conn);
+			return false;
+		}
+		if(!flush_replies(conn)) {
+			close_connection(conn);
+			return false;
+		}
+		
+		// Waiting for EPOLLOUT while the replies are stuck in the socket buffer
+		if(conn->out_len > 0)
+			return true;
+		
+		// process_frames stops when the replies fill conn->out, leaving frames behind once they are sent
+		if(frame_pending(conn))
+			continue;
+		
+		if(conn->state == CONN_DRAINING) {
+			close_connection(conn);
+			return false;
+		}
+		
+		ssize_t got = recv(conn->fd, conn->in + conn->in_len, sizeof conn->in - conn->in_len, 0);
+		if(got > 0) {
+			conn->in_len += got;
+		}
+		else if(got == 0) {
+			conn->state = CONN_DRAINING;
+		}
+		else if(errno == EINTR) {
+			continue;
+		}
+		else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			return true;
+		}
+		else {
+			close_connection(conn);
+			return false;
+		}
+	}
+}
+
+
+// Accepting every pending connection on the edge
+void accept_connections(int epoll_fd, int socket_fd) {
+	while(1) {
+		struct sockaddr_in clientAddress;
+		socklen_t clientAddress_len = sizeof clientAddress;
+		int connection_fd = accept4(socket_fd, (struct sockaddr *)&clientAddress, &clientAddress_len, SOCK_NONBLOCK);
+		
+		if(connection_fd < 0) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				log_error("[ERROR]: Refused to connect\n");
+			return;
+		}
+		log_info("[SUCCESS]: Connection Established\n");
+		stats_count(STAT_CONNECTIONS_OPENED);
+		
+		struct connection *conn = (struct connection *) pool_get(&connection_pool);
+		if(conn == NULL) {
+			log_error("[ERROR]: Out of memory, refusing the connection\n");
+			close(connection_fd);
+			stats_count(STAT_CONNECTIONS_CLOSED);
+			continue;
+		}
+		memset(conn, 0, offsetof(struct connection, in));
+		conn->fd = connection_fd;
+		conn->state = CONN_OPEN;
+		
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = conn;
+		if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection_fd, &event) < 0) {
+			log_error("[ERROR]: Unable to watch the connection\n");
+			close_connection(conn);
+			continue;
+		}
+		
+		// The request may already be waiting
+		drive_connection(conn);
+	}
+}
+
+
+// Creating a listening socket of its own for every worker, the kernel spreads connections across them.
+// The port is shared only when there are several workers, so that a second server started on it fails to bind
+int create_listener(int port, int backlog, bool shared) {
+	struct sockaddr_in serverAddress; 
+	int socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
 	
 	if(socket_fd < 0) { 
 		printf("[ERROR]: Unable to create socket\n");
-		exit(EXIT_FAILURE); 
+		return -1;
 	}
 	else {
 		printf("[SUCCESS]: Socket created\n");
 	}
 	
 	// Configuring socket parameters
+	int reuse = 1;
+	setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+	if(shared)
+		setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof reuse);
+	
+	memset(&serverAddress, 0, sizeof serverAddress);
 	serverAddress.sin_family = AF_INET; 
 	serverAddress.sin_addr.s_addr = INADDR_ANY; 
-	serverAddress.sin_port = htons( PORT_NO ); 
+	serverAddress.sin_port = htons( port ); 
 	
 	
 	// Binding the socket to the specified port
 	int bind_res = bind(socket_fd, (struct sockaddr *)&serverAddress, sizeof(serverAddress));
 	if(bind_res < 0) { 
 		printf("[ERROR]: Failed to bind to the socket\n"); 
-		exit(EXIT_FAILURE); 
+		close(socket_fd);
+		return -1;
 	} 
 	else {
 		printf("[SUCCESS]: Successfully binded\n");
@@ -97,85 +448,276 @@ int main(int argc, char const *argv[])
 	
 	
 	// Listening for the requests from the DNS Proxy
-	if(listen(socket_fd, 5) < 0) { 
+	if(listen(socket_fd, backlog) < 0) { 
 		printf("[ERROR]: Unable to Listen\n");
-		exit(EXIT_FAILURE); 
+		close(socket_fd);
+		return -1;
 	} 
 	else {
 		printf("[SUCCESS]: Listening\n");
 	}
 	
+	return socket_fd;
+}
+
+
+// Datagram twin of the listener on the same port, one per worker as well
+int create_datagram_socket(int port, bool shared) {
+	struct sockaddr_in serverAddress; 
+	int socket_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
 	
-	// Infinite loop to query for multiple requests from the clients
-	while(1) {
-		int clientAddress_len = sizeof clientAddress ;
-		connection_fd =  accept(socket_fd, (struct sockaddr *)&clientAddress, &clientAddress_len);
+	if(socket_fd < 0) { 
+		printf("[ERROR]: Unable to create socket\n");
+		return -1;
+	}
 	
-		if(connection_fd < 0) { 
-			printf("[ERROR]: Refused to connect\n"); 
-			exit(EXIT_FAILURE); 
-		} 
-		else {
-			printf("[SUCCESS]: Connection Established\n");
+	int reuse = 1;
+	setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+	if(shared)
+		setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof reuse);
+	
+	memset(&serverAddress, 0, sizeof serverAddress);
+	serverAddress.sin_family = AF_INET; 
+	serverAddress.sin_addr.s_addr = INADDR_ANY; 
+	serverAddress.sin_port = htons( port ); 
+	
+	if(bind(socket_fd, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0) { 
+		printf("[ERROR]: Failed to bind to the socket\n"); 
+		close(socket_fd);
+		return -1;
+	} 
+	
+	printf("[SUCCESS]: Listening for datagrams\n");
+	return socket_fd;
+}
+
+
+// Draining the datagram socket in batches: one recvmmsg in, one sendmmsg out, a frame per datagram
+void serve_datagrams(int socket_fd) {
+	static __thread char requests[DATAGRAM_BATCH][MAX_FRAME_LEN];
+	static __thread char replies[DATAGRAM_BATCH][MAX_FRAME_LEN];
+	struct mmsghdr in_msgs[DATAGRAM_BATCH], out_msgs[DATAGRAM_BATCH];
+	struct iovec in_iovs[DATAGRAM_BATCH], out_iovs[DATAGRAM_BATCH];
+	struct sockaddr_in peers[DATAGRAM_BATCH];
+	
+	while(1) {
+		memset(in_msgs, 0, sizeof in_msgs);
+		for(int i = 0; i < DATAGRAM_BATCH; i++) {
+			in_iovs[i].iov_base = requests[i];
+			in_iovs[i].iov_len = sizeof requests[i];
+			in_msgs[i].msg_hdr.msg_iov = &in_iovs[i];
+			in_msgs[i].msg_hdr.msg_iovlen = 1;
+			in_msgs[i].msg_hdr.msg_name = &peers[i];
+			in_msgs[i].msg_hdr.msg_namelen = sizeof peers[i];
 		}
 		
+		int n_in = recvmmsg(socket_fd, in_msgs, DATAGRAM_BATCH, MSG_DONTWAIT, NULL);
+		if(n_in <= 0) {
+			if(n_in < 0 && errno == EINTR)
+				continue;
+			return;
+		}
 		
-		char *queried_object = (char *) malloc(1024);
-		char buffer[1024] = {0}; 
-		memset(buffer, 0, strlen(buffer));
+		int n_out = 0;
+		memset(out_msgs, 0, sizeof out_msgs);
+		for(int i = 0; i < n_in; i++) {
+			struct frame_header header;
+			const char *payload;
+			size_t offset = 0;
+			
+			// A datagram carries exactly one frame
+			if(frame_parse(requests[i], in_msgs[i].msg_len, &offset, &header, &payload) != 1 || offset != in_msgs[i].msg_len)
+				continue;
+			size_t reply_len = handle_request(&header, payload, replies[n_out]);
+			
+			out_iovs[n_out].iov_base = replies[n_out];
+			out_iovs[n_out].iov_len = reply_len;
+			out_msgs[n_out].msg_hdr.msg_iov = &out_iovs[n_out];
+			out_msgs[n_out].msg_hdr.msg_iovlen = 1;
+			out_msgs[n_out].msg_hdr.msg_name = &peers[i];
+			out_msgs[n_out].msg_hdr.msg_namelen = in_msgs[i].msg_hdr.msg_namelen;
+			n_out++;
+		}
 		
-		int recv_status = recv(connection_fd, buffer, 1024, 0); 	
-		int type_of_msg = buffer[0] - '0';
-		char request_msg[strlen(buffer) - 2];
-		//printf("[DEBUGGING]: %s\t%d\t%d\n", buffer, strlen(buffer), recv_status);
+		// A reply that does not fit in the socket buffer is dropped, the proxy retries over TCP
+		for(int sent = 0; sent < n_out; ) {
+			int done = sendmmsg(socket_fd, out_msgs + sent, n_out - sent, MSG_DONTWAIT);
+			if(done <= 0) {
+				if(done < 0 && errno == EINTR)
+					continue;
+				break;
+			}
+			sent += done;
+		}
 		
-		if(recv_status != 0){
-			memcpy(request_msg, &buffer[2], strlen(buffer) - 2);
-			request_msg[strlen(buffer) - 2] = '\0';
+		if(n_in < DATAGRAM_BATCH)
+			return;
+	}
+}
+
+
+// The sockets owned by one worker shard
+struct worker {
+	int listen_fd;
+	int datagram_fd;
+	pthread_t thread_id;
+};
+
+
+// One edge triggered event loop per worker, sharing nothing but the read only database
+void *worker_thread(void *args) {
+	struct worker *self = (struct worker *) args;
+	int epoll_fd = epoll_create1(0);
+	struct epoll_event event, events[MAX_EVENTS];
+	
+	if(epoll_fd < 0) {
+		printf("[ERROR]: Unable to create the event loop\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = &self->listen_fd;
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, self->listen_fd, &event) < 0) {
+		printf("[ERROR]: Unable to create the event loop\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = &self->datagram_fd;
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, self->datagram_fd, &event) < 0) {
+		printf("[ERROR]: Unable to create the event loop\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	// Datagrams that arrived before the socket was watched produce no edge
+	serve_datagrams(self->datagram_fd);
+	
+	while(1) {
+		int n_events = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if(n_events < 0) {
+			if(errno == EINTR)
+				continue;
+			printf("[ERROR]: Event loop failed\n");
+			break;
 		}
 		
-		printf("[PROGRESS]: Message type received = %d\n", type_of_msg);
-		if(type_of_msg == 1 ) {
-			printf("Domain Name = %s\n", request_msg);
-			printf("[SEARCHING]...\n\n");
+		for(int i = 0; i < n_events; i++) {
+			if(events[i].data.ptr == &self->listen_fd)
+				accept_connections(epoll_fd, self->listen_fd);
+			else if(events[i].data.ptr == &self->datagram_fd)
+				serve_datagrams(self->datagram_fd);
+			else
+				drive_connection((struct connection *) events[i].data.ptr);
+		}
+	}
+	
+	close(epoll_fd);
+	close(self->listen_fd);
+	close(self->datagram_fd);
+	return NULL;
+}
+
+
+int main(int argc, char const *argv[]) 
+{ 
+	int backlog = DEFAULT_BACKLOG;
+	int n_workers = 1;
+	int level = LOG_INFO;
+	int stats_port = 0;
+	char *USAGE = "[USAGE]: <executable code> <Server Port number> [--backlog N] [--workers N] [--log-level error|info|debug] [--stats-port N]\n";
+	
+	// Validating User Parameters
+	if(argc < 2) {
+		printf("%s", USAGE);
+		return 0;
+	}
+	
+	int PORT_NO = atoi(argv[1]);
+	for(int i = 2; i < argc; i++) {
+		if(strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+			backlog = atoi(argv[++i]);
 		}
-		else if (type_of_msg == 2) {
-			printf("I/P Address = %s\n", request_msg);
-			printf("[SEARCHING]...\n\n");
+		else if(strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+			n_workers = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+			level = log_parse_level(argv[++i]);
+		}
+		else if(strcmp(argv[i], "--stats-port") == 0 && i + 1 < argc) {
+			stats_port = atoi(argv[++i]);
 		}
 		else {
-			printf("[CLOSE]: Client is down\n\n");
-			break;
+			printf("%s", USAGE);
+			return 0;
 		}
+	}
+	
+	// Every worker is a database reader, the slots are fixed at compile time
+	if(n_workers < 1 || n_workers > MAX_DB_READERS) {
+		printf("[ERROR]: Number of workers must be between 1 and %d\n", MAX_DB_READERS);
+		return 0;
+	}
+	if(level < 0) {
+		printf("%s", USAGE);
+		return 0;
+	}
+	log_init(level);
+	
+	// Keeping counters and latency histograms, served on 127.0.0.1 when asked for
+	if(!stats_create(STATS_SERVER, false)) {
+		printf("[ERROR]: Unable to allocate the statistics\n");
+		exit(EXIT_FAILURE);
+	}
+	pool_init(&connection_pool, "connection", sizeof(struct connection));
+	if(stats_port > 0 && !stats_serve(stats_port, pool_write_stats)) {
+		printf("[ERROR]: Unable to serve statistics on port %d\n", stats_port);
+		exit(EXIT_FAILURE);
+	}
+	
+	// Indexing the database before accepting any query
+	struct dbf_file *database = (struct dbf_file *) malloc(sizeof *database);
+	if(load_database(DATABASE_PATH, COMPILED_DATABASE_PATH, database) < 0) {
+		printf("[ERROR]: Unable to load the database\n");
+		exit(EXIT_FAILURE);
+	}
+	atomic_store(&current_database, database);
+	
+	// Reloading database.txt on SIGHUP without stopping the server
+	pthread_t reload_thread_id;
+	struct sigaction reload_action;
+	
+	sem_init(&reload_request, 0, 0);
+	memset(&reload_action, 0, sizeof reload_action);
+	reload_action.sa_handler = request_reload;
+	reload_action.sa_flags = SA_RESTART;
+	sigaction(SIGHUP, &reload_action, NULL);
+	
+	if(pthread_create(&reload_thread_id, NULL, reload_thread, NULL) != 0) {
+		printf("[ERROR]: Could not create thread\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	
+	// Starting the worker shards, each with its own listeners (TCP and UDP, SO_REUSEPORT when there are several) and event loop
+	struct worker *workers = (struct worker *) calloc(n_workers, sizeof *workers);
+	
+	for(int i = 0; i < n_workers; i++) {
+		workers[i].listen_fd = create_listener(PORT_NO, backlog, n_workers > 1);
+		workers[i].datagram_fd = create_datagram_socket(PORT_NO, n_workers > 1);
+		if(workers[i].listen_fd < 0 || workers[i].datagram_fd < 0)
+			exit(EXIT_FAILURE);
 		
-		
-		// Searching in Database
-		int server_status = search_database(request_msg, queried_object, type_of_msg);
-		
-		if(server_status == -1) {
-			send(connection_fd, ERROR, strlen(ERROR), 0);
-			break;
+		if(pthread_create(&workers[i].thread_id, NULL, worker_thread, &workers[i]) != 0) {
+			printf("[ERROR]: Could not create thread\n");
+			exit(EXIT_FAILURE);
 		}
-		
-		
-		// Configuring the Reply from the DNS Server
-		char *reply = (char *) malloc(1024);
-		
-		reply[0] = '4' - server_status;
-		reply[1] = '#';
-		strcpy(reply + 2, queried_object);
-		printf("[RESULT]: %s\n", reply);
-		printf("[RESULT]: Message type sent = %d\n", reply[0] - '0');
-		
-		
-		// Replying to the DNS Proxy
-		send(connection_fd, reply, strlen(reply), 0); 
-		
-		close(connection_fd);
 	}
+	printf("[SUCCESS]: Serving with %d worker(s)\n", n_workers);
+	
+	for(int i = 0; i < n_workers; i++)
+		pthread_join(workers[i].thread_id, NULL);
 	
 	printf("[COMPLETED]: Server Closed\n"); 
-	close(socket_fd);
 	
 	return 0; 
 } 
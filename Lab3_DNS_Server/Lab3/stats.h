@@ -0,0 +1,436 @@
+/*
+ * Counters and latency histograms for the server and the proxies
+ *
+ * Every thread that records a metric claims a slot of its own in the
+ * stats area, so stats_count() and stats_observe() are plain stores with
+ * no lock and no shared cache line. Readers add all slots up. The area
+ * can be created in shared memory, where the forked children of the
+ * multiprocess proxy claim slots next to their parent's; a slot is
+ * handed on when its thread or its process exits, or once its process is
+ * found dead, and keeps its totals. A thread that finds no free slot records into slot 0 with
+ * atomic adds.
+ *
+ * Histograms are HDR style: each power of two nanoseconds is split into
+ * STATS_SUB_BUCKETS linear buckets, which keeps every recorded latency
+ * within 12.5% of its value from 1 ns up to hours.
+ *
+ * stats_serve() answers every connection to a local port with the
+ * totals in the Prometheus text format, so curl or a scraper can read
+ * them (curl http://127.0.0.1:<port>/metrics).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+
+#define STATS_MAX_SLOTS 256
+#define STATS_SUB_BITS 3
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS (42 * STATS_SUB_BUCKETS)
+#define STATS_REQUEST_WAIT_MS 100
+
+#define STATS_SERVER 1
+#define STATS_PROXY 2
+
+
+enum stats_counter {
+	STAT_QUERIES_NAME,
+	STAT_QUERIES_ADDR,
+	STAT_BAD_REQUESTS,
+	STAT_DB_FOUND,
+	STAT_DB_NOT_FOUND,
+	STAT_CACHE_HITS,
+	STAT_CACHE_NEGATIVE_HITS,
+	STAT_CACHE_MISSES,
+	STAT_COALESCED,
+	STAT_UPSTREAM_QUERIES,
+	STAT_UPSTREAM_ERRORS,
+	STAT_UPSTREAM_HEDGES,
+	STAT_UPSTREAM_FAILOVERS,
+	STAT_CONNECTIONS_OPENED,
+	STAT_CONNECTIONS_CLOSED,
+	STAT_COUNTERS
+};
+
+enum stats_histogram {
+	STAT_QUERY_LATENCY,
+	STAT_DB_LOOKUP,
+	STAT_UPSTREAM_LATENCY,
+	STAT_HISTOGRAMS
+};
+
+// Name, labels and the programs that record it, in the order of the enums
+static const struct {
+	const char *name;
+	const char *labels;
+	int roles;
+} stats_counters[STAT_COUNTERS] = {
+	{"dns_queries_total", "{type=\"name\"}", STATS_SERVER | STATS_PROXY},
+	{"dns_queries_total", "{type=\"addr\"}", STATS_SERVER | STATS_PROXY},
+	{"dns_bad_requests_total", "", STATS_SERVER | STATS_PROXY},
+	{"dns_db_lookups_total", "{result=\"found\"}", STATS_SERVER},
+	{"dns_db_lookups_total", "{result=\"not_found\"}", STATS_SERVER},
+	{"dns_cache_lookups_total", "{result=\"hit\"}", STATS_PROXY},
+	{"dns_cache_lookups_total", "{result=\"negative\"}", STATS_PROXY},
+	{"dns_cache_lookups_total", "{result=\"miss\"}", STATS_PROXY},
+	{"dns_coalesced_misses_total", "", STATS_PROXY},
+	{"dns_upstream_queries_total", "", STATS_PROXY},
+	{"dns_upstream_errors_total", "", STATS_PROXY},
+	{"dns_upstream_hedges_total", "", STATS_PROXY},
+	{"dns_upstream_failovers_total", "", STATS_PROXY},
+	{"dns_connections_total", "", STATS_SERVER | STATS_PROXY},
+	{NULL, NULL, STATS_SERVER | STATS_PROXY},
+};
+
+static const struct {
+	const char *name;
+	int roles;
+} stats_histograms[STAT_HISTOGRAMS] = {
+	{"dns_query_duration_seconds", STATS_SERVER | STATS_PROXY},
+	{"dns_db_lookup_duration_seconds", STATS_SERVER},
+	{"dns_upstream_duration_seconds", STATS_PROXY},
+};
+
+
+struct stats_slot {
+	pid_t owner;
+	uint64_t counters[STAT_COUNTERS];
+	uint64_t buckets[STAT_HISTOGRAMS][STATS_BUCKETS];
+	uint64_t sum_ns[STAT_HISTOGRAMS];
+};
+
+struct stats_area {
+	int roles;
+	bool shared;
+	int n_slots;
+	struct stats_slot slots[STATS_MAX_SLOTS];
+};
+
+static struct stats_area *stats;
+static pthread_key_t stats_key;
+static __thread struct stats_slot *stats_thread_slot;
+static __thread bool stats_thread_shared;
+static int stats_listen_fd = -1;
+
+
+static inline uint64_t stats_now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+static inline int stats_bucket(uint64_t ns) {
+	if(ns < STATS_SUB_BUCKETS)
+		return (int) ns;
+
+	int shift = 63 - __builtin_clzll(ns) - STATS_SUB_BITS;
+	int bucket = (shift + 1) * STATS_SUB_BUCKETS + (int) ((ns >> shift) & (STATS_SUB_BUCKETS - 1));
+	return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+// Highest latency counted in a bucket
+static inline uint64_t stats_bucket_top(int bucket) {
+	if(bucket < STATS_SUB_BUCKETS)
+		return bucket;
+
+	int shift = bucket / STATS_SUB_BUCKETS - 1;
+	return ((uint64_t) (STATS_SUB_BUCKETS + bucket % STATS_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+
+// Handing the slot of an exiting thread on to the next thread that needs one
+static inline void stats_thread_exit(void *slot) {
+	__atomic_store_n(&((struct stats_slot *) slot)->owner, 0, __ATOMIC_RELEASE);
+}
+
+// A forked child claims its own slots instead of writing into its parent's, and leaves the stats port to the
+// parent: the child has no thread accepting on it, and holding it open would keep the port bound past the parent
+static inline void stats_fork_child(void) {
+	stats_thread_slot = NULL;
+	stats_thread_shared = false;
+	if(stats_listen_fd >= 0) {
+		close(stats_listen_fd);
+		stats_listen_fd = -1;
+	}
+}
+
+
+// An exiting process hands its slots on at once, without waiting to be reaped
+static inline void stats_exit(void) {
+	pid_t self = getpid();
+
+	for(int i = 1; i < STATS_MAX_SLOTS; i++) {
+		pid_t owner = self;
+		__atomic_compare_exchange_n(&stats->slots[i].owner, &owner, 0, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	}
+}
+
+
+// Creating the stats area, in shared memory when forked children record into it too
+static inline bool stats_create(int roles, bool shared) {
+	if(shared)
+		stats = (struct stats_area *) mmap(NULL, sizeof *stats, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	else
+		stats = (struct stats_area *) mmap(NULL, sizeof *stats, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(stats == MAP_FAILED) {
+		stats = NULL;
+		return false;
+	}
+
+	stats->roles = roles;
+	stats->shared = shared;
+	stats->n_slots = 1;
+	pthread_key_create(&stats_key, stats_thread_exit);
+	pthread_atfork(NULL, NULL, stats_fork_child);
+	atexit(stats_exit);
+	return true;
+}
+
+
+// Claiming a free slot, or the slot of a process that is gone
+static inline void stats_claim(void) {
+	pid_t self = getpid();
+
+	for(int i = 1; i < STATS_MAX_SLOTS; i++) {
+		struct stats_slot *slot = &stats->slots[i];
+		pid_t owner = __atomic_load_n(&slot->owner, __ATOMIC_ACQUIRE);
+
+		if(owner != 0 && (!stats->shared || owner == self || kill(owner, 0) == 0 || errno != ESRCH))
+			continue;
+		if(!__atomic_compare_exchange_n(&slot->owner, &owner, self, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			continue;
+
+		int n_slots = __atomic_load_n(&stats->n_slots, __ATOMIC_RELAXED);
+		while(n_slots <= i && !__atomic_compare_exchange_n(&stats->n_slots, &n_slots, i + 1, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+		pthread_setspecific(stats_key, slot);
+		stats_thread_slot = slot;
+		return;
+	}
+
+	stats_thread_slot = &stats->slots[0];
+	stats_thread_shared = true;
+}
+
+
+static inline void stats_bump(uint64_t *cell, uint64_t n) {
+	if(stats_thread_shared)
+		__atomic_fetch_add(cell, n, __ATOMIC_RELAXED);
+	else
+		__atomic_store_n(cell, __atomic_load_n(cell, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+
+static inline void stats_add(enum stats_counter counter, uint64_t n) {
+	if(stats == NULL)
+		return;
+	if(stats_thread_slot == NULL)
+		stats_claim();
+	stats_bump(&stats_thread_slot->counters[counter], n);
+}
+
+static inline void stats_count(enum stats_counter counter) {
+	stats_add(counter, 1);
+}
+
+// Recording one latency in nanoseconds
+static inline void stats_observe(enum stats_histogram histogram, uint64_t ns) {
+	if(stats == NULL)
+		return;
+	if(stats_thread_slot == NULL)
+		stats_claim();
+	stats_bump(&stats_thread_slot->buckets[histogram][stats_bucket(ns)], 1);
+	stats_bump(&stats_thread_slot->sum_ns[histogram], ns);
+}
+
+
+// Adding up a counter over every slot
+static inline uint64_t stats_total(enum stats_counter counter) {
+	int n_slots = __atomic_load_n(&stats->n_slots, __ATOMIC_ACQUIRE);
+	uint64_t total = 0;
+
+	for(int i = 0; i < n_slots; i++)
+		total += __atomic_load_n(&stats->slots[i].counters[counter], __ATOMIC_RELAXED);
+	return total;
+}
+
+static inline void stats_merge(enum stats_histogram histogram, uint64_t *buckets, uint64_t *sum_ns) {
+	int n_slots = __atomic_load_n(&stats->n_slots, __ATOMIC_ACQUIRE);
+
+	memset(buckets, 0, STATS_BUCKETS * sizeof *buckets);
+	*sum_ns = 0;
+	for(int i = 0; i < n_slots; i++) {
+		for(int j = 0; j < STATS_BUCKETS; j++)
+			buckets[j] += __atomic_load_n(&stats->slots[i].buckets[histogram][j], __ATOMIC_RELAXED);
+		*sum_ns += __atomic_load_n(&stats->slots[i].sum_ns[histogram], __ATOMIC_RELAXED);
+	}
+}
+
+// Latency under which the fraction q of the recorded ones fall, 0 when there are none
+static inline uint64_t stats_quantile(const uint64_t *buckets, uint64_t count, double q) {
+	uint64_t rank = (uint64_t) (q * count + 0.5), seen = 0;
+
+	if(count == 0)
+		return 0;
+	for(int i = 0; i < STATS_BUCKETS; i++) {
+		seen += buckets[i];
+		if(seen >= rank && seen > 0)
+			return stats_bucket_top(i);
+	}
+	return stats_bucket_top(STATS_BUCKETS - 1);
+}
+
+
+// Writing every metric of this program in the Prometheus text format
+static inline void stats_write(FILE *out) {
+	static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+	const char *family = NULL;
+
+	for(int i = 0; i < STAT_CONNECTIONS_CLOSED; i++) {
+		if((stats_counters[i].roles & stats->roles) == 0)
+			continue;
+		if(family == NULL || strcmp(family, stats_counters[i].name) != 0) {
+			family = stats_counters[i].name;
+			fprintf(out, "# TYPE %s counter\n", family);
+		}
+		fprintf(out, "%s%s %llu\n", family, stats_counters[i].labels, (unsigned long long) stats_total(i));
+	}
+
+	uint64_t opened = stats_total(STAT_CONNECTIONS_OPENED), closed = stats_total(STAT_CONNECTIONS_CLOSED);
+	fprintf(out, "# TYPE dns_active_connections gauge\ndns_active_connections %llu\n",
+		(unsigned long long) (opened > closed ? opened - closed : 0));
+
+	for(int h = 0; h < STAT_HISTOGRAMS; h++) {
+		uint64_t buckets[STATS_BUCKETS], sum_ns, count = 0;
+		const char *name = stats_histograms[h].name;
+
+		if((stats_histograms[h].roles & stats->roles) == 0)
+			continue;
+		stats_merge(h, buckets, &sum_ns);
+
+		// Cumulative counts at every power of two from 128 ns to 16 s, which are all bucket edges
+		fprintf(out, "# TYPE %s histogram\n", name);
+		int bucket = 0;
+		for(int power = 7; power <= 34; power++) {
+			for(; bucket < STATS_BUCKETS && stats_bucket_top(bucket) < (1ULL << power); bucket++)
+				count += buckets[bucket];
+			fprintf(out, "%s_bucket{le=\"%.9g\"} %llu\n", name, (double) (1ULL << power) / 1e9, (unsigned long long) count);
+		}
+		for(; bucket < STATS_BUCKETS; bucket++)
+			count += buckets[bucket];
+		fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) count);
+		fprintf(out, "%s_sum %.9f\n%s_count %llu\n", name, sum_ns / 1e9, name, (unsigned long long) count);
+
+		// The same latencies as quantiles, which is what a p99 regression shows up in first
+		fprintf(out, "# TYPE %s_quantile gauge\n", name);
+		for(size_t q = 0; q < sizeof quantiles / sizeof quantiles[0]; q++)
+			fprintf(out, "%s_quantile{quantile=\"%g\"} %.9f\n", name, quantiles[q], stats_quantile(buckets, count, quantiles[q]) / 1e9);
+	}
+}
+
+
+struct stats_server {
+	int listen_fd;
+	void (*extra)(FILE *out);
+};
+
+// Sending all of buf, which a signal may otherwise cut short, false once the scraper is gone
+static inline bool stats_send_all(int fd, const char *buf, size_t len) {
+	while(len > 0) {
+		ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+		if(sent > 0) {
+			buf += sent;
+			len -= sent;
+		}
+		else if(sent < 0 && errno == EINTR) {
+			continue;
+		}
+		else {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+// Answering each connection with the metrics, as a plain HTTP response so that curl and scrapers can read it
+static inline void *stats_thread(void *args) {
+	struct stats_server *server = (struct stats_server *) args;
+
+	while(1) {
+		int fd = accept(server->listen_fd, NULL, NULL);
+		if(fd < 0) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		// Whatever was asked for, the answer is the same
+		char request[1024];
+		struct pollfd readable = {fd, POLLIN, 0};
+		if(poll(&readable, 1, STATS_REQUEST_WAIT_MS) > 0)
+			recv(fd, request, sizeof request, 0);
+
+		char *body = NULL;
+		size_t body_len = 0;
+		FILE *out = open_memstream(&body, &body_len);
+		if(out != NULL) {
+			stats_write(out);
+			if(server->extra != NULL)
+				server->extra(out);
+			fclose(out);
+
+			char header[128];
+			int header_len = snprintf(header, sizeof header,
+				"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_len);
+			if(stats_send_all(fd, header, header_len))
+				stats_send_all(fd, body, body_len);
+			free(body);
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+
+// Serving the metrics on 127.0.0.1:port, extra may add metrics of its own after them
+static inline bool stats_serve(int port, void (*extra)(FILE *out)) {
+	struct stats_server *server = (struct stats_server *) malloc(sizeof *server);
+	struct sockaddr_in address;
+	int reuse = 1;
+	pthread_t stats_thread_id;
+
+	memset(&address, 0, sizeof address);
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = htons(port);
+
+	server->extra = extra;
+	server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(server->listen_fd < 0)
+		return false;
+	setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+	if(bind(server->listen_fd, (struct sockaddr *) &address, sizeof address) < 0 || listen(server->listen_fd, 16) < 0
+			|| pthread_create(&stats_thread_id, NULL, stats_thread, server) != 0) {
+		close(server->listen_fd);
+		free(server);
+		return false;
+	}
+	stats_listen_fd = server->listen_fd;
+	return true;
+}
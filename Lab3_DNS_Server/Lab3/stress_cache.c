@@ -0,0 +1,188 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "proto.h"
+#include "cache.h"
+#include "bench.h"
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_CAPACITY 512
+#define DEFAULT_SHARDS 4
+#define DEFAULT_ITERATIONS 200000
+#define HOT_KEYS 300
+#define COLD_KEYS 100000
+#define SHORT_TTL 1
+#define LONG_TTL 1000
+
+
+// Every key has one value, or is known to be missing when its number is a multiple of 10,
+// so any other answer read from the cache was torn or mixed up with another entry
+struct cache *cache;
+long n_threads = DEFAULT_THREADS;
+long capacity = DEFAULT_CAPACITY;
+long n_iterations = DEFAULT_ITERATIONS;
+long n_wrong = 0;
+long n_hits = 0;
+long n_refreshes = 0;
+bool done = false;
+char snapshot_path[64];
+
+
+void keyOf(long key_no, char *key) {
+	sprintf(key, "k%ld.stress.example", key_no);
+}
+
+void valueOf(long key_no, char *value) {
+	sprintf(value, "value-of-%ld", key_no);
+}
+
+
+// Hot keys mostly, which stay cached and are read while other threads write their shard,
+// and a quarter cold ones, which keep the CLOCK hands and the admission window moving
+void *workerThread(void *args) {
+	uint64_t seed = 0x9e3779b97f4a7c15ULL * ((long) args + 1);
+	long wrong = 0, hits = 0;
+
+	for(long i = 0; i < n_iterations; i++) {
+		uint64_t random = bench_random(&seed);
+		long key_no = random % 4 == 0 ? (long) ((random >> 8) % COLD_KEYS) : (long) ((random >> 8) % HOT_KEYS);
+		char key[64], value[CACHE_VALUE_MAX], expected[64];
+		uint32_t ttl;
+
+		keyOf(key_no, key);
+		valueOf(key_no, expected);
+		int found = cache_lookup(cache, OP_QUERY_NAME, key, value, &ttl);
+		if(found == CACHE_HIT) {
+			hits++;
+			if(key_no % 10 == 0 || strcmp(value, expected) != 0)
+				wrong++;
+		}
+		else if(found == CACHE_NEGATIVE) {
+			if(key_no % 10 != 0)
+				wrong++;
+		}
+		else if(key_no % 10 == 0)
+			cache_insert(cache, OP_QUERY_NAME, key, NULL, SHORT_TTL);
+		else
+			cache_insert(cache, OP_QUERY_NAME, key, expected, (random >> 40) % 2 ? SHORT_TTL : LONG_TTL);
+	}
+
+	__atomic_fetch_add(&n_wrong, wrong, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&n_hits, hits, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+
+void countRefresh(int type, const char *key) {
+	if(type != OP_QUERY_NAME || key[0] != 'k')
+		__atomic_fetch_add(&n_wrong, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&n_refreshes, 1, __ATOMIC_RELAXED);
+}
+
+// What the proxies run next to the lookups: the sweeper, the refresher's scan and the snapshots, all lock-free readers
+void *housekeepingThread(void *args) {
+	while(!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		cache_sweep(cache, 64);
+		cache_scan_hot(cache, SHORT_TTL + 1, countRefresh);
+		if(cache_save(cache, snapshot_path) < 0)
+			__atomic_fetch_add(&n_wrong, 1, __ATOMIC_RELAXED);
+		usleep(10000);
+	}
+	return NULL;
+}
+
+
+// Every live entry must still be reachable through its shard's index
+long countUnindexed(struct cache *cache) {
+	long unindexed = 0;
+
+	for(uint32_t i = 0; i < cache->n_shards; i++) {
+		struct cache_shard *shard = &cache_shards(cache)[i];
+
+		for(uint32_t entry_no = 0; entry_no < shard->n_used; entry_no++) {
+			struct cache_entry *entry = &cache_entries(cache, shard)[entry_no];
+			if(!entry->live)
+				continue;
+
+			uint32_t slot = cache_probe(cache, shard, entry->hash, entry->type, entry->key);
+			if(cache_index(cache, shard)[slot] != entry_no + 1)
+				unindexed++;
+		}
+	}
+	return unindexed;
+}
+
+
+int main(int argc, char const *argv[]) {
+	char *USAGE = "[USAGE]: <executable code> [--threads N] [--capacity N] [--iterations N]\n";
+
+	for(int i = 1; i < argc; i++) {
+		long *option = NULL;
+
+		if(strcmp(argv[i], "--threads") == 0)
+			option = &n_threads;
+		else if(strcmp(argv[i], "--capacity") == 0)
+			option = &capacity;
+		else if(strcmp(argv[i], "--iterations") == 0)
+			option = &n_iterations;
+		if(option == NULL || i + 1 == argc || (*option = bench_parse_count(argv[++i])) < 0) {
+			printf("%s", USAGE);
+			return 0;
+		}
+	}
+	if(capacity < DEFAULT_SHARDS) {
+		printf("[ERROR]: The capacity is at least %d\n", DEFAULT_SHARDS);
+		return 0;
+	}
+
+	cache = cache_create(capacity, DEFAULT_SHARDS);
+	pthread_t *workers = (pthread_t *) calloc(n_threads, sizeof *workers);
+	pthread_t housekeeping;
+	if(cache == NULL || workers == NULL) {
+		printf("[ERROR]: Out of memory\n");
+		return 1;
+	}
+	snprintf(snapshot_path, sizeof snapshot_path, "/tmp/stress_cache.%d.bin", (int) getpid());
+
+	int64_t begin = bench_now_ns();
+	for(long i = 0; i < n_threads; i++)
+		pthread_create(&workers[i], NULL, workerThread, (void *) i);
+	pthread_create(&housekeeping, NULL, housekeepingThread, NULL);
+	for(long i = 0; i < n_threads; i++)
+		pthread_join(workers[i], NULL);
+	__atomic_store_n(&done, true, __ATOMIC_RELEASE);
+	pthread_join(housekeeping, NULL);
+
+	// The last snapshot must load back into an empty cache with the same values
+	struct cache *loaded = cache_create(capacity, DEFAULT_SHARDS);
+	long n_loaded = loaded != NULL ? cache_load(loaded, snapshot_path) : -1;
+	for(long key_no = 0; n_loaded >= 0 && key_no < HOT_KEYS; key_no++) {
+		char key[64], value[CACHE_VALUE_MAX], expected[64];
+		uint32_t ttl;
+
+		keyOf(key_no, key);
+		valueOf(key_no, expected);
+		if(cache_lookup(loaded, OP_QUERY_NAME, key, value, &ttl) == CACHE_HIT && strcmp(value, expected) != 0)
+			n_wrong++;
+	}
+	unlink(snapshot_path);
+
+	struct cache_stats stats;
+	long n_unindexed = countUnindexed(cache);
+	cache_get_stats(cache, &stats);
+	printf("[RESULT]: %ld threads x %ld lookups in %.2f s: %ld hits, %llu evictions, %llu expired, %ld refresh candidates\n",
+		n_threads, n_iterations, (bench_now_ns() - begin) / 1e9, n_hits, (unsigned long long) stats.evictions,
+		(unsigned long long) stats.expirations, n_refreshes);
+	printf("[RESULT]: %ld wrong answers, %ld live entries missing from the index, %ld records reloaded\n",
+		n_wrong, n_unindexed, n_loaded);
+	if(n_wrong > 0 || n_unindexed > 0 || n_loaded < 0) {
+		printf("[ERROR]: The cache gave a wrong answer or lost track of an entry\n");
+		return 1;
+	}
+	printf("[SUCCESS]: No wrong answer\n");
+	return 0;
+}
@@ -0,0 +1,111 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "proto.h"
+#include "bench.h"
+
+#define DEFAULT_FRAMES 420
+#define MAX_FRAMES 65536
+#define REPLY_TIMEOUT_S 5
+#define RECEIVE_BUFFER 65536
+#define QUERY_ADDR "172.16.78.1"
+
+
+// Pipelining --frames queries in a single write and checking that every one is answered exactly once.
+// The address is in database.txt, so the replies carry a name and fill the server's output buffer before
+// its input is used up. A server that leaves frames unread in its buffer stalls here until the timeout
+int main(int argc, char const *argv[]) {
+	char *USAGE = "[USAGE]: <executable code> <Server IP Address> <Server Port number> [--frames N]\n";
+	long n_frames = DEFAULT_FRAMES;
+
+	if(argc < 3) {
+		printf("%s", USAGE);
+		return 0;
+	}
+	for(int i = 3; i < argc; i++) {
+		if(strcmp(argv[i], "--frames") != 0 || i + 1 == argc || (n_frames = bench_parse_count(argv[++i])) < 0) {
+			printf("%s", USAGE);
+			return 0;
+		}
+	}
+	if(n_frames > MAX_FRAMES) {
+		printf("[ERROR]: At most %d frames\n", MAX_FRAMES);
+		return 0;
+	}
+
+	char *out = (char *) malloc(n_frames * MAX_FRAME_LEN);
+	char *in = (char *) malloc(RECEIVE_BUFFER);
+	bool *answered = (bool *) calloc(n_frames, sizeof *answered);
+	if(out == NULL || in == NULL || answered == NULL) {
+		printf("[ERROR]: Out of memory\n");
+		return 1;
+	}
+
+	int fd = bench_connect(argv[1], atoi(argv[2]), SOCK_STREAM);
+	struct timeval timeout = {REPLY_TIMEOUT_S, 0};
+	if(fd < 0) {
+		printf("[ERROR]: Unable to connect to %s:%s\n", argv[1], argv[2]);
+		return 1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+	size_t out_len = 0;
+	for(long i = 0; i < n_frames; i++)
+		out_len += frame_encode(out + out_len, i, OP_QUERY_ADDR, 0, QUERY_ADDR, strlen(QUERY_ADDR));
+	for(size_t sent_len = 0; sent_len < out_len; ) {
+		ssize_t sent = send(fd, out + sent_len, out_len - sent_len, MSG_NOSIGNAL);
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent <= 0) {
+			printf("[ERROR]: Unable to send the queries\n");
+			return 1;
+		}
+		sent_len += sent;
+	}
+
+	long n_answered = 0, n_wrong = 0;
+	size_t in_len = 0;
+	while(n_answered < n_frames) {
+		ssize_t got = recv(fd, in + in_len, RECEIVE_BUFFER - in_len, 0);
+		if(got < 0 && errno == EINTR)
+			continue;
+		if(got <= 0)
+			break;
+		in_len += got;
+
+		struct frame_header header;
+		const char *payload;
+		size_t offset = 0;
+		int parsed;
+		while((parsed = frame_parse(in, in_len, &offset, &header, &payload)) == 1) {
+			if(!(header.flags & FLAG_REPLY) || header.request_id >= (uint32_t) n_frames || answered[header.request_id]) {
+				n_wrong++;
+				continue;
+			}
+			answered[header.request_id] = true;
+			n_answered++;
+		}
+		if(parsed < 0) {
+			n_wrong++;
+			break;
+		}
+		memmove(in, in + offset, in_len - offset);
+		in_len -= offset;
+	}
+	close(fd);
+
+	printf("[RESULT]: %ld frames in one write of %zu bytes: %ld answered, %ld unexpected replies\n", n_frames,
+		out_len, n_answered, n_wrong);
+	if(n_answered < n_frames || n_wrong > 0) {
+		printf("[ERROR]: %ld queries never answered\n", n_frames - n_answered);
+		return 1;
+	}
+	printf("[SUCCESS]: Every query answered\n");
+	return 0;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "bench.h"
+
+#define DEFAULT_KEYS 200000
+#define DEFAULT_REQUESTS 4000000
+#define DEFAULT_SKEW 0.9
+#define DEFAULT_SCAN 50000
+#define DEFAULT_SCAN_EVERY 200000
+
+
+// Writing a trace of lookups to stdout, one per line: "z <name>" for a name drawn from a Zipf
+// distribution over --keys names, "s <name>" for a name of a scan, looked up once and never again.
+// Every --scan-every requests start with a burst of --scan of those, as a batch job resolving a list would
+long n_keys = DEFAULT_KEYS;
+long n_requests = DEFAULT_REQUESTS;
+long scan_len = DEFAULT_SCAN;
+long scan_every = DEFAULT_SCAN_EVERY;
+double skew = DEFAULT_SKEW;
+double *cdf;
+
+
+// Picking key i with a probability proportional to 1 / (i + 1)^skew, uniformly for a skew of 0
+long pickKey(uint64_t *seed) {
+	double u = (bench_random(seed) >> 11) * (1.0 / 9007199254740992.0);
+	long lo = 0, hi = n_keys - 1;
+
+	while(lo < hi) {
+		long mid = lo + (hi - lo) / 2;
+		if(cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+
+int main(int argc, char const *argv[]) {
+	char *USAGE = "[USAGE]: <executable code> [--keys N] [--requests N] [--skew S] [--scan N] [--scan-every N] > trace.txt\n";
+	uint64_t seed = 88172645463325252ULL;
+
+	for(int i = 1; i < argc; i++) {
+		long *option = NULL;
+
+		if(strcmp(argv[i], "--skew") == 0 && i + 1 < argc) {
+			char *end;
+			skew = strtod(argv[++i], &end);
+			if(end == argv[i] || *end != '\0' || skew < 0) {
+				printf("%s", USAGE);
+				return 0;
+			}
+			continue;
+		}
+		if(strcmp(argv[i], "--keys") == 0)
+			option = &n_keys;
+		else if(strcmp(argv[i], "--requests") == 0)
+			option = &n_requests;
+		else if(strcmp(argv[i], "--scan") == 0)
+			option = &scan_len;
+		else if(strcmp(argv[i], "--scan-every") == 0)
+			option = &scan_every;
+		if(option == NULL || i + 1 == argc || (*option = bench_parse_count(argv[++i])) < 0) {
+			printf("%s", USAGE);
+			return 0;
+		}
+	}
+	if(scan_len > scan_every) {
+		printf("[ERROR]: --scan is at most --scan-every\n");
+		return 0;
+	}
+
+	cdf = (double *) malloc(n_keys * sizeof *cdf);
+	if(cdf == NULL) {
+		printf("[ERROR]: Out of memory\n");
+		return 1;
+	}
+	double total = 0;
+	for(long i = 0; i < n_keys; i++) {
+		total += 1.0 / pow(i + 1, skew);
+		cdf[i] = total;
+	}
+	for(long i = 0; i < n_keys; i++)
+		cdf[i] /= total;
+
+	long n_scanned = 0;
+	for(long i = 0; i < n_requests; i++) {
+		if(i % scan_every < scan_len)
+			printf("s scan%ld.trace.example\n", n_scanned++);
+		else
+			printf("z host%ld.trace.example\n", pickKey(&seed));
+	}
+	free(cdf);
+	return fflush(stdout) == 0 ? 0 : 1;
+}
@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "proto.h"
+#include "cache.h"
+#include "bench.h"
+
+#define DEFAULT_CAPACITY 20000
+#define DEFAULT_SHARDS 16
+#define SWEEP_EVERY 10000
+#define TTL 100000
+#define NO_KEY UINT32_MAX
+
+
+// Every distinct name of the trace gets a number, for the LRU to work on
+struct name_table {
+	char **names;
+	uint32_t *slots;
+	uint32_t mask;
+	uint32_t n_names;
+};
+
+// An exact LRU of capacity names: a doubly linked list over the name numbers, most recent at head
+struct lru {
+	uint32_t *prev;
+	uint32_t *next;
+	bool *cached;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t n_cached;
+	uint32_t allocated;
+};
+
+
+long capacity = DEFAULT_CAPACITY;
+long n_shards = DEFAULT_SHARDS;
+
+
+bool tableGrow(struct name_table *table) {
+	uint32_t size = table->mask ? (table->mask + 1) * 2 : 1024;
+	uint32_t *slots = (uint32_t *) malloc(size * sizeof *slots);
+	char **names = (char **) realloc(table->names, (size / 2) * sizeof *names);
+
+	if(slots == NULL || names == NULL) {
+		free(slots);
+		if(names != NULL)
+			table->names = names;
+		return false;
+	}
+	memset(slots, 0xff, size * sizeof *slots);
+	for(uint32_t id = 0; id < table->n_names; id++) {
+		uint32_t slot = cache_hash(0, names[id]) & (size - 1);
+		while(slots[slot] != NO_KEY)
+			slot = (slot + 1) & (size - 1);
+		slots[slot] = id;
+	}
+	free(table->slots);
+	table->slots = slots;
+	table->names = names;
+	table->mask = size - 1;
+	return true;
+}
+
+// The number of name, given the next one if it is new, or NO_KEY when out of memory
+uint32_t tableIntern(struct name_table *table, const char *name) {
+	if((table->n_names + 1) * 2 > table->mask + 1 && !tableGrow(table))
+		return NO_KEY;
+
+	uint32_t slot = cache_hash(0, name) & table->mask;
+	while(table->slots[slot] != NO_KEY) {
+		if(strcmp(table->names[table->slots[slot]], name) == 0)
+			return table->slots[slot];
+		slot = (slot + 1) & table->mask;
+	}
+	if((table->names[table->n_names] = strdup(name)) == NULL)
+		return NO_KEY;
+	table->slots[slot] = table->n_names;
+	return table->n_names++;
+}
+
+
+void lruUnlink(struct lru *lru, uint32_t id) {
+	uint32_t prev = lru->prev[id], next = lru->next[id];
+
+	if(prev != NO_KEY)
+		lru->next[prev] = next;
+	else
+		lru->head = next;
+	if(next != NO_KEY)
+		lru->prev[next] = prev;
+	else
+		lru->tail = prev;
+}
+
+void lruPushFront(struct lru *lru, uint32_t id) {
+	lru->prev[id] = NO_KEY;
+	lru->next[id] = lru->head;
+	if(lru->head != NO_KEY)
+		lru->prev[lru->head] = id;
+	lru->head = id;
+	if(lru->tail == NO_KEY)
+		lru->tail = id;
+}
+
+// Looking up name number id, which then becomes the most recent. Returns 1 on a hit, 0 on a miss, -1 when out of memory
+int lruAccess(struct lru *lru, uint32_t id) {
+	if(id >= lru->allocated) {
+		uint32_t allocated = lru->allocated ? lru->allocated * 2 : 1024;
+		while(allocated <= id)
+			allocated *= 2;
+
+		uint32_t *prev = (uint32_t *) realloc(lru->prev, allocated * sizeof *prev);
+		if(prev != NULL)
+			lru->prev = prev;
+		uint32_t *next = (uint32_t *) realloc(lru->next, allocated * sizeof *next);
+		if(next != NULL)
+			lru->next = next;
+		bool *cached = (bool *) realloc(lru->cached, allocated * sizeof *cached);
+		if(cached != NULL)
+			lru->cached = cached;
+		if(prev == NULL || next == NULL || cached == NULL)
+			return -1;
+		memset(lru->cached + lru->allocated, 0, (allocated - lru->allocated) * sizeof *cached);
+		lru->allocated = allocated;
+	}
+
+	if(lru->cached[id]) {
+		lruUnlink(lru, id);
+		lruPushFront(lru, id);
+		return 1;
+	}
+	if(lru->n_cached == capacity) {
+		uint32_t victim = lru->tail;
+		lruUnlink(lru, victim);
+		lru->cached[victim] = false;
+		lru->n_cached--;
+	}
+	lruPushFront(lru, id);
+	lru->cached[id] = true;
+	lru->n_cached++;
+	return 0;
+}
+
+
+int main(int argc, char const *argv[]) {
+	char *USAGE = "[USAGE]: <executable code> <trace file> [--capacity N] [--shards N]\n";
+
+	if(argc < 2) {
+		printf("%s", USAGE);
+		return 0;
+	}
+	for(int i = 2; i < argc; i++) {
+		long *option = NULL;
+
+		if(strcmp(argv[i], "--capacity") == 0)
+			option = &capacity;
+		else if(strcmp(argv[i], "--shards") == 0)
+			option = &n_shards;
+		if(option == NULL || i + 1 == argc || (*option = bench_parse_count(argv[++i])) < 0) {
+			printf("%s", USAGE);
+			return 0;
+		}
+	}
+	if((n_shards & (n_shards - 1)) != 0 || n_shards > capacity) {
+		printf("[ERROR]: --shards must be a power of two, at most the capacity\n");
+		return 0;
+	}
+
+	FILE *fp = fopen(argv[1], "r");
+	struct cache *cache = cache_create(capacity, n_shards);
+	struct name_table table = {NULL, NULL, 0, 0};
+	struct lru lru = {NULL, NULL, NULL, NO_KEY, NO_KEY, 0, 0};
+	if(fp == NULL) {
+		printf("[ERROR]: Unable to read %s\n", argv[1]);
+		return 1;
+	}
+	if(cache == NULL) {
+		printf("[ERROR]: Unable to allocate the cache\n");
+		return 1;
+	}
+
+	// Replaying every lookup through the proxies' cache, storing each miss as they do, and through the LRU
+	char *line = NULL, value[CACHE_VALUE_MAX];
+	size_t len = 0;
+	uint64_t n_requests = 0, n_skipped = 0, n_zipf = 0, cache_hits = 0, cache_zipf_hits = 0, lru_hits = 0, lru_zipf_hits = 0;
+	int64_t begin = bench_now_ns();
+	while(getline(&line, &len, fp) != -1) {
+		char *name = line + 2;
+		uint32_t ttl;
+
+		name[strcspn(name, " \t\r\n")] = '\0';
+		if((line[0] != 'z' && line[0] != 's') || line[1] != ' ' || *name == '\0' || strlen(name) >= CACHE_KEY_MAX) {
+			n_skipped++;
+			continue;
+		}
+
+		uint32_t id = tableIntern(&table, name);
+		int lru_hit = id == NO_KEY ? -1 : lruAccess(&lru, id);
+		if(lru_hit < 0) {
+			printf("[ERROR]: Out of memory after %llu requests\n", (unsigned long long) n_requests);
+			return 1;
+		}
+		bool cache_hit = cache_lookup(cache, OP_QUERY_NAME, name, value, &ttl) == CACHE_HIT;
+		if(!cache_hit)
+			cache_insert(cache, OP_QUERY_NAME, name, "10.1.2.3", TTL);
+
+		n_requests++;
+		cache_hits += cache_hit;
+		lru_hits += lru_hit;
+		if(line[0] == 'z') {
+			n_zipf++;
+			cache_zipf_hits += cache_hit;
+			lru_zipf_hits += lru_hit;
+		}
+		// The proxies' sweeper is also what ages the sketch. Nothing expires during a replay, so no entry needs a look
+		if(n_requests % SWEEP_EVERY == 0)
+			cache_sweep(cache, 0);
+	}
+	free(line);
+	fclose(fp);
+	if(n_requests == 0) {
+		printf("[ERROR]: No requests in %s\n", argv[1]);
+		return 1;
+	}
+
+	printf("[RESULT]: %llu requests (%llu skipped) for %u names, replayed in %.2f s, capacity %ld in %ld shard(s)\n",
+		(unsigned long long) n_requests, (unsigned long long) n_skipped, table.n_names, (bench_now_ns() - begin) / 1e9,
+		capacity, n_shards);
+	if(n_zipf > 0)
+		printf("[RESULT]: Hit ratio on the %llu z requests: cache %.4f, LRU %.4f\n", (unsigned long long) n_zipf,
+			(double) cache_zipf_hits / n_zipf, (double) lru_zipf_hits / n_zipf);
+	printf("[RESULT]: Hit ratio on all requests: cache %.4f, LRU %.4f\n", (double) cache_hits / n_requests,
+		(double) lru_hits / n_requests);
+	return 0;
+}
@@ -0,0 +1,1171 @@
+/*
+ * Pool of long-lived connections from a proxy to its DNS Servers
+ *
+ * Requests are framed with proto.h and carry an id, so any number of
+ * cache misses can share one connection. A query is submitted as an
+ * upstream_pending: the pool sends a copy of it (an attempt) on one of
+ * its connections and returns at once. The connection's reader thread
+ * matches the reply by id and calls the pending's done callback, so the
+ * submitter never waits for the round trip. upstream_query() is the
+ * blocking form, built on the same path.
+ *
+ * The pool holds one or more servers, each with its own connections. A
+ * query goes to the healthy server with the lowest smoothed latency. A
+ * server that keeps failing is marked down and left out until a probe
+ * query gets an answer from it again. A failed query is sent again to
+ * the next server it has not tried, and one still unanswered past its
+ * server's 99th percentile latency is hedged: a second copy goes to
+ * another server and whichever answers first completes the query.
+ *
+ * With use_udp a query goes out as a datagram first, and is sent again
+ * over TCP when no reply comes within UPSTREAM_UDP_TIMEOUT_MS. A timer
+ * thread expires overdue attempts, sends hedges and probes. A broken
+ * connection fails its attempts and is reopened by the next one sent.
+ *
+ * What counts against a server's health is a reply flagged as an error,
+ * a connect that fails, a connection it breaks (once, however many
+ * attempts were on it) and a tick's worth of late TCP replies. A lost
+ * datagram only sends the query over TCP.
+ *
+ * A connection carries at most UPSTREAM_CONN_MAX_ATTEMPTS attempts. A query
+ * that finds every connection to its server full waits in the server's
+ * backlog and is sent as soon as an attempt leaves; a hedge or a probe
+ * that finds no room is not sent at all.
+ *
+ * Sockets never block, and no lock is held across a connect or a send.
+ * A frame the socket has no room for waits in the connection's output
+ * buffer, which its reader writes out as the socket drains; a server that
+ * stops reading until the buffer is full breaks the connection.
+ *
+ * Callbacks run on the pool's threads without any of its locks held, or
+ * on the submitter's thread when no server can be reached at all.
+ *
+ * Connections and threads are started on first use. A child forked from a
+ * process whose pools are in use gets them back empty: every pool lock is
+ * taken across fork(), so the child sees no half-made change, and the
+ * child closes the sockets it inherited and opens its own when it first
+ * sends a query.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "proto.h"
+#include "logger.h"
+#include "stats.h"
+
+
+#define UPSTREAM_TIMEOUT_MS 2000
+#define UPSTREAM_UDP_TIMEOUT_MS 200
+#define UPSTREAM_CONNECT_TIMEOUT_MS 500
+#define UPSTREAM_TICK_MS 5
+#define UPSTREAM_MAX_SERVERS 16
+#define UPSTREAM_MAX_FAILURES 3
+#define UPSTREAM_PROBE_MS 500
+#define UPSTREAM_PROBE_NAME "upstream.health.check"
+#define UPSTREAM_HEDGE_MIN_US 2000
+#define UPSTREAM_HEDGE_DEFAULT_US 50000
+#define UPSTREAM_HEDGE_MIN_SAMPLES 64
+#define UPSTREAM_LATENCY_BUCKETS 32
+#define UPSTREAM_CONN_MAX_ATTEMPTS 256
+#define UPSTREAM_OUT_BUFFER 262144
+#define UPSTREAM_IN_BUFFER 16384
+#define UPSTREAM_MAX_POOLS 4
+
+
+struct upstream_pending;
+struct upstream_server;
+struct upstream_pool;
+
+// One copy of a query on one connection, a hedged query has two out at once
+struct upstream_attempt {
+	uint32_t request_id;
+	struct upstream_conn *conn;
+	int64_t sent_us;
+	int64_t deadline_us;
+	struct upstream_pending *pending;
+	struct upstream_attempt *next;
+};
+
+// One query to the DNS Servers, owned by the pool from submission until its done callback
+struct upstream_pending {
+	int opcode;
+	char request[MAX_FRAME_BODY + 1];
+	bool over_udp;
+	int status;
+	uint32_t ttl;
+	char reply[MAX_FRAME_BODY];
+	void (*done)(struct upstream_pending *pending);
+
+	// Kept by the pool: the first attempt to answer settles the query, the last one out completes it
+	struct upstream_pool *pool;
+	struct upstream_attempt attempts[2];
+	int refs;
+	bool settled;
+	bool hedged;
+	bool probe;
+	uint32_t tried;
+};
+
+// lock guards the attempts and the socket, write_lock what is written to it. write_lock is taken after lock
+// or alone, and only ever held around calls that do not block
+struct upstream_conn {
+	int fd;
+	bool datagram;
+	uint64_t generation;
+	pthread_mutex_t lock;
+	struct upstream_attempt *attempts;
+	int n_attempts;
+	struct upstream_server *server;
+
+	pthread_mutex_t write_lock;
+	int out_fd;
+	int wake_fd;
+	bool connected;
+	char *out;
+	size_t out_len;
+};
+
+struct upstream_server {
+	struct sockaddr_in address;
+	char name[32];
+	int index;
+	struct upstream_conn *conns;
+	struct upstream_conn udp;
+	unsigned int next_conn;
+	struct upstream_pool *pool;
+
+	// Attempts waiting for room on a connection, oldest first
+	pthread_mutex_t backlog_lock;
+	struct upstream_attempt *backlog_head;
+	struct upstream_attempt *backlog_tail;
+	int backlog_len;
+
+	// Latency of the answers, smoothed and as a histogram of power of two microseconds
+	int64_t ewma_us;
+	uint32_t latency[UPSTREAM_LATENCY_BUCKETS];
+	int64_t hedge_after_us;
+
+	bool healthy;
+	int failures;
+	bool probing;
+	struct upstream_pending probe;
+};
+
+struct upstream_pool {
+	struct upstream_server servers[UPSTREAM_MAX_SERVERS];
+	int n_servers;
+	int n_conns;
+	bool use_udp;
+	uint32_t next_request_id;
+	pthread_mutex_t lock;
+	bool timer_running;
+};
+
+// Every pool of the process, for the fork handlers
+static struct upstream_pool *upstream_pools[UPSTREAM_MAX_POOLS];
+static int upstream_n_pools;
+
+
+static inline void upstream_conn_lock(struct upstream_conn *conn) {
+	pthread_mutex_lock(&conn->lock);
+	pthread_mutex_lock(&conn->write_lock);
+}
+
+static inline void upstream_conn_unlock(struct upstream_conn *conn) {
+	pthread_mutex_unlock(&conn->write_lock);
+	pthread_mutex_unlock(&conn->lock);
+}
+
+// Holding every lock of every pool across fork(), in the order they are taken in. No lock of a pool is held
+// across a blocking call, so this waits no longer than the changes under way
+static inline void upstream_fork_prepare(void) {
+	for(int p = 0; p < upstream_n_pools; p++) {
+		struct upstream_pool *pool = upstream_pools[p];
+
+		pthread_mutex_lock(&pool->lock);
+		for(int i = 0; i < pool->n_servers; i++) {
+			struct upstream_server *server = &pool->servers[i];
+
+			pthread_mutex_lock(&server->backlog_lock);
+			upstream_conn_lock(&server->udp);
+			for(int j = 0; j < pool->n_conns; j++)
+				upstream_conn_lock(&server->conns[j]);
+		}
+	}
+}
+
+static inline void upstream_fork_parent(void) {
+	for(int p = upstream_n_pools - 1; p >= 0; p--) {
+		struct upstream_pool *pool = upstream_pools[p];
+
+		for(int i = pool->n_servers - 1; i >= 0; i--) {
+			struct upstream_server *server = &pool->servers[i];
+
+			for(int j = pool->n_conns - 1; j >= 0; j--)
+				upstream_conn_unlock(&server->conns[j]);
+			upstream_conn_unlock(&server->udp);
+			pthread_mutex_unlock(&server->backlog_lock);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+// The child has none of the readers and timer of its parent: the attempts in flight belong to the parent's
+// threads, and the sockets stay with the parent. A socket still in conn->fd has not been torn down,
+// so its wake_fd is still open too
+static inline void upstream_fork_conn(struct upstream_conn *conn) {
+	if(conn->fd >= 0) {
+		close(conn->fd);
+		if(conn->wake_fd >= 0)
+			close(conn->wake_fd);
+	}
+	conn->fd = -1;
+	conn->generation++;
+	conn->attempts = NULL;
+	conn->n_attempts = 0;
+	conn->out_fd = -1;
+	conn->wake_fd = -1;
+	conn->connected = false;
+	conn->out_len = 0;
+	upstream_conn_unlock(conn);
+}
+
+static inline void upstream_fork_child(void) {
+	for(int p = 0; p < upstream_n_pools; p++) {
+		struct upstream_pool *pool = upstream_pools[p];
+
+		for(int i = 0; i < pool->n_servers; i++) {
+			struct upstream_server *server = &pool->servers[i];
+
+			upstream_fork_conn(&server->udp);
+			for(int j = 0; j < pool->n_conns; j++)
+				upstream_fork_conn(&server->conns[j]);
+			server->backlog_head = NULL;
+			server->backlog_tail = NULL;
+			server->backlog_len = 0;
+			server->probing = false;
+			pthread_mutex_unlock(&server->backlog_lock);
+		}
+		pool->timer_running = false;
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+
+// Adding the servers of a comma separated list of "address[:port]", false if one cannot be parsed
+static inline bool upstream_init(struct upstream_pool *pool, const char *servers, int default_port, int n_conns) {
+	char *list = strdup(servers);
+	char *saveptr = NULL;
+
+	memset(pool, 0, sizeof *pool);
+	pool->n_conns = n_conns;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	for(char *entry = strtok_r(list, ",", &saveptr); entry != NULL; entry = strtok_r(NULL, ",", &saveptr)) {
+		struct upstream_server *server = &pool->servers[pool->n_servers];
+		char *colon = strchr(entry, ':');
+		int port = default_port;
+
+		if(colon != NULL) {
+			*colon = '\0';
+			port = atoi(colon + 1);
+		}
+		if(pool->n_servers == UPSTREAM_MAX_SERVERS || port < 1 || port > 65535
+				|| inet_pton(AF_INET, entry, &server->address.sin_addr) != 1) {
+			free(list);
+			return false;
+		}
+
+		server->address.sin_family = AF_INET;
+		server->address.sin_port = htons(port);
+		snprintf(server->name, sizeof server->name, "%s:%d", entry, port);
+		server->index = pool->n_servers++;
+		server->pool = pool;
+		server->healthy = true;
+		server->hedge_after_us = UPSTREAM_HEDGE_DEFAULT_US;
+		pthread_mutex_init(&server->backlog_lock, NULL);
+
+		server->conns = (struct upstream_conn *) calloc(n_conns, sizeof *server->conns);
+		for(int i = 0; i < n_conns; i++) {
+			server->conns[i].fd = -1;
+			server->conns[i].out_fd = -1;
+			server->conns[i].server = server;
+			pthread_mutex_init(&server->conns[i].lock, NULL);
+			pthread_mutex_init(&server->conns[i].write_lock, NULL);
+		}
+
+		server->udp.fd = -1;
+		server->udp.out_fd = -1;
+		server->udp.datagram = true;
+		server->udp.server = server;
+		pthread_mutex_init(&server->udp.lock, NULL);
+		pthread_mutex_init(&server->udp.write_lock, NULL);
+	}
+
+	free(list);
+	if(pool->n_servers == 0 || upstream_n_pools == UPSTREAM_MAX_POOLS)
+		return false;
+
+	if(upstream_n_pools == 0)
+		pthread_atfork(upstream_fork_prepare, upstream_fork_parent, upstream_fork_child);
+	upstream_pools[upstream_n_pools++] = pool;
+	return true;
+}
+
+
+static inline int64_t upstream_now_us(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+
+// Counting an answer from a server, which also brings a server marked down back
+static inline void upstream_record_answer(struct upstream_server *server, int64_t latency_us) {
+	int64_t ewma = __atomic_load_n(&server->ewma_us, __ATOMIC_RELAXED);
+	int bucket = 63 - __builtin_clzll((uint64_t) latency_us | 1);
+
+	__atomic_store_n(&server->ewma_us, ewma == 0 ? latency_us : ewma + (latency_us - ewma) / 8, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&server->latency[bucket < UPSTREAM_LATENCY_BUCKETS ? bucket : UPSTREAM_LATENCY_BUCKETS - 1], 1, __ATOMIC_RELAXED);
+	stats_observe(STAT_UPSTREAM_LATENCY, latency_us * 1000);
+
+	__atomic_store_n(&server->failures, 0, __ATOMIC_RELAXED);
+	if(!__atomic_exchange_n(&server->healthy, true, __ATOMIC_RELAXED))
+		log_info("[PROGRESS]: DNS Server %s is back up\n", server->name);
+}
+
+
+// Counting a failed attempt, enough of them in a row mark the server down
+static inline void upstream_record_failure(struct upstream_server *server) {
+	stats_count(STAT_UPSTREAM_ERRORS);
+	if(__atomic_add_fetch(&server->failures, 1, __ATOMIC_RELAXED) >= UPSTREAM_MAX_FAILURES
+			&& __atomic_exchange_n(&server->healthy, false, __ATOMIC_RELAXED))
+		log_error("[ERROR]: DNS Server %s is down\n", server->name);
+}
+
+
+// Picking the healthy server with the lowest latency among those not in tried,
+// or the fastest one left when they are all down. NULL once every server was tried
+static inline struct upstream_server *upstream_pick(struct upstream_pool *pool, uint32_t tried) {
+	struct upstream_server *best = NULL;
+	bool best_healthy = false;
+	int64_t best_ewma = 0;
+
+	for(int i = 0; i < pool->n_servers; i++) {
+		struct upstream_server *server = &pool->servers[i];
+		bool healthy = __atomic_load_n(&server->healthy, __ATOMIC_RELAXED);
+		int64_t ewma = __atomic_load_n(&server->ewma_us, __ATOMIC_RELAXED);
+
+		if(tried & (1u << i))
+			continue;
+		if(best == NULL || (healthy && !best_healthy) || (healthy == best_healthy && ewma < best_ewma)) {
+			best = server;
+			best_healthy = healthy;
+			best_ewma = ewma;
+		}
+	}
+	return best;
+}
+
+
+static inline struct upstream_conn *upstream_tcp(struct upstream_server *server) {
+	return &server->conns[__atomic_fetch_add(&server->next_conn, 1, __ATOMIC_RELAXED) % server->pool->n_conns];
+}
+
+
+static inline bool upstream_start(struct upstream_pending *pending, struct upstream_attempt *attempt, struct upstream_conn *conn, bool may_wait);
+static inline void upstream_resume(struct upstream_server *server);
+
+// Taking an attempt off its connection, false when it is not there (never sent, or already being completed)
+static inline bool upstream_cancel(struct upstream_attempt *attempt) {
+	struct upstream_conn *conn = __atomic_load_n(&attempt->conn, __ATOMIC_SEQ_CST);
+	bool found = false;
+
+	if(conn == NULL)
+		return false;
+
+	pthread_mutex_lock(&conn->lock);
+	for(struct upstream_attempt **link = &conn->attempts; *link; link = &(*link)->next) {
+		if(*link == attempt) {
+			*link = attempt->next;
+			conn->n_attempts--;
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&conn->lock);
+
+	if(found)
+		upstream_resume(conn->server);
+	return found;
+}
+
+// Sending a query again after all its attempts failed: over TCP after UDP, otherwise to the
+// next server it has not tried. Fails the query once there is none left
+static inline void upstream_retry(struct upstream_pending *pending) {
+	struct upstream_conn *last = pending->attempts[0].conn;
+	struct upstream_conn *conn = NULL;
+
+	if(!pending->probe) {
+		if(last->datagram) {
+			conn = upstream_tcp(last->server);
+		}
+		else {
+			struct upstream_server *server = upstream_pick(pending->pool, pending->tried);
+			if(server != NULL) {
+				stats_count(STAT_UPSTREAM_FAILOVERS);
+				conn = upstream_tcp(server);
+			}
+		}
+	}
+
+	if(conn == NULL) {
+		pending->status = -1;
+		pending->done(pending);
+		return;
+	}
+
+	pending->refs = 1;
+	pending->hedged = false;
+	upstream_start(pending, &pending->attempts[0], conn, true);
+}
+
+
+// Dropping the reference of one attempt: the last one completes a settled query or retries a failed one
+static inline void upstream_release(struct upstream_pending *pending) {
+	if(__atomic_sub_fetch(&pending->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	if(__atomic_load_n(&pending->settled, __ATOMIC_ACQUIRE))
+		pending->done(pending);
+	else
+		upstream_retry(pending);
+}
+
+
+// Completing an attempt taken off its connection, with status -1 when it failed. Called without any lock held,
+// the failure already counted against the server when it was one
+static inline void upstream_complete(struct upstream_attempt *attempt, int status, uint32_t ttl, const char *answer, size_t answer_len) {
+	struct upstream_pending *pending = attempt->pending;
+
+	if(status != -1 && !__atomic_exchange_n(&pending->settled, true, __ATOMIC_SEQ_CST)) {
+		if(answer_len >= MAX_FRAME_BODY)
+			answer_len = MAX_FRAME_BODY - 1;
+		memcpy(pending->reply, answer, answer_len);
+		pending->reply[answer_len] = '\0';
+		pending->ttl = ttl;
+		pending->status = status;
+
+		// The other copy of a hedged query is not needed anymore
+		struct upstream_attempt *other = &pending->attempts[attempt == &pending->attempts[0]];
+		if(upstream_cancel(other))
+			__atomic_sub_fetch(&pending->refs, 1, __ATOMIC_ACQ_REL);
+	}
+
+	upstream_release(pending);
+}
+
+
+// Failing every attempt of a broken connection into *failed, called with conn->lock held
+static inline void upstream_fail_locked(struct upstream_conn *conn, struct upstream_attempt **failed) {
+	// The reader owns the descriptor and closes it once it sees the shutdown
+	if(conn->fd >= 0) {
+		shutdown(conn->fd, SHUT_RDWR);
+		conn->fd = -1;
+	}
+	conn->generation++;
+
+	while(conn->attempts != NULL) {
+		struct upstream_attempt *attempt = conn->attempts;
+		conn->attempts = attempt->next;
+		attempt->next = *failed;
+		*failed = attempt;
+	}
+	conn->n_attempts = 0;
+}
+
+
+static inline void upstream_fail_all(struct upstream_attempt *list) {
+	while(list != NULL) {
+		struct upstream_attempt *attempt = list;
+		list = attempt->next;
+		upstream_complete(attempt, -1, 0, NULL, 0);
+	}
+}
+
+
+// Handing a reply to the attempt with the same id, if it is still waiting
+static inline void upstream_dispatch(struct upstream_conn *conn, const struct frame_header *frame, const char *body) {
+	struct upstream_attempt *attempt = NULL;
+
+	pthread_mutex_lock(&conn->lock);
+	for(struct upstream_attempt **link = &conn->attempts; *link; link = &(*link)->next) {
+		if((*link)->request_id == frame->request_id) {
+			attempt = *link;
+			*link = attempt->next;
+			conn->n_attempts--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&conn->lock);
+
+	if(attempt == NULL)
+		return;
+	upstream_resume(conn->server);
+
+	const char *answer = body;
+	size_t answer_len = frame->length;
+	uint32_t ttl = 0;
+	int status = frame_status(frame->flags);
+
+	if(status != -1)
+		upstream_record_answer(conn->server, upstream_now_us() - attempt->sent_us);
+	else
+		upstream_record_failure(conn->server);
+	frame_take_ttl(frame->flags, &answer, &answer_len, &ttl);
+	upstream_complete(attempt, status, ttl, answer, answer_len);
+}
+
+
+// Writing out what the output buffer holds until the socket is full, called with conn->write_lock held.
+// False when the connection is broken
+static inline bool upstream_flush_locked(struct upstream_conn *conn) {
+	size_t sent_total = 0;
+
+	while(sent_total < conn->out_len) {
+		ssize_t sent = send(conn->out_fd, conn->out + sent_total, conn->out_len - sent_total, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if(sent <= 0)
+			return false;
+		sent_total += sent;
+	}
+	memmove(conn->out, conn->out + sent_total, conn->out_len - sent_total);
+	conn->out_len -= sent_total;
+	return true;
+}
+
+
+// Writing the frame of an attempt registered on socket fd, unless the socket was torn down meanwhile and
+// the attempt failed with it. What the socket has no room for is left to the reader
+static inline void upstream_write(struct upstream_conn *conn, int fd, const char *frame, size_t frame_len) {
+	pthread_mutex_lock(&conn->write_lock);
+	if(conn->out_fd != fd) {
+		pthread_mutex_unlock(&conn->write_lock);
+		return;
+	}
+
+	// A datagram the socket has no room for is lost like any other, and sent again over TCP
+	if(conn->datagram) {
+		send(fd, frame, frame_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+		pthread_mutex_unlock(&conn->write_lock);
+		return;
+	}
+
+	// A server that stopped reading for a whole buffer is broken, its reader then fails the attempts
+	bool idle = conn->out_len == 0;
+	if(conn->out_len + frame_len > UPSTREAM_OUT_BUFFER) {
+		shutdown(fd, SHUT_RDWR);
+		pthread_mutex_unlock(&conn->write_lock);
+		return;
+	}
+	memcpy(conn->out + conn->out_len, frame, frame_len);
+	conn->out_len += frame_len;
+
+	if(conn->connected) {
+		if(!upstream_flush_locked(conn)) {
+			shutdown(fd, SHUT_RDWR);
+		}
+		else if(idle && conn->out_len > 0) {
+			// The reader only waits for room in the socket when told there is something left to write
+			uint64_t wake = 1;
+			if(write(conn->wake_fd, &wake, sizeof wake) < 0)
+				log_debug("[ERROR]: Unable to wake the upstream reader\n");
+		}
+	}
+	pthread_mutex_unlock(&conn->write_lock);
+}
+
+
+struct upstream_reader_args {
+	struct upstream_conn *conn;
+	int fd;
+	int wake_fd;
+	uint64_t generation;
+};
+
+// Waiting for a TCP connection opened without blocking to be established
+static inline bool upstream_await_connect(int fd) {
+	struct pollfd writable = {fd, POLLOUT, 0};
+	int error = 0;
+	socklen_t error_len = sizeof error;
+
+	if(poll(&writable, 1, UPSTREAM_CONNECT_TIMEOUT_MS) <= 0)
+		return false;
+	return getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 && error == 0;
+}
+
+
+// Flushing the output buffer once the socket is established or has room again, false when it is broken
+static inline bool upstream_reader_flush(struct upstream_conn *conn, int fd) {
+	bool up = true;
+
+	pthread_mutex_lock(&conn->write_lock);
+	if(conn->out_fd == fd) {
+		conn->connected = true;
+		up = upstream_flush_locked(conn);
+	}
+	pthread_mutex_unlock(&conn->write_lock);
+	return up;
+}
+
+
+// Dispatching the replies of one connection to their attempts, and writing out what its senders left behind
+static inline void *upstream_reader(void *args) {
+	struct upstream_reader_args reader = *(struct upstream_reader_args *) args;
+	struct upstream_conn *conn = reader.conn;
+	char buf[UPSTREAM_IN_BUFFER];
+	size_t buf_len = 0;
+	bool up = true;
+
+	free(args);
+	pthread_detach(pthread_self());
+
+	if(!conn->datagram)
+		up = upstream_await_connect(reader.fd) && upstream_reader_flush(conn, reader.fd);
+
+	while(up) {
+		struct pollfd fds[2] = {{reader.fd, POLLIN, 0}, {reader.wake_fd, POLLIN, 0}};
+		struct frame_header frame;
+		const char *body;
+
+		if(!conn->datagram) {
+			pthread_mutex_lock(&conn->write_lock);
+			if(conn->out_fd == reader.fd && conn->out_len > 0)
+				fds[0].events |= POLLOUT;
+			pthread_mutex_unlock(&conn->write_lock);
+		}
+		if(poll(fds, conn->datagram ? 1 : 2, -1) < 0) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+
+		if(fds[1].revents & POLLIN) {
+			uint64_t wakes;
+			if(read(reader.wake_fd, &wakes, sizeof wakes) < 0 && errno != EAGAIN)
+				break;
+		}
+		if((fds[0].revents & POLLOUT) && !upstream_reader_flush(conn, reader.fd))
+			break;
+		if((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+			continue;
+
+		if(conn->datagram) {
+			// A datagram is one whole frame, anything else is dropped
+			ssize_t got = recv(reader.fd, buf, sizeof buf, 0);
+			size_t offset = 0;
+			if(got < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+				continue;
+			if(got <= 0)
+				break;
+			if(frame_parse(buf, got, &offset, &frame, &body) == 1)
+				upstream_dispatch(conn, &frame, body);
+			continue;
+		}
+
+		ssize_t got = recv(reader.fd, buf + buf_len, sizeof buf - buf_len, 0);
+		size_t offset = 0;
+		int parsed;
+		if(got < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+			continue;
+		if(got <= 0)
+			break;
+		buf_len += got;
+
+		while((parsed = frame_parse(buf, buf_len, &offset, &frame, &body)) == 1)
+			upstream_dispatch(conn, &frame, body);
+		if(parsed < 0)
+			break;
+		memmove(buf, buf + offset, buf_len - offset);
+		buf_len -= offset;
+	}
+
+	// Senders stop writing to the socket before it is closed
+	pthread_mutex_lock(&conn->write_lock);
+	if(conn->out_fd == reader.fd) {
+		conn->out_fd = -1;
+		conn->out_len = 0;
+		conn->connected = false;
+	}
+	pthread_mutex_unlock(&conn->write_lock);
+
+	// Only the reader of the current socket may tear it down
+	struct upstream_attempt *failed = NULL;
+	pthread_mutex_lock(&conn->lock);
+	if(conn->generation == reader.generation)
+		upstream_fail_locked(conn, &failed);
+	pthread_mutex_unlock(&conn->lock);
+	close(reader.fd);
+	if(reader.wake_fd >= 0)
+		close(reader.wake_fd);
+
+	if(failed != NULL)
+		upstream_record_failure(conn->server);
+	upstream_fail_all(failed);
+	upstream_resume(conn->server);
+	return NULL;
+}
+
+
+// Opening the connection without waiting for it and starting its reader, called with conn->lock held
+static inline bool upstream_connect_locked(struct upstream_conn *conn) {
+	int fd = socket(AF_INET, (conn->datagram ? SOCK_DGRAM : SOCK_STREAM) | SOCK_NONBLOCK, 0);
+	int wake_fd = -1;
+	if(fd < 0)
+		return false;
+
+	// Only datagrams from the DNS Server are delivered on a connected socket
+	if(connect(fd, (const struct sockaddr *) &conn->server->address, sizeof conn->server->address) < 0 && errno != EINPROGRESS) {
+		close(fd);
+		return false;
+	}
+
+	if(!conn->datagram) {
+		int nodelay = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
+		if(conn->out == NULL)
+			conn->out = (char *) malloc(UPSTREAM_OUT_BUFFER);
+		wake_fd = eventfd(0, EFD_NONBLOCK);
+		if(conn->out == NULL || wake_fd < 0) {
+			if(wake_fd >= 0)
+				close(wake_fd);
+			close(fd);
+			return false;
+		}
+	}
+
+	pthread_t reader_id;
+	struct upstream_reader_args *args = (struct upstream_reader_args *) malloc(sizeof *args);
+	if(args == NULL) {
+		if(wake_fd >= 0)
+			close(wake_fd);
+		close(fd);
+		return false;
+	}
+
+	conn->fd = fd;
+	conn->generation++;
+	pthread_mutex_lock(&conn->write_lock);
+	conn->out_fd = fd;
+	conn->wake_fd = wake_fd;
+	conn->connected = false;
+	conn->out_len = 0;
+	pthread_mutex_unlock(&conn->write_lock);
+
+	args->conn = conn;
+	args->fd = fd;
+	args->wake_fd = wake_fd;
+	args->generation = conn->generation;
+	if(pthread_create(&reader_id, NULL, upstream_reader, args) != 0) {
+		free(args);
+		pthread_mutex_lock(&conn->write_lock);
+		conn->out_fd = -1;
+		pthread_mutex_unlock(&conn->write_lock);
+		conn->fd = -1;
+		conn->generation++;
+		if(wake_fd >= 0)
+			close(wake_fd);
+		close(fd);
+		return false;
+	}
+	return true;
+}
+
+
+// Putting an attempt on conn unless it already carries UPSTREAM_CONN_MAX_ATTEMPTS. Returns the socket to write
+// its frame to, -1 when conn is full and -2 when it cannot be opened
+static inline int upstream_register(struct upstream_conn *conn, struct upstream_attempt *attempt) {
+	pthread_mutex_lock(&conn->lock);
+	if(conn->n_attempts >= UPSTREAM_CONN_MAX_ATTEMPTS) {
+		pthread_mutex_unlock(&conn->lock);
+		return -1;
+	}
+	if(conn->fd < 0 && !upstream_connect_locked(conn)) {
+		pthread_mutex_unlock(&conn->lock);
+		return -2;
+	}
+
+	attempt->sent_us = upstream_now_us();
+	attempt->deadline_us = attempt->sent_us + (conn->datagram ? UPSTREAM_UDP_TIMEOUT_MS : UPSTREAM_TIMEOUT_MS) * 1000LL;
+	attempt->next = conn->attempts;
+	conn->attempts = attempt;
+	conn->n_attempts++;
+	int fd = conn->fd;
+	pthread_mutex_unlock(&conn->lock);
+	return fd;
+}
+
+
+// Sending an attempt on conn, or else on any connection of its server with room (over TCP when the datagram
+// socket is full). False when they are all full
+static inline bool upstream_place(struct upstream_attempt *attempt, struct upstream_conn *conn) {
+	struct upstream_pending *pending = attempt->pending;
+	struct upstream_server *server = conn->server;
+	char frame[MAX_FRAME_LEN];
+	size_t frame_len = frame_encode(frame, attempt->request_id, pending->opcode, 0, pending->request, strlen(pending->request));
+
+	for(int tries = 0; tries <= server->pool->n_conns; tries++) {
+		if(tries > 0)
+			conn = upstream_tcp(server);
+		__atomic_store_n(&attempt->conn, conn, __ATOMIC_SEQ_CST);
+		if(!conn->datagram)
+			pending->tried |= 1u << server->index;
+
+		int fd = upstream_register(conn, attempt);
+		if(fd == -2) {
+			upstream_record_failure(server);
+			upstream_complete(attempt, -1, 0, NULL, 0);
+			return true;
+		}
+		if(fd >= 0) {
+			// The attempt may be completed by now, but its frame is our own copy
+			upstream_write(conn, fd, frame, frame_len);
+			return true;
+		}
+	}
+	return false;
+}
+
+
+// Sending one copy of a query on conn, the reference it holds on the query already taken. When every
+// connection of the server is full it waits in the backlog if may_wait, or else is not sent and false returned
+static inline bool upstream_start(struct upstream_pending *pending, struct upstream_attempt *attempt, struct upstream_conn *conn, bool may_wait) {
+	struct upstream_server *server = conn->server;
+
+	attempt->pending = pending;
+	attempt->request_id = __atomic_add_fetch(&pending->pool->next_request_id, 1, __ATOMIC_RELAXED);
+	if(upstream_place(attempt, conn))
+		return true;
+	if(!may_wait)
+		return false;
+
+	pthread_mutex_lock(&server->backlog_lock);
+	attempt->next = NULL;
+	if(server->backlog_tail != NULL)
+		server->backlog_tail->next = attempt;
+	else
+		server->backlog_head = attempt;
+	server->backlog_tail = attempt;
+	__atomic_add_fetch(&server->backlog_len, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&server->backlog_lock);
+
+	// An attempt may have left since, before there was anything in the backlog to send in its place
+	upstream_resume(server);
+	return true;
+}
+
+
+// Sending what waits in the backlog of a server while its connections have room, called after an attempt
+// leaves one of them
+static inline void upstream_resume(struct upstream_server *server) {
+	while(__atomic_load_n(&server->backlog_len, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&server->backlog_lock);
+		struct upstream_attempt *attempt = server->backlog_head;
+		if(attempt != NULL) {
+			server->backlog_head = attempt->next;
+			if(server->backlog_head == NULL)
+				server->backlog_tail = NULL;
+			__atomic_sub_fetch(&server->backlog_len, 1, __ATOMIC_SEQ_CST);
+		}
+		pthread_mutex_unlock(&server->backlog_lock);
+		if(attempt == NULL)
+			return;
+
+		if(upstream_place(attempt, upstream_tcp(server)))
+			continue;
+
+		// Still full, the next attempt to leave sends it
+		pthread_mutex_lock(&server->backlog_lock);
+		attempt->next = server->backlog_head;
+		server->backlog_head = attempt;
+		if(server->backlog_tail == NULL)
+			server->backlog_tail = attempt;
+		__atomic_add_fetch(&server->backlog_len, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&server->backlog_lock);
+		return;
+	}
+}
+
+
+// Sending a second copy of a slow query to another server, with a reference already taken for it
+static inline void upstream_hedge(struct upstream_pending *pending) {
+	struct upstream_server *server = upstream_pick(pending->pool, pending->tried | (1u << pending->attempts[0].conn->server->index));
+
+	if(server == NULL || __atomic_load_n(&pending->settled, __ATOMIC_SEQ_CST)) {
+		upstream_release(pending);
+		return;
+	}
+
+	// Holding on to the query while checking whether the first copy was answered meanwhile
+	__atomic_add_fetch(&pending->refs, 1, __ATOMIC_ACQ_REL);
+	if(!upstream_start(pending, &pending->attempts[1], upstream_tcp(server), false)) {
+		upstream_release(pending);
+	}
+	else {
+		stats_count(STAT_UPSTREAM_HEDGES);
+		if(__atomic_load_n(&pending->settled, __ATOMIC_SEQ_CST) && upstream_cancel(&pending->attempts[1]))
+			upstream_release(pending);
+	}
+	upstream_release(pending);
+}
+
+
+static inline void upstream_reset(struct upstream_pool *pool, struct upstream_pending *pending) {
+	pending->pool = pool;
+	pending->status = -1;
+	pending->ttl = 0;
+	pending->refs = 1;
+	pending->settled = false;
+	pending->hedged = false;
+	pending->tried = 0;
+	pending->attempts[1].conn = NULL;
+}
+
+
+static inline void upstream_probed(struct upstream_pending *pending) {
+	struct upstream_server *server = pending->attempts[0].conn->server;
+
+	__atomic_store_n(&server->probing, false, __ATOMIC_RELEASE);
+}
+
+
+// Sending a probe query to a server marked down, any answer brings it back
+static inline void upstream_probe(struct upstream_server *server) {
+	struct upstream_pending *probe = &server->probe;
+
+	if(__atomic_exchange_n(&server->probing, true, __ATOMIC_ACQ_REL))
+		return;
+
+	upstream_reset(server->pool, probe);
+	probe->opcode = OP_QUERY_NAME;
+	strcpy(probe->request, UPSTREAM_PROBE_NAME);
+	probe->over_udp = false;
+	probe->probe = true;
+	probe->done = upstream_probed;
+	if(!upstream_start(probe, &probe->attempts[0], upstream_tcp(server), false))
+		__atomic_store_n(&server->probing, false, __ATOMIC_RELEASE);
+}
+
+
+// Setting the hedging delay of a server to the 99th percentile of its recent answers.
+// The histogram is halved each time, so that old answers fade out
+static inline void upstream_update_hedge(struct upstream_server *server) {
+	uint32_t counts[UPSTREAM_LATENCY_BUCKETS];
+	uint64_t total = 0, seen = 0;
+	int bucket;
+
+	for(bucket = 0; bucket < UPSTREAM_LATENCY_BUCKETS; bucket++) {
+		counts[bucket] = __atomic_load_n(&server->latency[bucket], __ATOMIC_RELAXED);
+		__atomic_fetch_sub(&server->latency[bucket], counts[bucket] / 2, __ATOMIC_RELAXED);
+		total += counts[bucket];
+	}
+	if(total < UPSTREAM_HEDGE_MIN_SAMPLES)
+		return;
+
+	for(bucket = 0; bucket < UPSTREAM_LATENCY_BUCKETS - 1; bucket++) {
+		seen += counts[bucket];
+		if(seen * 100 >= total * 99)
+			break;
+	}
+
+	int64_t hedge_after_us = 2LL << bucket;
+	__atomic_store_n(&server->hedge_after_us, hedge_after_us > UPSTREAM_HEDGE_MIN_US ? hedge_after_us : UPSTREAM_HEDGE_MIN_US, __ATOMIC_RELAXED);
+}
+
+
+// Going over the attempts of one connection: a late attempt is failed, which retries a datagram over TCP
+// and a TCP query on the next server, and a query slower than its server's 99th percentile is hedged
+static inline void upstream_tick(struct upstream_conn *conn, int64_t now) {
+	struct upstream_pool *pool = conn->server->pool;
+	int64_t hedge_after_us = __atomic_load_n(&conn->server->hedge_after_us, __ATOMIC_RELAXED);
+	struct upstream_pending *hedges[64];
+	struct upstream_attempt *expired = NULL;
+	int n_hedges = 0, n_expired = 0;
+
+	pthread_mutex_lock(&conn->lock);
+	for(struct upstream_attempt **link = &conn->attempts; *link; ) {
+		struct upstream_attempt *attempt = *link;
+		struct upstream_pending *pending = attempt->pending;
+
+		if(attempt->deadline_us <= now) {
+			*link = attempt->next;
+			conn->n_attempts--;
+			attempt->next = expired;
+			expired = attempt;
+			n_expired++;
+			continue;
+		}
+
+		// The attempt is on the list, so its query is still held and cannot complete meanwhile
+		if(pool->n_servers > 1 && n_hedges < 64 && !pending->probe && !pending->hedged
+				&& attempt == &pending->attempts[0] && now - attempt->sent_us > hedge_after_us) {
+			pending->hedged = true;
+			__atomic_add_fetch(&pending->refs, 1, __ATOMIC_ACQ_REL);
+			hedges[n_hedges++] = pending;
+		}
+		link = &attempt->next;
+	}
+	pthread_mutex_unlock(&conn->lock);
+
+	// However many replies are late, the server failed once
+	if(n_expired > 0 && !conn->datagram)
+		upstream_record_failure(conn->server);
+	upstream_fail_all(expired);
+	if(n_expired > 0)
+		upstream_resume(conn->server);
+	for(int i = 0; i < n_hedges; i++)
+		upstream_hedge(hedges[i]);
+}
+
+
+static inline void *upstream_timer(void *args) {
+	struct upstream_pool *pool = (struct upstream_pool *) args;
+	int64_t next_probe = upstream_now_us();
+
+	pthread_detach(pthread_self());
+
+	while(1) {
+		struct timespec tick = {0, UPSTREAM_TICK_MS * 1000000L};
+		nanosleep(&tick, NULL);
+		int64_t now = upstream_now_us();
+
+		for(int i = 0; i < pool->n_servers; i++) {
+			struct upstream_server *server = &pool->servers[i];
+
+			upstream_tick(&server->udp, now);
+			for(int j = 0; j < pool->n_conns; j++)
+				upstream_tick(&server->conns[j], now);
+		}
+
+		if(now < next_probe)
+			continue;
+		next_probe = now + UPSTREAM_PROBE_MS * 1000LL;
+
+		for(int i = 0; i < pool->n_servers; i++) {
+			upstream_update_hedge(&pool->servers[i]);
+			if(!__atomic_load_n(&pool->servers[i].healthy, __ATOMIC_RELAXED))
+				upstream_probe(&pool->servers[i]);
+		}
+	}
+	return NULL;
+}
+
+
+// Sending a query whose opcode, request and done callback are set; done is called exactly once
+static inline void upstream_submit(struct upstream_pool *pool, struct upstream_pending *pending) {
+	if(!__atomic_load_n(&pool->timer_running, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&pool->lock);
+		if(!pool->timer_running) {
+			pthread_t timer_id;
+			__atomic_store_n(&pool->timer_running, pthread_create(&timer_id, NULL, upstream_timer, pool) == 0, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	struct upstream_server *server = upstream_pick(pool, 0);
+
+	upstream_reset(pool, pending);
+	pending->probe = false;
+	upstream_start(pending, &pending->attempts[0], pending->over_udp ? &server->udp : upstream_tcp(server), true);
+}
+
+
+// Starting a query that goes over UDP first when the pool allows it
+static inline bool upstream_prepare(struct upstream_pool *pool, struct upstream_pending *pending, int opcode, const char *request) {
+	if(strlen(request) > MAX_FRAME_BODY)
+		return false;
+	pending->opcode = opcode;
+	strcpy(pending->request, request);
+	pending->over_udp = pool->use_udp;
+	return true;
+}
+
+
+// A caller sleeping until its query completes
+struct upstream_sync {
+	struct upstream_pending pending;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool done;
+};
+
+static inline void upstream_wake(struct upstream_pending *pending) {
+	struct upstream_sync *sync = (struct upstream_sync *) pending;
+
+	pthread_mutex_lock(&sync->lock);
+	sync->done = true;
+	pthread_cond_signal(&sync->cond);
+	pthread_mutex_unlock(&sync->lock);
+}
+
+
+// Sending one query and waiting for it, returns STATUS_FOUND or STATUS_NOT_FOUND with the answer in reply
+// and its time to live in *ttl (0 when the server sent none), or -1
+static inline int upstream_query(struct upstream_pool *pool, int opcode, const char *request, char *reply, uint32_t *ttl) {
+	struct upstream_sync sync;
+
+	memset(&sync, 0, sizeof sync);
+	if(!upstream_prepare(pool, &sync.pending, opcode, request))
+		return -1;
+	sync.pending.done = upstream_wake;
+	pthread_mutex_init(&sync.lock, NULL);
+	pthread_cond_init(&sync.cond, NULL);
+
+	upstream_submit(pool, &sync.pending);
+
+	pthread_mutex_lock(&sync.lock);
+	while(!sync.done)
+		pthread_cond_wait(&sync.cond, &sync.lock);
+	pthread_mutex_unlock(&sync.lock);
+
+	pthread_cond_destroy(&sync.cond);
+	pthread_mutex_destroy(&sync.lock);
+
+	if(sync.pending.status != -1)
+		strcpy(reply, sync.pending.reply);
+	*ttl = sync.pending.ttl;
+	return sync.pending.status;
+}
+
+
+// Writing the state of every server after the stats_write() metrics
+static inline void upstream_write_stats(struct upstream_pool *pool, FILE *out) {
+	fprintf(out, "# TYPE dns_upstream_up gauge\n");
+	for(int i = 0; i < pool->n_servers; i++)
+		fprintf(out, "dns_upstream_up{server=\"%s\"} %d\n", pool->servers[i].name,
+			__atomic_load_n(&pool->servers[i].healthy, __ATOMIC_RELAXED) ? 1 : 0);
+
+	fprintf(out, "# TYPE dns_upstream_smoothed_latency_seconds gauge\n");
+	for(int i = 0; i < pool->n_servers; i++)
+		fprintf(out, "dns_upstream_smoothed_latency_seconds{server=\"%s\"} %.6f\n", pool->servers[i].name,
+			__atomic_load_n(&pool->servers[i].ewma_us, __ATOMIC_RELAXED) / 1e6);
+}